@@ -0,0 +1,731 @@
+/*
+ * AllocatorApiDriver.c - checks the mm entry points that the traces of
+ *     mdriver do not reach: mm_memalign, mm_calloc, mm_malloc_batch,
+ *     mm_free_batch and mm_free_sized, mm_snapshot and mm_restore, and
+ *     mm_check on heaps it must find corrupted
+ *
+ * Each check starts from an empty heap and prints an ERROR line for
+ * every problem it finds; the exit status is nonzero if there was one.
+ * The corrupted heaps are made by writing to the boundary tags and links
+ * of mm.c's default layout (no COMPACT_HEADERS). Built with MM_HARDEN, as
+ * mdriver-api-harden is, the canaries are checked too.
+ *
+ * A snapshot is restored by running the driver again as
+ * "mdriver-api -R <file>" in a new process, as a program restarting
+ * from its snapshot would.
+ */
+#include "mm.h"
+#include "memlib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#ifndef MM_HARDEN
+#define MM_HARDEN 0
+#endif
+
+#define MAX_BLOCKS 64
+#define MAX_BATCH 32768 /* blocks of the batch that runs out of heap */
+#define SNAPSHOT_NODES 1000
+
+/* A list in the heap that mm_snapshot saves, from its root */
+typedef struct node {
+  struct node* next;
+  size_t index;
+  size_t size;     /* bytes of the node, which fill the rest with index */
+} node;
+
+typedef struct snapshot_root {
+  node* list;
+  size_t in_use;   /* mm_stats in_use_bytes when the snapshot was taken */
+} snapshot_root;
+
+static int errors = 0;
+
+static void check_memalign(void);
+static void check_calloc(void);
+static void check_batch(void);
+static void check_batch_sizes(size_t size);
+static void check_free_sized(void);
+static void check_batch_limit(size_t size);
+static void check_heap_checker(void);
+static void check_snapshot(const char* self);
+static void check_restore(const char* file);
+
+static void usage(void);
+static void reset_heap(void);
+static void error(const char* test, const char* msg);
+static int is_zero(const char* p, size_t size);
+static size_t* header_of(void* p);
+static size_t* last_word_of(void* p);
+static int check_quietly(void);
+
+int main(int argc, char** argv) {
+  char* restore_file = NULL;
+  int c;
+
+  while ((c = getopt(argc, argv, "R:h")) != EOF) {
+    switch (c) {
+      case 'R': restore_file = optarg; break;
+      case 'h': usage(); return 0;
+      default: usage(); return 1;
+    }
+  }
+
+  /* Initialize the simulated memory system in memlib.c */
+  mem_init();
+
+  if (restore_file != NULL) {
+    check_restore(restore_file);
+    return errors != 0;
+  }
+
+  check_memalign();
+  check_calloc();
+  check_batch();
+  check_heap_checker();
+  check_snapshot(argv[0]);
+
+  mem_deinit();
+  if (errors != 0) {
+    printf("Terminated with %d errors\n", errors);
+    return 1;
+  }
+  printf("Success! The allocator passed all of the API tests\n");
+  return 0;
+}
+
+/*
+ * check_memalign - Every power of two from the payload alignment up to
+ *     1 MB gives an aligned block that can be filled, zero sizes and other
+ *     alignments give NULL, and the space in front of an aligned block goes
+ *     back to the free list
+ */
+static void check_memalign(void) {
+  char* blocks[MAX_BLOCKS];
+  size_t sizes[MAX_BLOCKS];
+  size_t align;
+  char* p;
+  char* q;
+  int n = 0;
+  int i;
+
+  reset_heap();
+  for (align = sizeof(void*); align <= (1 << 20); align *= 2) {
+    sizes[n] = 1 + (n * 997) % 3000;
+    blocks[n] = mm_memalign(align, sizes[n]);
+    if (blocks[n] == NULL || (uintptr_t) blocks[n] % align != 0) {
+      error("memalign", "a block is not aligned");
+      return;
+    }
+    memset(blocks[n], n + 1, sizes[n]);
+    n++;
+  }
+  /* The blocks did not overlap if none was overwritten */
+  for (i = 0; i < n; i++) {
+    for (p = blocks[i]; p < blocks[i] + sizes[i]; p++) {
+      if (*p != (char) (i + 1)) {
+        error("memalign", "a block was overwritten by another");
+        break;
+      }
+    }
+  }
+  if (mm_check() != 0) {
+    error("memalign", "mm_check failed");
+  }
+  for (i = 0; i < n; i++) {
+    mm_free(blocks[i]);
+  }
+
+  if (mm_memalign(24, 100) != NULL || mm_memalign(0, 100) != NULL ||
+      mm_memalign(64, 0) != NULL) {
+    error("memalign", "a bad alignment or a zero size did not give NULL");
+  }
+
+  /* On an empty heap, the block the aligned one is split from starts just
+     after the prologue, on the page the heap starts on, so the block in
+     front of it has room for 1000 bytes. Blocks of that size fill the free
+     space until one of them lands there. */
+  reset_heap();
+  p = mm_memalign(1 << 16, 100);
+  for (n = 0; n < MAX_BLOCKS; n++) {
+    blocks[n] = q = mm_malloc(1000);
+    if (q == NULL || q < p) {
+      break;
+    }
+  }
+  if (p == NULL || n == MAX_BLOCKS || blocks[n] == NULL) {
+    error("memalign", "the space in front of an aligned block was not reused");
+  }
+  for (i = 0; i < n + (n < MAX_BLOCKS); i++) {
+    mm_free(blocks[i]);
+  }
+  mm_free(p);
+  if (mm_check() != 0) {
+    error("memalign", "mm_check failed");
+  }
+}
+
+/*
+ * check_calloc - mm_calloc clears blocks that reuse written memory, both
+ *     freed blocks and a heap reset over dirty pages, as well as new heap
+ *     pages and directly mapped blocks, and gives NULL when nmemb * size
+ *     overflows
+ */
+static void check_calloc(void) {
+  char* blocks[MAX_BLOCKS];
+  size_t size;
+  char* p;
+  char* q;
+  int i;
+  int round;
+
+  /* A freed block that is still dirty */
+  reset_heap();
+  p = mm_malloc(5000);
+  memset(p, 0xff, 5000);
+  mm_free(p);
+  q = mm_calloc(50, 100);
+  if (q != p) {
+    error("calloc", "the freed block was not reused, so its clearing is "
+          "not checked");
+  }
+  if (q == NULL || !is_zero(q, 5000)) {
+    error("calloc", "a reused block is not zero");
+  }
+  mm_free(q);
+
+  /* Blocks of many sizes carved out of dirty free space */
+  for (round = 0; round < 20; round++) {
+    for (i = 0; i < MAX_BLOCKS; i++) {
+      size = 1 + (i * 7919 + round * 104729) % 20000;
+      blocks[i] = mm_malloc(size);
+      memset(blocks[i], 0xa5, size);
+    }
+    for (i = 0; i < MAX_BLOCKS; i += 2) {
+      mm_free(blocks[i]);
+    }
+    for (i = 0; i < MAX_BLOCKS; i += 2) {
+      size = 1 + (i * 104729 + round * 7919) % 20000;
+      blocks[i] = mm_calloc(1, size);
+      if (blocks[i] == NULL || !is_zero(blocks[i], size)) {
+        error("calloc", "a block carved from dirty free space is not zero");
+      }
+    }
+    for (i = 0; i < MAX_BLOCKS; i++) {
+      mm_free(blocks[i]);
+    }
+  }
+  if (mm_check() != 0) {
+    error("calloc", "mm_check failed");
+  }
+
+  /* A heap that was reset over pages it had written: below the highest brk
+     so far the memory is dirty, above it new pages are zero */
+  mm_set_mmap_threshold(0);
+  reset_heap();
+  p = mm_malloc(4 << 20);
+  memset(p, 0xff, 4 << 20);
+  reset_heap();
+  p = mm_calloc(1, 8 << 20);
+  if (p == NULL || !is_zero(p, 8 << 20)) {
+    error("calloc", "a block over a reset heap and new pages is not zero");
+  }
+  mm_free(p);
+  reset_heap();
+  mm_set_mmap_threshold(256 * 1024);
+
+  /* A directly mapped block */
+  p = mm_calloc(1024, 1024);
+  if (p == NULL || !is_zero(p, 1 << 20)) {
+    error("calloc", "a directly mapped block is not zero");
+  }
+  mm_free(p);
+
+  if (mm_calloc(SIZE_MAX / 2 + 1, 2) != NULL ||
+      mm_calloc((size_t) 1 << 33, (size_t) 1 << 32) != NULL ||
+      mm_calloc(0, 100) != NULL || mm_calloc(100, 0) != NULL) {
+    error("calloc", "an overflowing or zero size did not give NULL");
+  }
+}
+
+/*
+ * check_batch - mm_malloc_batch gives aligned blocks that do not overlap for
+ *     heap, slab and directly mapped sizes, mm_free_batch coalesces them,
+ *     mm_free_sized leaves the heap as mm_free does, and a batch larger than
+ *     the heap gives the blocks that fit
+ */
+static void check_batch(void) {
+  char* blocks[MAX_BLOCKS];
+  char* odd[MAX_BLOCKS / 2];
+  char* even[MAX_BLOCKS / 2];
+  struct mm_stats stats;
+  size_t max_heap;
+  int i;
+
+  check_batch_sizes(16);
+  check_batch_sizes(1000);
+  check_batch_sizes(300 * 1024);
+
+  /* Every other block has used neighbours, then the rest join them */
+  reset_heap();
+  if (mm_malloc_batch(1000, MAX_BLOCKS, (void**) blocks) != MAX_BLOCKS) {
+    error("batch", "mm_malloc_batch did not allocate the whole batch");
+    return;
+  }
+  for (i = 0; i < MAX_BLOCKS / 2; i++) {
+    odd[i] = blocks[2 * i + 1];
+    even[i] = blocks[2 * i];
+  }
+  mm_free_batch((void**) odd, MAX_BLOCKS / 2);
+  mm_stats(&stats);
+  if (stats.free_blocks < MAX_BLOCKS / 2) {
+    error("batch", "blocks with used neighbours were merged");
+  }
+  mm_free_batch((void**) even, MAX_BLOCKS / 2);
+  mm_stats(&stats);
+  if (stats.free_blocks != 1 || stats.largest_free < MAX_BLOCKS * 1000) {
+    error("batch", "mm_free_batch did not coalesce its blocks into one");
+  }
+  if (mm_check() != 0) {
+    error("batch", "mm_check failed");
+  }
+
+  check_free_sized();
+
+  /* A heap of 256 KB cannot hold the batch */
+  max_heap = mem_max_heap();
+  mem_deinit();
+  mem_set_max_heap(256 * 1024);
+  mem_init();
+  check_batch_limit(16);
+  check_batch_limit(4000);
+  mem_deinit();
+  mem_set_max_heap(max_heap);
+  mem_init();
+}
+
+/*
+ * check_batch_sizes - A batch of blocks of size bytes that can all be
+ *     written without overwriting each other
+ */
+static void check_batch_sizes(size_t size) {
+  char* blocks[MAX_BLOCKS];
+  char* p;
+  int i;
+
+  reset_heap();
+  if (mm_malloc_batch(size, MAX_BLOCKS, (void**) blocks) != MAX_BLOCKS) {
+    error("batch", "mm_malloc_batch did not allocate the whole batch");
+    return;
+  }
+  for (i = 0; i < MAX_BLOCKS; i++) {
+    if ((uintptr_t) blocks[i] % sizeof(void*) != 0) {
+      error("batch", "a block is not aligned");
+      return;
+    }
+    memset(blocks[i], i + 1, size);
+  }
+  for (i = 0; i < MAX_BLOCKS; i++) {
+    for (p = blocks[i]; p < blocks[i] + size; p++) {
+      if (*p != (char) (i + 1)) {
+        error("batch", "a block was overwritten by another");
+        break;
+      }
+    }
+  }
+  if (mm_check() != 0) {
+    error("batch", "mm_check failed");
+  }
+  mm_free_batch((void**) blocks, MAX_BLOCKS);
+  if (mm_check() != 0) {
+    error("batch", "mm_check failed");
+  }
+}
+
+/*
+ * check_free_sized - The same blocks freed with mm_free and with
+ *     mm_free_sized leave the same free lists, so the next blocks are
+ *     placed at the same addresses
+ */
+static void check_free_sized(void) {
+  struct mm_stats before;
+  struct mm_stats after[2];
+  char* next[2][MAX_BLOCKS];
+  char* blocks[MAX_BLOCKS];
+  size_t size;
+  int run;
+  int i;
+
+  for (run = 0; run < 2; run++) {
+    reset_heap();
+    mm_stats(&before);
+    for (i = 0; i < MAX_BLOCKS; i++) {
+      blocks[i] = mm_malloc(1 + (i * 7919) % 3000);
+    }
+    for (i = 0; i < MAX_BLOCKS; i += 2) {
+      size = 1 + (i * 7919) % 3000;
+      if (run == 0) {
+        mm_free(blocks[i]);
+      } else {
+        mm_free_sized(blocks[i], size);
+      }
+    }
+    mm_stats(&after[run]);
+    after[run].in_use_bytes -= before.in_use_bytes;
+    for (i = 0; i < MAX_BLOCKS; i++) {
+      next[run][i] = mm_malloc(1 + (i * 104729) % 3000);
+    }
+    if (mm_check() != 0) {
+      error("free_sized", "mm_check failed");
+    }
+  }
+  if (after[0].in_use_bytes != after[1].in_use_bytes ||
+      after[0].free_bytes != after[1].free_bytes ||
+      after[0].free_blocks != after[1].free_blocks ||
+      memcmp(next[0], next[1], sizeof(next[0])) != 0) {
+    error("free_sized", "mm_free_sized and mm_free left different heaps");
+  }
+}
+
+/*
+ * check_batch_limit - A batch of blocks of size bytes that the heap cannot
+ *     hold gives as many as fit, which can be used and freed
+ */
+static void check_batch_limit(size_t size) {
+  static void* blocks[MAX_BATCH];
+  size_t n;
+  size_t i;
+
+  reset_heap();
+  n = mm_malloc_batch(size, MAX_BATCH, blocks);
+  if (n == 0 || n == MAX_BATCH || n * size > mem_max_heap()) {
+    error("batch", "a batch larger than the heap did not give the blocks that fit");
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    memset(blocks[i], 0x5a, size);
+  }
+  if (mm_check() != 0) {
+    error("batch", "mm_check failed");
+  }
+  mm_free_batch(blocks, n);
+  if (mm_check() != 0) {
+    error("batch", "mm_check failed");
+  }
+}
+
+/*
+ * check_heap_checker - mm_check passes a heap of every kind of block, and
+ *     fails it after a free block's footer, a used block's canary (with
+ *     MM_HARDEN) or a free-list link is overwritten. Each overwritten word
+ *     is put back before the next check.
+ */
+static void check_heap_checker(void) {
+  char* blocks[MAX_BLOCKS];
+  size_t* word;
+  size_t saved;
+  int i;
+
+  /* Slab objects, small and large heap blocks, aligned, batch and directly
+     mapped blocks, with every other one freed */
+  reset_heap();
+  for (i = 0; i < MAX_BLOCKS / 2; i++) {
+    blocks[i] = mm_malloc(1 + (i * 7919) % 5000);
+  }
+  mm_malloc_batch(500, 8, (void**) blocks + MAX_BLOCKS / 2);
+  mm_malloc_batch(16, 8, (void**) blocks + MAX_BLOCKS / 2 + 8);
+  for (i = MAX_BLOCKS / 2 + 16; i < MAX_BLOCKS - 1; i++) {
+    blocks[i] = mm_memalign(256, 100 * i);
+  }
+  blocks[MAX_BLOCKS - 1] = mm_malloc(1 << 20);
+  for (i = 0; i < MAX_BLOCKS; i += 2) {
+    mm_free(blocks[i]);
+  }
+  if (mm_check() != 0) {
+    error("mm_check", "a valid heap failed the check");
+  }
+  for (i = 1; i < MAX_BLOCKS; i += 2) {
+    mm_free(blocks[i]);
+  }
+
+  /* Blocks outside of the thread cache and the size tree, the first and
+     third of them free, so that both are in the same free list */
+  reset_heap();
+  blocks[0] = mm_malloc(500);
+  blocks[1] = mm_malloc(500);
+  blocks[2] = mm_malloc(500);
+  blocks[3] = mm_malloc(500);
+  mm_free(blocks[0]);
+  mm_free(blocks[2]);
+  if (mm_check() != 0) {
+    error("mm_check", "a valid heap failed the check");
+  }
+
+  word = last_word_of(blocks[0]);
+  saved = *word;
+  *word ^= 64;
+  if (check_quietly() == 0) {
+    error("mm_check", "a footer that does not match its header passed");
+  }
+  *word = saved;
+
+  word = last_word_of(blocks[1]);
+  saved = *word;
+  *word ^= 1;
+  if (MM_HARDEN && check_quietly() == 0) {
+    error("mm_check", "an overwritten canary passed");
+  }
+  *word = saved;
+
+  /* The list is blocks[2] then blocks[0], whose next link (the first word
+     of its payload) now leads back to blocks[2] */
+  word = (size_t*) blocks[0];
+  saved = *word;
+  *word = (size_t) header_of(blocks[2]);
+  if (check_quietly() == 0) {
+    error("mm_check", "a cycle in a free list passed");
+  }
+  *word = saved;
+
+  if (mm_check() != 0) {
+    error("mm_check", "the restored heap failed the check");
+  }
+}
+
+/*
+ * check_snapshot - A heap with a list of nodes and free blocks between them
+ *     is written by mm_snapshot, then restored by this driver in a new
+ *     process (see check_restore), which must exit with status 0. A file
+ *     that is not a snapshot, and one cut short, fail to restore.
+ */
+static void check_snapshot(const char* self) {
+  char file[] = "/tmp/mdriver-api-XXXXXX";
+  struct mm_stats stats;
+  snapshot_root* root;
+  void* saved;
+  node* n;
+  node* garbage = NULL;
+  size_t i;
+  pid_t pid;
+  int status;
+  int fd;
+
+  /* Directly mapped blocks cannot be in a snapshot */
+  mm_set_mmap_threshold(0);
+  reset_heap();
+  root = mm_malloc(sizeof(snapshot_root));
+  root->list = NULL;
+  for (i = 0; i < SNAPSHOT_NODES; i++) {
+    n = mm_malloc(sizeof(node) + (i * 7919) % 5000);
+    n->index = i;
+    n->size = sizeof(node) + (i * 7919) % 5000;
+    memset(n + 1, (char) i, n->size - sizeof(node));
+    if (i % 3 == 0) {
+      n->next = garbage;
+      garbage = n;
+    } else {
+      n->next = root->list;
+      root->list = n;
+    }
+  }
+  while ((n = garbage) != NULL) {
+    garbage = n->next;
+    mm_free(n);
+  }
+  mm_stats(&stats);
+  root->in_use = stats.in_use_bytes;
+
+  /* A file that is not a snapshot leaves the heap as it was */
+  n = root->list;
+  fd = open("/dev/zero", O_RDONLY);
+  if (fd < 0 || mm_restore(fd, &saved) != -1 || mm_check() != 0 ||
+      root->list != n || n->index != SNAPSHOT_NODES - 2) {
+    error("restore", "a file that is not a snapshot changed the heap");
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  fd = mkstemp(file);
+  if (fd < 0 || mm_snapshot(fd, root) != 0) {
+    error("snapshot", "mm_snapshot failed");
+    if (fd >= 0) {
+      close(fd);
+      unlink(file);
+    }
+    mm_set_mmap_threshold(256 * 1024);
+    return;
+  }
+  close(fd);
+  mm_set_mmap_threshold(256 * 1024);
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    execl(self, self, "-R", file, (char*) NULL);
+    printf("ERROR [snapshot]: could not run %s\n", self);
+    _exit(1);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    error("snapshot", "the heap restored in a new process failed its checks");
+  }
+
+  /* A snapshot cut short replaces the heap by an empty one that works */
+  if (truncate(file, 4096) != 0 || (fd = open(file, O_RDONLY)) < 0) {
+    error("snapshot", "could not cut the snapshot short");
+  } else {
+    if (mm_restore(fd, &saved) != -1) {
+      error("restore", "a snapshot cut short was restored");
+    }
+    close(fd);
+    mm_free(mm_malloc(100));
+    mm_free(mm_malloc(5000));
+    if (mm_check() != 0) {
+      error("restore", "the heap left by a failed restore failed mm_check");
+    }
+  }
+  unlink(file);
+}
+
+/*
+ * check_restore - Restore the snapshot in file over a heap with blocks of
+ *     its own, and check that the list from the root is intact, that mm_check
+ *     passes, and that only the snapshot's blocks count as in use
+ */
+static void check_restore(const char* file) {
+  struct mm_stats stats;
+  snapshot_root* root = NULL;
+  node* n;
+  size_t count = 0;
+  size_t i;
+  char* p;
+  int fd;
+  int ok;
+
+  /* Blocks of the heap the snapshot replaces */
+  reset_heap();
+  for (i = 0; i < MAX_BLOCKS; i++) {
+    mm_malloc(1 + (i * 7919) % 5000);
+  }
+
+  fd = open(file, O_RDONLY);
+  ok = fd >= 0 && mm_restore(fd, (void**) &root) == 0;
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (!ok) {
+    error("restore", "mm_restore failed");
+    return;
+  }
+  if (mm_check() != 0) {
+    error("restore", "mm_check failed on the restored heap");
+  }
+  mm_stats(&stats);
+  if (stats.in_use_bytes != root->in_use) {
+    error("restore", "in_use_bytes does not match the snapshot");
+  }
+
+  /* Every node whose index is not a multiple of 3, last one first */
+  i = SNAPSHOT_NODES;
+  for (n = root->list; n != NULL; n = n->next) {
+    do {
+      i--;
+    } while (i % 3 == 0);
+    if (n->index != i || n->size != sizeof(node) + (i * 7919) % 5000) {
+      error("restore", "the list from the root is not the one saved");
+      return;
+    }
+    for (p = (char*) (n + 1); p < (char*) n + n->size; p++) {
+      if (*p != (char) i) {
+        error("restore", "a node of the list was overwritten");
+        return;
+      }
+    }
+    count++;
+  }
+  if (count != SNAPSHOT_NODES - (SNAPSHOT_NODES + 2) / 3) {
+    error("restore", "the list from the root is not the one saved");
+    return;
+  }
+
+  /* The restored heap keeps working, and frees all of its blocks */
+  while ((n = root->list) != NULL) {
+    root->list = n->next;
+    mm_free(n);
+    mm_free(mm_malloc(100 + count % 3000));
+  }
+  mm_free(root);
+  mm_stats(&stats);
+  if (stats.in_use_bytes != 0) {
+    error("restore", "blocks are left in use after freeing them all");
+  }
+  if (mm_check() != 0) {
+    error("restore", "mm_check failed");
+  }
+}
+
+/*
+ * Helper routines
+ */
+static void usage(void) {
+  fprintf(stderr, "Usage: mdriver-api [-R <snapshot file>]\n");
+}
+
+static void reset_heap(void) {
+  mem_reset_brk();
+  if (mm_init() < 0) {
+    printf("Error in mm_init\n");
+    exit(1);
+  }
+}
+
+static void error(const char* test, const char* msg) {
+  errors++;
+  printf("ERROR [%s]: %s\n", test, msg);
+}
+
+/* The header of the block whose payload is p */
+static size_t* header_of(void* p) {
+  return (size_t*) p - 1;
+}
+
+/* The footer of a free block, or the canary of a used one */
+static size_t* last_word_of(void* p) {
+  size_t size = *header_of(p) & ~(size_t) 7;
+
+  return (size_t*) ((char*) header_of(p) + size) - 1;
+}
+
+/* Run mm_check with the problems it reports on stderr thrown away */
+static int check_quietly(void) {
+  int saved = dup(STDERR_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  int problems;
+
+  fflush(stderr);
+  dup2(null, STDERR_FILENO);
+  problems = mm_check();
+  fflush(stderr);
+  dup2(saved, STDERR_FILENO);
+  close(null);
+  close(saved);
+  return problems;
+}
+
+static int is_zero(const char* p, size_t size) {
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    if (p[i] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
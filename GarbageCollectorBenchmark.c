@@ -0,0 +1,389 @@
+/*
+ * GarbageCollectorBenchmark.c - times mm_garbage_collect on a large
+ * synthetic heap and checks that it frees exactly the unreachable blocks.
+ *
+ * The heap holds num_objects blocks of 2 to MAX_SLOTS words. The first
+ * chain_len blocks form one long linked chain from the first root (deep
+ * enough to overflow a recursive marker); every other slot either points
+ * to a random block or holds a small integer that is not a pointer.
+ *
+ * With -i, the first collection runs incrementally in steps of the given
+ * number of bytes. Between steps the program keeps running: it splices new
+ * blocks into links of the reachable graph with mm_gc_write, so a block can
+ * end up reachable only through a block that has already been scanned, and
+ * it frees short-lived blocks of its own. Those allocations may reuse the
+ * memory of blocks the collection has already freed.
+ *
+ * With -t, collections mark and sweep with that many threads, and the
+ * benchmark ends by timing the collection with 1, 2, 4, ... threads.
+ */
+#include "mm.h"
+#include "memlib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+int verbose = 0;        /* global flag for verbose output */
+#define WORD_SIZE sizeof(void*)
+#define TAG_USED 1
+
+/* Size of the header before each payload (4 bytes with COMPACT_HEADERS) */
+#if COMPACT_HEADERS
+#define HEADER_SIZE 4
+typedef unsigned int header_t;
+#else
+#define HEADER_SIZE WORD_SIZE
+typedef size_t header_t;
+#endif
+
+/* Most pointer slots in one block */
+#define MAX_SLOTS 8
+
+static int num_objects = 1000000;  /* number of blocks (-n) */
+static int chain_len = 250000;     /* length of the chain (-c) */
+static int num_roots = 16;         /* number of roots (-r) */
+static double edge_prob = 0.15;    /* chance that a slot is a pointer (-p) */
+static size_t heap_mb = 512;       /* heap size in MB (-M) */
+static size_t step_bytes = 0;      /* incremental step budget, 0 = off (-i) */
+static int step_mutations = 4;     /* blocks allocated between steps (-m) */
+static int threads = 1;            /* collector threads (-t) */
+
+static int total_objects;  /* blocks allocated so far */
+static int max_objects;    /* room in the arrays below */
+
+static void** objects;   /* payload of each block */
+static int* num_slots;   /* words in each block */
+static int* targets;     /* target index of each slot, or -1 */
+static char* reachable;  /* expected result of marking */
+static char* reused;     /* memory of the block was allocated again */
+static void** roots;
+static int* root_index;  /* block index of each root */
+
+static void build_heap(void);
+static int find_reachable(void);
+static int validate(void);
+static void collect_incrementally(void);
+static void mutate(void);
+static void note_reuse(void* payload);
+static int scale_threads(void);
+static int is_free(void* payloadPtr);
+static double now(void);
+
+static void usage(void) {
+  fprintf(stderr, "Usage: mdriver-garbage-bench [-n <objects>] [-c <chain>] "
+          "[-r <roots>] [-p <prob>] [-M <mb>] [-i <step bytes>] [-m <blocks>] [-t <threads>]\n");
+}
+
+int main(int argc, char** argv) {
+  int c;
+  int live;
+  double start, secs;
+
+  while ((c = getopt(argc, argv, "n:c:r:p:M:i:m:t:h")) != EOF) {
+    switch (c) {
+      case 'n': num_objects = atoi(optarg); break;
+      case 'c': chain_len = atoi(optarg); break;
+      case 'r': num_roots = atoi(optarg); break;
+      case 'p': edge_prob = atof(optarg); break;
+      case 'M': heap_mb = atol(optarg); break;
+      case 'i': step_bytes = atol(optarg); break;
+      case 'm': step_mutations = atoi(optarg); break;
+      case 't': threads = atoi(optarg); break;
+      case 'h': usage(); return 0;
+      default: usage(); return 1;
+    }
+  }
+  if (num_objects < 1 || chain_len > num_objects || num_roots < 1) {
+    usage();
+    return 1;
+  }
+
+  mem_set_max_heap(heap_mb << 20);
+  mem_init();
+  mem_reset_brk();
+  if (mm_init() < 0) {
+    printf("Error in mm_init\n");
+    return -1;
+  }
+
+  max_objects = step_bytes ? num_objects + num_objects / 4 : num_objects;
+  objects = malloc(max_objects * sizeof(void*));
+  num_slots = malloc(max_objects * sizeof(int));
+  targets = malloc((size_t) max_objects * MAX_SLOTS * sizeof(int));
+  reachable = calloc(max_objects, 1);
+  reused = calloc(num_objects, 1);
+  roots = malloc(num_roots * sizeof(void*));
+  root_index = malloc(num_roots * sizeof(int));
+  if (!objects || !num_slots || !targets || !reachable || !reused || !roots || !root_index) {
+    printf("Error: out of memory\n");
+    return -1;
+  }
+
+  mm_gc_set_threads(threads);
+  srand(1);
+  build_heap();
+  live = find_reachable();
+  printf("%d blocks, %d reachable, heap %zu KB\n",
+         num_objects, live, mem_heapsize() >> 10);
+
+  if (step_bytes) {
+    collect_incrementally();
+    find_reachable();
+    if (!validate()) {
+      return 1;
+    }
+  } else {
+    start = now();
+    mm_garbage_collect(roots, num_roots);
+    secs = now() - start;
+    printf("first collection:  %.3f ms\n", secs * 1e3);
+    if (!validate()) {
+      return 1;
+    }
+  }
+
+  /* Nothing is left to free, so this times marking and sweeping alone */
+  start = now();
+  mm_garbage_collect(roots, num_roots);
+  secs = now() - start;
+  printf("second collection: %.3f ms\n", secs * 1e3);
+  if (!validate()) {
+    return 1;
+  }
+  if (threads > 1 && !scale_threads()) {
+    return 1;
+  }
+
+  printf("Success! The garbage collector freed exactly the unreachable blocks\n");
+  mem_deinit();
+  return 0;
+}
+
+/* Allocate every block, then fill in its slots. */
+static void build_heap(void) {
+  int i, s, t;
+  void** payload;
+
+  for (i = 0; i < num_objects; i++) {
+    num_slots[i] = 2 + rand() % (MAX_SLOTS - 1);
+    objects[i] = mm_malloc(num_slots[i] * WORD_SIZE);
+  }
+  total_objects = num_objects;
+
+  for (i = 0; i < num_objects; i++) {
+    payload = objects[i];
+    for (s = 0; s < num_slots[i]; s++) {
+      t = -1;
+      if (i < chain_len - 1 && s == 0) {
+        t = i + 1;
+      } else if (i >= chain_len && rand() < edge_prob * RAND_MAX) {
+        t = rand() % num_objects;
+      }
+      targets[i * MAX_SLOTS + s] = t;
+      payload[s] = (t >= 0) ? objects[t] : (void*) (size_t) (rand() % 4096);
+    }
+  }
+
+  root_index[0] = 0;
+  for (i = 1; i < num_roots; i++) {
+    root_index[i] = (chain_len < num_objects)
+                    ? chain_len + rand() % (num_objects - chain_len)
+                    : rand() % num_objects;
+  }
+  for (i = 0; i < num_roots; i++) {
+    roots[i] = objects[root_index[i]];
+  }
+}
+
+/* Mark the expected reachable set with a worklist; returns its size. */
+static int find_reachable(void) {
+  int* work = malloc(total_objects * sizeof(int));
+  int top = 0, count = 0;
+  int i, s, t;
+
+  memset(reachable, 0, total_objects);
+  for (i = 0; i < num_roots; i++) {
+    t = root_index[i];
+    if (!reachable[t]) {
+      reachable[t] = 1;
+      work[top++] = t;
+    }
+  }
+  while (top > 0) {
+    i = work[--top];
+    count++;
+    for (s = 0; s < num_slots[i]; s++) {
+      t = targets[i * MAX_SLOTS + s];
+      if (t >= 0 && !reachable[t]) {
+        reachable[t] = 1;
+        work[top++] = t;
+      }
+    }
+  }
+  free(work);
+  return count;
+}
+
+/* Check that exactly the unreachable blocks were freed. */
+static int validate(void) {
+  int i;
+
+  for (i = 0; i < total_objects; i++) {
+    if (reachable[i] && is_free(objects[i])) {
+      printf("ERROR: reachable block %d was freed!\n", i);
+      return 0;
+    }
+    if (!reachable[i] && !is_free(objects[i]) && !(i < num_objects && reused[i])) {
+      printf("ERROR: unreachable block %d was not freed\n", i);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Run the first collection in steps of step_bytes, mutating the graph
+ * between them, and report the pauses.
+ */
+static void collect_incrementally(void) {
+  struct mm_gc_stats stats;
+  double start, secs;
+
+  start = now();
+  mm_gc_begin(roots, num_roots);
+  while (mm_gc_step(step_bytes)) {
+    mutate();
+  }
+  secs = now() - start;
+  mm_gc_get_stats(&stats);
+  printf("first collection:  %.3f ms in %zu steps of %zu bytes, "
+         "%d blocks allocated meanwhile\n",
+         secs * 1e3, stats.slices, step_bytes, total_objects - num_objects);
+  printf("pauses: max %.3f us, mean %.3f us, total %.3f ms\n",
+         stats.max_pause * 1e6, stats.total_pause / (stats.slices + 1) * 1e6,
+         stats.total_pause * 1e3);
+}
+
+/*
+ * Splice step_mutations new blocks into the graph. Each one takes the place
+ * of a pointer slot of a random reachable block, keeps the old target in its
+ * first slot and points to random reachable blocks with the others. A
+ * scratch block is allocated and freed along with each.
+ */
+static void mutate(void) {
+  int m, i, s, t, n, tries;
+  void** payload;
+  void* scratch;
+
+  for (m = 0; m < step_mutations && total_objects < max_objects; m++) {
+    tries = 0;
+    do {
+      i = rand() % total_objects;
+      s = rand() % num_slots[i];
+    } while ((!reachable[i] || targets[i * MAX_SLOTS + s] < 0) && ++tries < 1000);
+    if (tries == 1000) {
+      return;
+    }
+
+    n = total_objects++;
+    num_slots[n] = 2 + rand() % (MAX_SLOTS - 1);
+    objects[n] = mm_malloc(num_slots[n] * WORD_SIZE);
+    note_reuse(objects[n]);
+    reachable[n] = 1;
+    payload = objects[n];
+    for (t = 0; t < num_slots[n]; t++) {
+      targets[n * MAX_SLOTS + t] = -1;
+      payload[t] = NULL;
+    }
+
+    t = targets[i * MAX_SLOTS + s];
+    targets[n * MAX_SLOTS] = t;
+    mm_gc_write(&payload[0], objects[t]);
+    targets[i * MAX_SLOTS + s] = n;
+    mm_gc_write(&((void**) objects[i])[s], objects[n]);
+
+    for (s = 1; s < num_slots[n]; s++) {
+      do {
+        t = rand() % total_objects;
+      } while (!reachable[t]);
+      targets[n * MAX_SLOTS + s] = t;
+      mm_gc_write(&payload[s], objects[t]);
+    }
+
+    scratch = mm_malloc(WORD_SIZE * (1 + rand() % MAX_SLOTS));
+    note_reuse(scratch);
+    mm_gc_write(scratch, objects[n]);
+    mm_free(scratch);
+  }
+}
+
+/*
+ * Time the collection with 1, 2, 4, ... and threads threads, best of three
+ * runs each, validating every run.
+ */
+static int scale_threads(void) {
+  double start, secs, best, serial = 0;
+  int t, run;
+
+  printf("threads  time (ms)  speedup\n");
+  for (t = 1; t <= threads; t = (t < threads && 2 * t > threads) ? threads : 2 * t) {
+    mm_gc_set_threads(t);
+    best = 0;
+    for (run = 0; run < 3; run++) {
+      start = now();
+      mm_garbage_collect(roots, num_roots);
+      secs = now() - start;
+      if (!validate()) {
+        return 0;
+      }
+      if (run == 0 || secs < best) {
+        best = secs;
+      }
+    }
+    if (t == 1) {
+      serial = best;
+    }
+    printf("%7d  %9.3f  %6.2fx\n", t, best * 1e3, serial / best);
+    if (t == threads) {
+      break;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Note the original blocks whose header lies in the block at payload. They
+ * were allocated in address order, so a binary search finds them.
+ */
+static void note_reuse(void* payload) {
+  char* lo = (char*) payload - HEADER_SIZE;
+  char* hi = lo + (*(header_t*) lo & ~(size_t) 7);
+  int first = 0, last = num_objects;
+  int mid;
+
+  while (first < last) {
+    mid = first + (last - first) / 2;
+    if ((char*) objects[mid] - HEADER_SIZE < lo) {
+      first = mid + 1;
+    } else {
+      last = mid;
+    }
+  }
+  for (; first < num_objects && (char*) objects[first] - HEADER_SIZE < hi; first++) {
+    reused[first] = 1;
+  }
+}
+
+static int is_free(void* payloadPtr) {
+  size_t sizeAndTags = *((header_t*) (((char*) payloadPtr) - HEADER_SIZE));
+  return !(sizeAndTags & TAG_USED);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -7,6 +7,15 @@ int verbose = 0;        /* global flag for verbose output */
 #define WORD_SIZE sizeof(void*)
 #define TAG_USED 1
 
+/* Size of the header before each payload (4 bytes with COMPACT_HEADERS) */
+#if COMPACT_HEADERS
+#define HEADER_SIZE 4
+typedef unsigned int header_t;
+#else
+#define HEADER_SIZE WORD_SIZE
+typedef size_t header_t;
+#endif
+
 #define NUM_ROOTS 3
 
 typedef struct obj_1 {
@@ -147,6 +156,6 @@ static void validate_garbage_collect(void) {
 }
 
 static int is_free(void* payloadPtr) {
-  size_t sizeAndTags = *((size_t*) (((char*) payloadPtr) - WORD_SIZE));
+  size_t sizeAndTags = *((header_t*) (((char*) payloadPtr) - HEADER_SIZE));
   return !(sizeAndTags & TAG_USED);
 }
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# bench-matrix.sh - replay a matrix of synthetic workloads through mdriver
+#
+# Generates a trace with tracegen for every combination of the size
+# distributions, lifetime distributions, live-set sizes and realloc
+# fractions below, replays each with mdriver-realloc, and writes one CSV
+# line of throughput and utilization per workload to stdout:
+#
+#     unix> make bench                # writes bench.csv
+#     unix> BENCH_OPS=100000000 ./bench-matrix.sh > big.csv
+#
+# The environment can override the lists and these settings:
+#   BENCH_OPS      requests per trace (default 1000000)
+#   BENCH_DIR      where the traces are generated (default bench-traces)
+#   BENCH_HEAP_MB  heap size passed to mdriver -M (default 4096)
+#   MDRIVER        the driver to run (default ./mdriver-realloc)
+#
+set -e
+
+ops=${BENCH_OPS:-1000000}
+dir=${BENCH_DIR:-bench-traces}
+heap_mb=${BENCH_HEAP_MB:-4096}
+mdriver=${MDRIVER:-./mdriver-realloc}
+sizes=${BENCH_SIZES:-"uniform:1:512 lognormal:64:1.5 bimodal:32:4096:0.9"}
+lifetimes=${BENCH_LIFETIMES:-"exp:100 exp:10000"}
+lives=${BENCH_LIVES:-"1000 100000"}
+reallocs=${BENCH_REALLOCS:-"0 0.1"}
+
+mkdir -p "$dir"
+echo "sizes,lifetimes,live,realloc,ops,valid,util,secs,kops,stddev,runs"
+n=0
+for s in $sizes; do
+  for t in $lifetimes; do
+    for l in $lives; do
+      for r in $reallocs; do
+        n=$((n + 1))
+        trace="$dir/w$n.bin"
+        ./tracegen -n "$ops" -l "$l" -s "$s" -t "$t" -r "$r" -S "$n" "$trace"
+        "$mdriver" -M "$heap_mb" -f "$trace" -c "$dir/w$n.csv" > /dev/null
+        # Replace the trace name by the workload's parameters
+        tail -n 1 "$dir/w$n.csv" | sed "s|^[^,]*|$s,$t,$l,$r|" |
+          awk -F, -v OFS=, '{ print $1, $2, $3, $4, $7, $5, $6, $8, $9, $10, $11 }'
+        rm -f "$trace" "$dir/w$n.csv"
+      done
+    done
+  done
+done
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# compare-drivers.sh - run several builds of mdriver on the same traces
+#
+# Runs each driver named on the command line (the policy and variant
+# builds of mm.c, see make policies and make variants) and writes its
+# per-trace CSV lines to stdout, with the driver's name in front:
+#
+#     unix> make compare              # writes compare.csv
+#     unix> MDRIVER_ARGS="-M 4096 -f big.bin" ./compare-drivers.sh \
+#               mdriver mdriver-compact > big.csv
+#
+# The environment can override:
+#   MDRIVER_ARGS   arguments passed to each driver (default: none, which
+#                  runs the default traces)
+#
+set -e
+
+args=${MDRIVER_ARGS:-}
+csv=${TMPDIR:-/tmp}/compare-drivers.$$.csv
+
+header=1
+for d in "$@"; do
+  "./$d" $args -c "$csv" > /dev/null
+  # The CSV heading (which depends on the arguments) once, then each line
+  # prefixed with the driver
+  if [ $header = 1 ]; then
+    head -n 1 "$csv" | sed "s|^|driver,|"
+    header=0
+  fi
+  tail -n +2 "$csv" | sed "s|^|$d,|"
+done
+rm -f "$csv"
@@ -17,9 +17,8 @@
 /*
  * This is the list of default tracefiles in TRACEDIR that the driver
  * will use for testing. Modify this if you want to add or delete
- * traces from the driver's test suite. For example, if you don't want
- * your students to implement realloc, you can delete the last two
- * traces.
+ * traces from the driver's test suite. The realloc traces are only
+ * run by mdriver-realloc, which appends REALLOC_TRACEFILES.
  */
 #define DEFAULT_TRACEFILES \
   "amptjp-bal.rep",\
@@ -32,6 +31,10 @@
   "binary-bal.rep",\
   "binary2-bal.rep"
 
+#define REALLOC_TRACEFILES \
+  "realloc-bal.rep",\
+  "realloc2-bal.rep"
+
 /*
  * This constant gives the estimated performance of the libc malloc
  * package using our traces on some reference system, typically the
@@ -51,20 +54,48 @@
 #define UTIL_WEIGHT .60
 
 /*
- * Alignment requirement in bytes (either 4 or 8)
+ * Alignment requirement in bytes of the payloads mm_malloc returns, which
+ * mdriver checks. mm.c needs a power of two of at least 8; build with
+ * -DALIGNMENT=16 for payloads that hold 16-byte vectors (make variants).
  */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
 
 /*
- * Maximum heap size in bytes
+ * Default maximum heap size in bytes (of each arena, see MEM_ARENAS).
+ * It can be changed at runtime with mem_set_max_heap (mdriver -M).
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
+/*
+ * Set MEM_MMAP to "1" to back the modeled VM with an mmap reservation
+ * that is committed page by page as the heap grows, or to "0" to malloc
+ * all of it up front.
+ */
+#define MEM_MMAP 1
+
+/*
+ * Huge pages for the mmap backend: 0 = none, 1 = transparent huge pages
+ * (MADV_HUGEPAGE), 2 = hugetlb pages (MAP_HUGETLB), falling back to 1
+ * if not enough are reserved. Can be changed with mem_set_hugepages
+ * (mdriver -H).
+ */
+#define MEM_HUGEPAGES 0
+
+/*
+ * Number of arenas mem_init sets up. Each arena is an independent
+ * sub-heap of up to MAX_HEAP bytes; a multithreaded program can ask for
+ * more with mem_init_arenas().
+ */
+#define MEM_ARENAS 1
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
+#define USE_FCLOCK 1   /* TSC or CLOCK_MONOTONIC_RAW, repeated to a confidence interval */
 #define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
-#define USE_ITIMER 1   /* interval timer (any Unix box) */
+#define USE_ITIMER 0   /* interval timer (any Unix box) */
 #define USE_GETTOD 0   /* gettimeofday (any Unix box) */
 
 #endif /* __CONFIG_H */
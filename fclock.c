@@ -0,0 +1,241 @@
+/*
+ * fclock.c - Estimate the time (in seconds) used by a function f
+ *
+ * Times whole runs of f with the invariant TSC (read with rdtscp, which
+ * waits for earlier instructions to finish) or, where the CPU has none,
+ * with clock_gettime(CLOCK_MONOTONIC_RAW), which NTP does not slew.
+ * To keep the noise down, the thread is pinned to one CPU while timing,
+ * f is run a few times untimed first to warm the caches and the heap,
+ * and timed runs are repeated until the confidence interval of their
+ * median is narrow. The median is what is reported, since a run that
+ * was preempted skews the mean (and the standard deviation) but not it.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "fclock.h"
+
+/* Default values */
+#define WARMUP 1             /* Untimed runs first */
+#define MIN_RUNS 5           /* Timed runs at least ... */
+#define MAX_RUNS 100         /* ... and at most */
+#define EPSILON 0.01         /* Relative half-width of the 95% interval */
+#define BUDGET 2.0           /* Seconds of timed runs to give up after */
+#define PIN 1                /* Pin to one CPU while timing */
+#define CALIBRATE_SECS 0.05  /* Seconds to calibrate the TSC over */
+
+static int warmup = WARMUP;
+static int min_runs = MIN_RUNS;
+static int max_runs = MAX_RUNS;
+static double epsilon = EPSILON;
+static double budget = BUDGET;
+static int pin = PIN;
+
+static int use_tsc = 0;           /* time with the TSC? */
+static double secs_per_tick = 0;  /* TSC period, from calibration */
+
+/* Two-sided 95% quantiles of Student's t for 1 to 30 degrees of freedom */
+static const double t95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+/*
+ * The clocks
+ */
+static double monotonic_secs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static inline unsigned long long read_tsc(void) {
+  unsigned hi, lo, aux;
+
+  asm volatile("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+  return ((unsigned long long) hi << 32) | lo;
+}
+
+/* Does the CPU have an invariant TSC, and rdtscp to read it? */
+static int have_invariant_tsc(void) {
+  unsigned eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 27)))
+    return 0;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return (edx & (1u << 8)) != 0;
+}
+#else
+static inline unsigned long long read_tsc(void) {
+  return 0;
+}
+
+static int have_invariant_tsc(void) {
+  return 0;
+}
+#endif
+
+static double now(void) {
+  return use_tsc ? read_tsc() * secs_per_tick : monotonic_secs();
+}
+
+double init_fclock(void) {
+  unsigned long long tsc0, tsc1;
+  double t0, t1;
+
+  use_tsc = 0;
+  if (!have_invariant_tsc())
+    return 0;
+
+  t0 = monotonic_secs();
+  tsc0 = read_tsc();
+  do {
+    t1 = monotonic_secs();
+  } while (t1 - t0 < CALIBRATE_SECS);
+  tsc1 = read_tsc();
+
+  secs_per_tick = (t1 - t0) / (double) (tsc1 - tsc0);
+  use_tsc = 1;
+  return 1e-6 / secs_per_tick;
+}
+
+const char* fclock_name(void) {
+  return use_tsc ? "TSC" : "CLOCK_MONOTONIC_RAW";
+}
+
+/*
+ * Statistics of the samples
+ */
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+
+  return (x > y) - (x < y);
+}
+
+static double t_quantile(int df) {
+  return df <= 30 ? t95[df - 1] : 1.96;
+}
+
+/* Return the median of the n values in sorted */
+static double median_of(double* sorted, int n) {
+  return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+/*
+ * median_halfwidth - Return the half-width of the 95% confidence interval
+ *     of the median of the n samples, whose sorted copy is in sorted. The
+ *     spread is estimated from the median absolute deviation, so a few
+ *     runs that were preempted do not widen it.
+ */
+static double median_halfwidth(double* sorted, double* scratch, int n) {
+  double median = median_of(sorted, n);
+  double sigma;
+  int i;
+
+  for (i = 0; i < n; i++)
+    scratch[i] = fabs(sorted[i] - median);
+  qsort(scratch, n, sizeof(double), compare_doubles);
+  sigma = 1.4826 * median_of(scratch, n);   /* MAD to standard deviation */
+  return t_quantile(n - 1) * 1.2533 * sigma / sqrt(n);
+}
+
+double fclock(fclock_test_funct f, void* argp, fclock_result_t* result) {
+  double* samples;
+  double* sorted;
+  double* scratch;
+  double start, elapsed = 0;
+  double sum = 0, sumsq = 0;
+  double mean, var, median;
+  cpu_set_t old_set, set;
+  int pinned = 0;
+  int n, i, j;
+
+  samples = (double*) malloc(3 * max_runs * sizeof(double));
+  if (samples == NULL) {
+    fprintf(stderr, "fclock: malloc failed\n");
+    exit(1);
+  }
+  sorted = samples + max_runs;
+  scratch = sorted + max_runs;
+
+  /* Stay on the current CPU, so the TSC and the caches are the same
+     throughout */
+  if (pin && pthread_getaffinity_np(pthread_self(), sizeof(old_set), &old_set) == 0) {
+    CPU_ZERO(&set);
+    CPU_SET(sched_getcpu(), &set);
+    pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+  }
+
+  for (i = 0; i < warmup; i++)
+    f(argp);
+
+  for (n = 0; n < max_runs;) {
+    start = now();
+    f(argp);
+    samples[n] = now() - start;
+    elapsed += samples[n];
+    sum += samples[n];
+    sumsq += samples[n] * samples[n];
+
+    /* Keep the samples sorted as well, by insertion */
+    for (j = n; j > 0 && sorted[j - 1] > samples[n]; j--)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = samples[n];
+    n++;
+
+    if (n >= min_runs &&
+        (median_halfwidth(sorted, scratch, n) <= epsilon * median_of(sorted, n) ||
+         elapsed >= budget))
+      break;
+  }
+
+  if (pinned)
+    pthread_setaffinity_np(pthread_self(), sizeof(old_set), &old_set);
+
+  median = median_of(sorted, n);
+  mean = sum / n;
+  var = n > 1 ? (sumsq - sum * mean) / (n - 1) : 0;
+  if (result != NULL) {
+    result->median = median;
+    result->mean = mean;
+    result->stddev = var > 0 ? sqrt(var) : 0;
+    result->runs = n;
+  }
+  free(samples);
+  return median;
+}
+
+void set_fclock_warmup(int runs) {
+  warmup = runs;
+}
+
+void set_fclock_runs(int min_runs_arg, int max_runs_arg) {
+  min_runs = min_runs_arg < 2 ? 2 : min_runs_arg;
+  max_runs = max_runs_arg < min_runs ? min_runs : max_runs_arg;
+}
+
+void set_fclock_epsilon(double epsilon_arg) {
+  epsilon = epsilon_arg;
+}
+
+void set_fclock_budget(double secs) {
+  budget = secs;
+}
+
+void set_fclock_pin(int pin_arg) {
+  pin = pin_arg;
+}
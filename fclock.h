@@ -0,0 +1,72 @@
+/*
+ * fclock.h - prototypes for the routines in fclock.c that estimate the
+ *     time in seconds used by a test function f, with a statistical
+ *     stopping rule
+ */
+
+/* The test function takes a generic pointer as input */
+typedef void (* fclock_test_funct)(void*);
+
+/* The result of timing one function */
+typedef struct {
+    double median;   /* median seconds of the timed runs */
+    double mean;     /* mean seconds of the timed runs */
+    double stddev;   /* sample standard deviation, in seconds */
+    int runs;        /* number of timed runs (not counting warmups) */
+} fclock_result_t;
+
+/*
+ * init_fclock - Pick the clock (the invariant TSC if the CPU has one,
+ *     else CLOCK_MONOTONIC_RAW), calibrating the TSC against the
+ *     monotonic clock. Returns the TSC frequency in MHz, or 0.
+ */
+double init_fclock(void);
+
+/* Return the clock in use ("TSC" or "CLOCK_MONOTONIC_RAW") */
+const char* fclock_name(void);
+
+/*
+ * fclock - Time f(argp), pinned to the CPU it starts on: run it
+ *     warmup times untimed, then until the 95% confidence interval of
+ *     the median is within epsilon of the median. Fills in *result (if not
+ *     NULL) and returns the median.
+ */
+double fclock(fclock_test_funct f, void* argp, fclock_result_t* result);
+
+/*********************************************************
+ * Set the various parameters used by measurement routines
+ *********************************************************/
+
+/*
+ * set_fclock_warmup - Number of untimed runs first
+ *     Default = 1
+ */
+void set_fclock_warmup(int runs);
+
+/*
+ * set_fclock_runs - Minimum and maximum number of timed runs
+ *     Default = 5 and 100
+ */
+void set_fclock_runs(int min_runs, int max_runs);
+
+/*
+ * set_fclock_epsilon - Relative half-width of the 95% confidence
+ *     interval to stop at
+ *     Default = 0.01
+ */
+void set_fclock_epsilon(double epsilon);
+
+/*
+ * set_fclock_budget - Seconds of timed runs after which to stop once
+ *     the minimum number of runs is reached, even if the interval is
+ *     still wider
+ *     Default = 2.0
+ */
+void set_fclock_budget(double secs);
+
+/*
+ * set_fclock_pin - When set, pin the calling thread to one CPU while
+ *     timing
+ *     Default = 1
+ */
+void set_fclock_pin(int pin);
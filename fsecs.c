@@ -6,6 +6,7 @@
 #include "fcyc.h"
 #include "clock.h"
 #include "ftimer.h"
+#include "fclock.h"
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
@@ -18,7 +19,15 @@ extern int verbose; /* -v option in mdriver.c */
 void init_fsecs(void) {
   Mhz = 0; /* keep gcc -Wall happy */
 
-#if USE_FCYC
+#if USE_FCLOCK
+  Mhz = init_fclock();
+  if (verbose) {
+    if (Mhz > 0)
+      printf("Measuring performance with the %s (%.0f MHz).\n", fclock_name(), Mhz);
+    else
+      printf("Measuring performance with %s.\n", fclock_name());
+  }
+#elif USE_FCYC
   if (verbose)
       printf("Measuring performance with a cycle counter.\n");
 
@@ -42,12 +51,35 @@ void init_fsecs(void) {
  * fsecs - Return the running time of a function f (in seconds)
  */
 double fsecs(fsecs_test_funct f, void* argp) {
+  return fsecs_stats(f, argp, NULL);
+}
+
+/*
+ * fsecs_stats - Like fsecs, also telling in *stats (if not NULL) how the
+ *     runs varied; only USE_FCLOCK knows their standard deviation
+ */
+double fsecs_stats(fsecs_test_funct f, void* argp, fsecs_stats_t* stats) {
+#if USE_FCLOCK
+  fclock_result_t result;
+  double secs = fclock(f, argp, &result);
+  if (stats != NULL) {
+    stats->stddev = result.stddev;
+    stats->runs = result.runs;
+  }
+  return secs;
+#else
+  if (stats != NULL) {
+    stats->stddev = 0;
+    stats->runs = 10;
+  }
 #if USE_FCYC
-  double cycles = fcyc(f, argp);
-  return cycles/(Mhz*1e6);
+  if (stats != NULL)
+    stats->runs = 1;
+  return fcyc(f, argp)/(Mhz*1e6);
 #elif USE_ITIMER
   return ftimer_itimer(f, argp, 10);
 #elif USE_GETTOD
   return ftimer_gettod(f, argp, 10);
 #endif
+#endif
 }
@@ -2,4 +2,11 @@ typedef void (* fsecs_test_funct)(void*);
 
 void init_fsecs(void);
 
+/* How much the timed runs of f varied */
+typedef struct {
+    double stddev;   /* sample standard deviation, in seconds (0 if unknown) */
+    int runs;        /* number of timed runs */
+} fsecs_stats_t;
+
 double fsecs(fsecs_test_funct f, void* argp);
+double fsecs_stats(fsecs_test_funct f, void* argp, fsecs_stats_t* stats);
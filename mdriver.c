@@ -9,17 +9,26 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
+#include "perfctr.h"
 #include "config.h"
+#include "tracefmt.h"
 
 /**********************
  * Constants and macros
@@ -29,27 +38,47 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MT_DRAIN_OPS  64 /* ops between inbox drains in the -T replay */
+#define MT_INBOX_MAX 256 /* blocks an inbox holds before the sender waits */
+#define PERF_RUNS      3 /* counted runs of each trace (-P) */
+
+/* Log-linear histograms (-L): values below 2^HIST_SUB_BITS get a bucket
+ * each, and every larger power of two is split into 2^HIST_SUB_BITS
+ * buckets, so a bucket is within about 6% of the values it counts. */
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
 
+/*
+ * Only mdriver-realloc (built with -DMDRIVER_REALLOC) links against an mm
+ * package with mm_realloc. The plain driver rejects realloc traces in
+ * read_trace, so this stub is never reached.
+ */
+#ifndef MDRIVER_REALLOC
+#define mm_realloc(ptr, size) \
+  ((void) (ptr), (void) (size), app_error("mm_realloc is not linked into mdriver"), (void*) NULL)
+#endif
+
 /******************************
  * The key compound data types
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, as a node of a treap
+ * (a binary search tree by lo that is also a heap by priority) */
 typedef struct range_t {
     char* lo;              /* low payload address */
     char* hi;              /* high payload address */
-    struct range_t* next;  /* next list element */
+    unsigned priority;     /* random, keeps the tree balanced */
+    struct range_t* left;  /* ranges at lower addresses */
+    struct range_t* right; /* ranges at higher addresses */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum { ALLOC, FREE } type;        /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc request */
-} traceop_t;
+/* Characterizes a single trace operation (allocator request). This is the
+ * record of a binary trace, so those are replayed straight from the file */
+typedef tracefmt_op_t traceop_t;
+enum { ALLOC = TRACEFMT_ALLOC, FREE = TRACEFMT_FREE, REALLOC = TRACEFMT_REALLOC };
 
 /* Holds the information for one trace file*/
 typedef struct {
@@ -60,6 +89,8 @@ typedef struct {
     traceop_t* ops;      /* array of requests */
     char** blocks;       /* array of ptrs returned by malloc... */
     size_t* block_sizes; /* ... and a corresponding array of payload sizes */
+    void* map;           /* mapping of a binary trace file, or NULL */
+    size_t map_len;      /* its length in bytes */
 } trace_t;
 
 /*
@@ -77,7 +108,10 @@ typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
     double ops;      /* number of ops (malloc/free) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
-    double secs;     /* number of secs needed to run the trace */
+    double secs;     /* number of secs needed to run the trace (median) */
+    double stddev;   /* standard deviation of those secs over the runs */
+    int runs;        /* number of timed runs */
+    perfctr_result_t perf; /* hardware events per run of the trace (-P) */
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
@@ -85,6 +119,55 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+/* Summarizes a multithreaded replay (-T) of one trace */
+typedef struct {
+    int valid;           /* was the trace replayed? */
+    double ops;          /* number of ops replayed over all threads */
+    double secs;         /* wall-clock secs until the last thread finished */
+    double* thread_secs; /* secs needed by each thread */
+} mt_stats_t;
+
+/* Counts of the values recorded for one kind of measurement */
+typedef struct {
+    unsigned long long count[HIST_BUCKETS];
+    unsigned long long n;    /* number of values */
+    unsigned long long max;  /* largest value */
+} hist_t;
+
+/* Per-operation latency (in cycles) and search lengths of one trace (-L) */
+typedef struct {
+    int valid;         /* was the trace measured? */
+    hist_t malloc_cyc; /* cycles per mm_malloc */
+    hist_t free_cyc;   /* cycles per mm_free */
+    hist_t realloc_cyc;/* cycles per mm_realloc */
+    hist_t search;     /* free blocks looked at per mm_malloc */
+} latency_t;
+
+/* The allocator entry points used by a multithreaded replay */
+typedef struct {
+    void* (*malloc_fn)(size_t size);
+    void (*free_fn)(void* ptr);
+    void* (*realloc_fn)(void* ptr, size_t size);
+} mt_alloc_t;
+
+/*
+ * Per-thread state of a multithreaded replay. Each thread replays its own
+ * copy of the trace. A thread that frees a block on behalf of another
+ * thread's allocation finds it in its inbox, filled by its left neighbor.
+ */
+typedef struct {
+    int id;                   /* thread number */
+    trace_t* trace;           /* the trace being replayed (shared) */
+    mt_alloc_t* alloc;        /* allocator under test */
+    char** blocks;            /* this thread's blocks, indexed by trace id */
+    unsigned seed;            /* picks which frees go to another thread */
+    pthread_mutex_t lock;     /* protects the inbox */
+    char** inbox;             /* blocks this thread should free */
+    int inbox_len;            /* number of blocks in the inbox */
+    double start;             /* time this thread started replaying */
+    double end;               /* time this thread finished replaying */
+} mt_thread_t;
+
 /********************
  * Global variables
  *******************/
@@ -92,12 +175,28 @@ int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
+/* Multithreaded replay (-T, -x) settings */
+static int measure_latency = 0;  /* record per-op histograms (-L) */
+static int measure_perf = 0;     /* count hardware events (-P) */
+static int num_threads = 0;      /* 0 means no multithreaded replay */
+static double cross_frac = 0.0;  /* fraction of frees done by another thread */
+static mt_thread_t* mt_threads;  /* per-thread state of the current replay */
+static pthread_barrier_t mt_barrier;
+static int mt_done;              /* threads that have replayed all their ops */
+
+/* File to write the per-trace mm results to as CSV (-c), or NULL */
+static char* csvfile = NULL;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
 /* The filenames of the default tracefiles */
 static char* default_tracefiles[] = {
+#ifdef MDRIVER_REALLOC
+        DEFAULT_TRACEFILES, REALLOC_TRACEFILES, NULL
+#else
         DEFAULT_TRACEFILES, NULL
+#endif
 };
 
 
@@ -110,9 +209,12 @@ static int add_range(range_t** ranges, char* lo, int size,
                      int tracenum, int opnum);
 static void remove_range(range_t** ranges, char* lo);
 static void clear_ranges(range_t** ranges);
+static range_t* range_insert(range_t* root, range_t* p);
+static range_t* range_merge(range_t* a, range_t* b);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t* read_trace(char* tracedir, char* filename);
+static int map_binary_trace(trace_t* trace, char* path);
 static void free_trace(trace_t* trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -124,9 +226,24 @@ static void eval_libc_speed(void* ptr);
 static int eval_mm_valid(trace_t* trace, int tracenum, range_t** ranges);
 static double eval_mm_util(trace_t* trace, int tracenum, range_t** ranges);
 static void eval_mm_speed(void* ptr);
+static void eval_mm_latency(trace_t* trace, latency_t* latency);
+static void eval_mm_stats(trace_t* trace, int tracenum);
+
+/* Routines for the multithreaded replay of a trace (-T) */
+static void eval_mt_speed(trace_t* trace, mt_alloc_t* alloc, mt_stats_t* stats);
+static void* mt_replay(void* arg);
+static void mt_drain_inbox(mt_thread_t* self);
+static double mt_now(void);
+static void* mm_realloc_fn(void* ptr, size_t size);
 
 /* Various helper routines */
 static void printresults(int n, stats_t* stats);
+static void print_mt_results(int n, mt_stats_t* stats);
+static void write_csv_results(int n, char** tracefiles, stats_t* stats);
+static void print_latency_results(int n, latency_t* latency);
+static void print_perf_results(char* name, int n, stats_t* stats);
+static void hist_add(hist_t* hist, unsigned long long value);
+static unsigned long long hist_percentile(hist_t* hist, double p);
 static void usage(void);
 static void unix_error(char* msg) __attribute__ ((__noreturn__));
 static void malloc_error(int tracenum, int opnum, char* msg);
@@ -145,6 +262,12 @@ int main(int argc, char** argv) {
   stats_t* libc_stats = NULL;/* libc stats for each trace */
   stats_t* mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
   speed_t speed_params;      /* input parameters to the xx_speed routines */
+  fsecs_stats_t fstats;      /* spread of the timed runs of one trace */
+  mt_stats_t* libc_mt_stats = NULL; /* libc multithreaded replay stats */
+  mt_stats_t* mm_mt_stats = NULL;   /* mm multithreaded replay stats */
+  latency_t* mm_latency = NULL;     /* mm per-op histograms (-L) */
+  mt_alloc_t libc_alloc = { malloc, free, realloc };
+  mt_alloc_t mm_alloc = { mm_malloc, mm_free, mm_realloc_fn };
 
   int run_libc = 0;    /* If set, run libc malloc (set by -l) */
   int autograder = 0;  /* If set, emit summary info for autograder (-g) */
@@ -156,8 +279,11 @@ int main(int argc, char** argv) {
   /*
    * Read and interpret the command line arguments
    */
-  while ((c = getopt(argc, argv, "f:t:hvVgl")) != EOF) {
+  while ((c = getopt(argc, argv, "c:f:t:T:x:M:H:hvVglLP")) != EOF) {
     switch (c) {
+      case 'c': /* Write the per-trace mm results to a CSV file */
+        csvfile = optarg;
+        break;
       case 'g': /* Generate summary info for the autograder */
         autograder = 1;
         break;
@@ -179,6 +305,30 @@ int main(int argc, char** argv) {
       case 'l': /* Run libc malloc */
         run_libc = 1;
         break;
+      case 'L': /* Record latency and search-length histograms */
+        measure_latency = 1;
+        break;
+      case 'P': /* Count hardware events with perf_event_open */
+        measure_perf = 1;
+        break;
+      case 'T': /* Also replay each trace on this many threads at once */
+        num_threads = atoi(optarg);
+        if (num_threads < 1 || num_threads > MEM_MAX_ARENAS)
+          app_error("-T needs a thread count between 1 and MEM_MAX_ARENAS");
+        break;
+      case 'x': /* Fraction of frees done by a thread other than the allocator */
+        cross_frac = atof(optarg);
+        if (cross_frac < 0.0 || cross_frac > 1.0)
+          app_error("-x needs a fraction between 0 and 1");
+        break;
+      case 'M': /* Maximum heap size of each arena, in MB */
+        if (atof(optarg) <= 0)
+          app_error("-M needs a positive heap size in MB");
+        mem_set_max_heap((size_t) (atof(optarg) * (1 << 20)));
+        break;
+      case 'H': /* Huge page mode of the memory model */
+        mem_set_hugepages(atoi(optarg));
+        break;
       case 'v': /* Print per-trace performance breakdown */
         verbose = 1;
         break;
@@ -206,6 +356,8 @@ int main(int argc, char** argv) {
 
   /* Initialize the timing package */
   init_fsecs();
+  if (measure_perf && init_perfctr() == 0)
+    printf("Warning: no hardware events can be counted (see perf_event_paranoid)\n");
 
   /*
    * Optionally run and evaluate the libc malloc package
@@ -218,6 +370,9 @@ int main(int argc, char** argv) {
     libc_stats = (stats_t*) calloc(num_tracefiles, sizeof(stats_t));
     if (libc_stats == NULL)
       unix_error("libc_stats calloc in main failed");
+    libc_mt_stats = (mt_stats_t*) calloc(num_tracefiles, sizeof(mt_stats_t));
+    if (libc_mt_stats == NULL)
+      unix_error("libc_mt_stats calloc in main failed");
 
     /* Evaluate the libc malloc package using the K-best scheme */
     for (i = 0; i < num_tracefiles; i++) {
@@ -230,7 +385,13 @@ int main(int argc, char** argv) {
         speed_params.trace = trace;
         if (verbose > 1)
           printf("and performance.\n");
-        libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+        libc_stats[i].secs = fsecs_stats(eval_libc_speed, &speed_params, &fstats);
+        libc_stats[i].stddev = fstats.stddev;
+        libc_stats[i].runs = fstats.runs;
+        if (measure_perf)
+          perfctr(eval_libc_speed, &speed_params, PERF_RUNS, &libc_stats[i].perf);
+        if (num_threads > 0)
+          eval_mt_speed(trace, &libc_alloc, &libc_mt_stats[i]);
       }
       free_trace(trace);
     }
@@ -239,7 +400,11 @@ int main(int argc, char** argv) {
     if (verbose) {
       printf("\nResults for libc malloc:\n");
       printresults(num_tracefiles, libc_stats);
+      if (num_threads > 0)
+        print_mt_results(num_tracefiles, libc_mt_stats);
     }
+    if (measure_perf)
+      print_perf_results("libc malloc", num_tracefiles, libc_stats);
   }
 
   /*
@@ -252,9 +417,23 @@ int main(int argc, char** argv) {
   mm_stats = (stats_t*) calloc(num_tracefiles, sizeof(stats_t));
   if (mm_stats == NULL)
     unix_error("mm_stats calloc in main failed");
+  mm_mt_stats = (mt_stats_t*) calloc(num_tracefiles, sizeof(mt_stats_t));
+  if (mm_mt_stats == NULL)
+    unix_error("mm_mt_stats calloc in main failed");
+  if (measure_latency) {
+    mm_latency = (latency_t*) calloc(num_tracefiles, sizeof(latency_t));
+    if (mm_latency == NULL)
+      unix_error("mm_latency calloc in main failed");
+  }
 
-  /* Initialize the simulated memory system in memlib.c */
-  mem_init();
+  /*
+   * Initialize the simulated memory system in memlib.c, with one arena
+   * per replay thread if we replay on several threads
+   */
+  if (num_threads > 0)
+    mem_init_arenas(num_threads);
+  else
+    mem_init();
 
   /* Evaluate student's mm malloc package using the K-best scheme */
   for (i = 0; i < num_tracefiles; i++) {
@@ -267,11 +446,25 @@ int main(int argc, char** argv) {
       if (verbose > 1)
         printf("efficiency, ");
       mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+      if (verbose)
+        eval_mm_stats(trace, i);
       speed_params.trace = trace;
       speed_params.ranges = ranges;
       if (verbose > 1)
         printf("and performance.\n");
-      mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+      mm_stats[i].secs = fsecs_stats(eval_mm_speed, &speed_params, &fstats);
+      mm_stats[i].stddev = fstats.stddev;
+      mm_stats[i].runs = fstats.runs;
+      if (measure_perf)
+        perfctr(eval_mm_speed, &speed_params, PERF_RUNS, &mm_stats[i].perf);
+      if (measure_latency)
+        eval_mm_latency(trace, &mm_latency[i]);
+      if (num_threads > 0) {
+        mem_reset_brk();
+        if (mm_init() < 0)
+          app_error("mm_init failed in main");
+        eval_mt_speed(trace, &mm_alloc, &mm_mt_stats[i]);
+      }
     }
     free_trace(trace);
   }
@@ -280,8 +473,21 @@ int main(int argc, char** argv) {
   if (verbose) {
     printf("\nResults for mm malloc:\n");
     printresults(num_tracefiles, mm_stats);
+    if (num_threads > 0)
+      print_mt_results(num_tracefiles, mm_mt_stats);
     printf("\n");
   }
+  if (measure_perf) {
+    print_perf_results("mm malloc", num_tracefiles, mm_stats);
+    printf("\n");
+  }
+  if (measure_latency) {
+    print_latency_results(num_tracefiles, mm_latency);
+    printf("\n");
+  }
+
+  if (csvfile != NULL)
+    write_csv_results(num_tracefiles, tracefiles, mm_stats);
 
   /*
    * Accumulate the aggregate statistics for the student's mm package
@@ -333,21 +539,27 @@ int main(int argc, char** argv) {
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range tree, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. Since the
+ * ranges in the tree never overlap, a new payload only needs to be
+ * checked against its neighbors by address, so each check, insertion
+ * and removal takes O(log n) expected time.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range tree.
  */
 static int add_range(range_t** ranges, char* lo, int size,
                      int tracenum, int opnum) {
+  static unsigned seed = 1;
   char* hi = lo + size - 1;
   range_t* p;
+  range_t* pred = NULL; /* range with the highest lo <= lo */
+  range_t* succ = NULL; /* range with the lowest lo > lo */
   char msg[MAXLINE];
 
   assert(size > 0);
@@ -360,9 +572,11 @@ static int add_range(range_t** ranges, char* lo, int size,
     return 0;
   }
 
-  /* The payload must lie within the extent of the heap */
-  if ((lo < (char*) mem_heap_lo()) || (lo > (char*) mem_heap_hi()) ||
-      (hi < (char*) mem_heap_lo()) || (hi > (char*) mem_heap_hi())) {
+  /* The payload must lie within the extent of the heap, or of memory the
+     allocator mapped directly (as for huge blocks) */
+  if (((lo < (char*) mem_heap_lo()) || (lo > (char*) mem_heap_hi()) ||
+       (hi < (char*) mem_heap_lo()) || (hi > (char*) mem_heap_hi())) &&
+      !mem_is_mapped(lo, hi)) {
     sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
             lo, hi, mem_heap_lo(), mem_heap_hi());
     malloc_error(tracenum, opnum, msg);
@@ -370,45 +584,98 @@ static int add_range(range_t** ranges, char* lo, int size,
   }
 
   /* The payload must not overlap any other payloads */
-  for (p = *ranges; p != NULL; p = p->next) {
-    if ((lo >= p->lo && lo <= p->hi) ||
-        (hi >= p->lo && hi <= p->hi)) {
-      sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-              lo, hi, p->lo, p->hi);
-      malloc_error(tracenum, opnum, msg);
-      return 0;
+  for (p = *ranges; p != NULL; ) {
+    if (p->lo <= lo) {
+      pred = p;
+      p = p->right;
+    } else {
+      succ = p;
+      p = p->left;
     }
   }
+  p = (pred != NULL && pred->hi >= lo) ? pred :
+      (succ != NULL && succ->lo <= hi) ? succ : NULL;
+  if (p != NULL) {
+    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+            lo, hi, p->lo, p->hi);
+    malloc_error(tracenum, opnum, msg);
+    return 0;
+  }
 
   /*
    * Everything looks OK, so remember the extent of this block
-   * by creating a range struct and adding it the range list.
+   * by creating a range struct and adding it the range tree.
    */
   if ((p = (range_t*) malloc(sizeof(range_t))) == NULL)
     unix_error("malloc error in add_range");
-  p->next = *ranges;
   p->lo = lo;
   p->hi = hi;
-  *ranges = p;
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  p->priority = seed;
+  p->left = NULL;
+  p->right = NULL;
+  *ranges = range_insert(*ranges, p);
   return 1;
 }
 
+/*
+ * range_insert - insert p into the tree at root and return the new root,
+ *     rotating p up while its priority beats its parent's
+ */
+static range_t* range_insert(range_t* root, range_t* p) {
+  range_t* child;
+
+  if (root == NULL)
+    return p;
+  if (p->lo < root->lo) {
+    child = root->left = range_insert(root->left, p);
+    if (child->priority > root->priority) {
+      root->left = child->right;
+      child->right = root;
+      return child;
+    }
+  } else {
+    child = root->right = range_insert(root->right, p);
+    if (child->priority > root->priority) {
+      root->right = child->left;
+      child->left = root;
+      return child;
+    }
+  }
+  return root;
+}
+
+/*
+ * range_merge - join two trees, all of whose ranges in a lie below those
+ *     in b, and return the root of the result
+ */
+static range_t* range_merge(range_t* a, range_t* b) {
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (a->priority > b->priority) {
+    a->right = range_merge(a->right, b);
+    return a;
+  }
+  b->left = range_merge(a, b->left);
+  return b;
+}
+
 /*
  * remove_range - Free the range record of block whose payload starts at lo
  */
 static void remove_range(range_t** ranges, char* lo) {
+  range_t** link = ranges;
   range_t* p;
-  range_t** prevpp = ranges;
-  // int size;
-
-  for (p = *ranges; p != NULL; p = p->next) {
-    if (p->lo == lo) {
-      *prevpp = p->next;
-      // size = p->hi - p->lo + 1;
-      free(p);
-      break;
-    }
-    prevpp = &(p->next);
+
+  while ((p = *link) != NULL && p->lo != lo)
+    link = (lo < p->lo) ? &p->left : &p->right;
+  if (p != NULL) {
+    *link = range_merge(p->left, p->right);
+    free(p);
   }
 }
 
@@ -416,12 +683,14 @@ static void remove_range(range_t** ranges, char* lo) {
  * clear_ranges - free all of the range records for a trace
  */
 static void clear_ranges(range_t** ranges) {
-  range_t* p;
-  range_t* pnext;
+  range_t* p = *ranges;
+  range_t* right;
 
-  for (p = *ranges; p != NULL; p = pnext) {
-    pnext = p->next;
+  while (p != NULL) {
+    clear_ranges(&p->left);
+    right = p->right;
     free(p);
+    p = right;
   }
   *ranges = NULL;
 }
@@ -457,6 +726,19 @@ static trace_t* read_trace(char* tracedir, char* filename) {
     sprintf(msg, "Could not open %s in read_trace", path);
     unix_error(msg);
   }
+  trace->map = NULL;
+  trace->map_len = 0;
+  if (map_binary_trace(trace, path)) {
+    fclose(tracefile);
+    if ((trace->blocks =
+                 (char**) malloc(trace->num_ids * sizeof(char*))) == NULL)
+      unix_error("malloc 3 failed in read_trace");
+    if ((trace->block_sizes =
+                 (size_t*) malloc(trace->num_ids * sizeof(size_t))) == NULL)
+      unix_error("malloc 4 failed in read_trace");
+    return trace;
+  }
+
   fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
   fscanf(tracefile, "%d", &(trace->num_ids));
   fscanf(tracefile, "%d", &(trace->num_ops));
@@ -489,6 +771,18 @@ static trace_t* read_trace(char* tracedir, char* filename) {
         trace->ops[op_index].size = size;
         max_index = (index > max_index) ? index : max_index;
         break;
+      case 'r':
+#ifndef MDRIVER_REALLOC
+        printf("Tracefile %s has realloc requests; use mdriver-realloc\n",
+               path);
+        exit(1);
+#endif
+        fscanf(tracefile, "%u %u", &index, &size);
+        trace->ops[op_index].type = REALLOC;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].size = size;
+        max_index = (index > max_index) ? index : max_index;
+        break;
       case 'f':
         fscanf(tracefile, "%ud", &index);
         trace->ops[op_index].type = FREE;
@@ -508,12 +802,101 @@ static trace_t* read_trace(char* tracedir, char* filename) {
   return trace;
 }
 
+/*
+ * map_binary_trace - If path is a binary trace (see tracefmt.h), map it
+ *     and point trace->ops at its records, so that they are replayed in
+ *     place; the kernel pages the file in (and out again) as the replay
+ *     streams through it, so a trace may be larger than memory. Returns 0
+ *     if path is not a binary trace.
+ */
+static int map_binary_trace(trace_t* trace, char* path) {
+  tracefmt_header_t* header;
+  struct stat st;
+  size_t avail;
+  int fd;
+  int i;
+  int max_index = -1;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    sprintf(msg, "Could not open %s in read_trace", path);
+    unix_error(msg);
+  }
+  if (fstat(fd, &st) < 0)
+    unix_error("fstat failed in read_trace");
+  if ((size_t) st.st_size < sizeof(tracefmt_header_t)) {
+    close(fd);
+    return 0;
+  }
+  trace->map_len = st.st_size;
+  trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (trace->map == MAP_FAILED)
+    unix_error("mmap failed in read_trace");
+
+  header = (tracefmt_header_t*) trace->map;
+  if (memcmp(header->magic, TRACEFMT_MAGIC, TRACEFMT_MAGIC_LEN) != 0) {
+    munmap(trace->map, trace->map_len);
+    trace->map = NULL;
+    trace->map_len = 0;
+    return 0;
+  }
+  madvise(trace->map, trace->map_len, MADV_SEQUENTIAL);
+
+  /* A header written before the number of requests was known leaves it
+   * to the size of the file */
+  avail = (trace->map_len - sizeof(tracefmt_header_t)) / sizeof(traceop_t);
+  trace->sugg_heapsize = header->sugg_heapsize;
+  trace->num_ids = header->num_ids;
+  trace->num_ops = header->num_ops != 0 ? header->num_ops : (int) avail;
+  trace->weight = header->weight;
+  trace->ops = (traceop_t*) (header + 1);
+  if ((size_t) trace->num_ops > avail) {
+    printf("Tracefile %s is truncated\n", path);
+    exit(1);
+  }
+
+  /* One sequential pass over the records checks them, since nothing
+   * else bounds the ids before they index the block arrays */
+  for (i = 0; i < trace->num_ops; i++) {
+    switch (trace->ops[i].type) {
+      case REALLOC:
+#ifndef MDRIVER_REALLOC
+        printf("Tracefile %s has realloc requests; use mdriver-realloc\n",
+               path);
+        exit(1);
+#endif
+        /* fall through */
+      case ALLOC:
+      case FREE:
+        if (trace->ops[i].index < 0 || trace->ops[i].size < 0) {
+          printf("Bogus request %d in tracefile %s\n", i, path);
+          exit(1);
+        }
+        max_index = (trace->ops[i].index > max_index) ? trace->ops[i].index : max_index;
+        break;
+      default:
+        printf("Bogus type (%d) in tracefile %s\n", trace->ops[i].type, path);
+        exit(1);
+    }
+  }
+  if (trace->num_ids == 0) {
+    trace->num_ids = max_index + 1;
+  } else if (max_index >= trace->num_ids) {
+    printf("Tracefile %s uses id %d of only %d\n", path, max_index, trace->num_ids);
+    exit(1);
+  }
+  return 1;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t* trace) {
-  free(trace->ops);         /* free the three arrays... */
+  if (trace->map != NULL)   /* free the three arrays... */
+    munmap(trace->map, trace->map_len);
+  else
+    free(trace->ops);
   free(trace->blocks);
   free(trace->block_sizes);
   free(trace);              /* and the trace record itself... */
@@ -528,9 +911,12 @@ void free_trace(trace_t* trace) {
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static int eval_mm_valid(trace_t* trace, int tracenum, range_t** ranges) {
-  int i;
+  int i, j;
   int index;
   int size;
+  int oldsize;
+  char* newp;
+  char* oldp;
   char* p;
 
   /* Reset the heap and free any records in the range list */
@@ -577,6 +963,44 @@ static int eval_mm_valid(trace_t* trace, int tracenum, range_t** ranges) {
         trace->block_sizes[index] = size;
         break;
 
+      case REALLOC: /* mm_realloc */
+
+        /* Call the student's realloc */
+        oldp = trace->blocks[index];
+        if ((newp = mm_realloc(oldp, size)) == NULL) {
+          malloc_error(tracenum, i, "mm_realloc failed.");
+          return 0;
+        }
+
+        /* Remove the old region from the range list */
+        remove_range(ranges, oldp);
+
+        /* Check new block for correctness and add it to range list */
+        if (add_range(ranges, newp, size, tracenum, i) == 0)
+          return 0;
+
+        /* ADDED: cgw
+         * Make sure that the new block contains the data from the old
+         * block and then fill in the new block with the low order byte
+         * of the new index
+         */
+        oldsize = trace->block_sizes[index];
+        if (size < oldsize)
+          oldsize = size;
+        for (j = 0; j < oldsize; j++) {
+          if ((unsigned char) newp[j] != (index & 0xFF)) {
+            malloc_error(tracenum, i, "mm_realloc did not preserve the "
+                                      "data from old block");
+            return 0;
+          }
+        }
+        memset(newp, index & 0xFF, size);
+
+        /* Remember region */
+        trace->blocks[index] = newp;
+        trace->block_sizes[index] = size;
+        break;
+
       case FREE: /* mm_free */
 
         /* Remove region from list and call student's free function */
@@ -599,18 +1023,19 @@ static int eval_mm_valid(trace_t* trace, int tracenum, range_t** ranges) {
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size of the heap in bytes while running the student's malloc
+ *   package on the trace. Since the package may lower the brk pointer
+ *   again (see mm_trim), heapsize is the high water mark of the brk.
  */
 static double eval_mm_util(trace_t* trace, int tracenum, range_t** ranges) {
   int i;
   int index;
-  int size;
+  int size, newsize, oldsize;
   int max_total_size = 0;
   int total_size = 0;
   char* p;
+  char* newp;
+  char* oldp;
 
   /* initialize the heap and the mm malloc package */
   mem_reset_brk();
@@ -639,6 +1064,28 @@ static double eval_mm_util(trace_t* trace, int tracenum, range_t** ranges) {
                          total_size : max_total_size;
         break;
 
+      case REALLOC: /* mm_realloc */
+        index = trace->ops[i].index;
+        newsize = trace->ops[i].size;
+        oldsize = trace->block_sizes[index];
+
+        oldp = trace->blocks[index];
+        if ((newp = mm_realloc(oldp, newsize)) == NULL)
+          app_error("mm_realloc failed in eval_mm_util");
+
+        /* Remember region and size */
+        trace->blocks[index] = newp;
+        trace->block_sizes[index] = newsize;
+
+        /* Keep track of current total size
+         * of all allocated blocks */
+        total_size += (newsize - oldsize);
+
+        /* Update statistics */
+        max_total_size = (total_size > max_total_size) ?
+                         total_size : max_total_size;
+        break;
+
       case FREE: /* mm_free */
         index = trace->ops[i].index;
         size = trace->block_sizes[index];
@@ -657,7 +1104,7 @@ static double eval_mm_util(trace_t* trace, int tracenum, range_t** ranges) {
     }
   }
 
-  return ((double) max_total_size / (double) mem_heapsize());
+  return ((double) max_total_size / (double) mem_heap_peak());
 }
 
 
@@ -687,6 +1134,15 @@ static void eval_mm_speed(void* ptr) {
         trace->blocks[index] = p;
         break;
 
+      case REALLOC: /* mm_realloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        block = trace->blocks[index];
+        if ((p = mm_realloc(block, size)) == NULL)
+          app_error("mm_realloc error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
       case FREE: /* mm_free */
         index = trace->ops[i].index;
         block = trace->blocks[index];
@@ -698,6 +1154,196 @@ static void eval_mm_speed(void* ptr) {
     }
 }
 
+/*
+ * eval_mm_stats - Replay the trace once more and check the mm_stats
+ *    counters against it: the blocks handed out and given back, their
+ *    bytes in use when the trace frees every block it allocates, and the
+ *    heap size against memlib's. Only the change over the replay is
+ *    compared, since the counters are kept across mm_init.
+ */
+static void eval_mm_stats(trace_t* trace, int tracenum) {
+  struct mm_stats before, after;
+  size_t mallocs, frees, heap_size;
+  int allocs = 0, reallocs = 0, releases = 0;
+  int i, c, index, size;
+  char* p;
+
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_stats");
+  mm_stats(&before);
+
+  for (i = 0; i < trace->num_ops; i++) {
+    index = trace->ops[i].index;
+    size = trace->ops[i].size;
+    switch (trace->ops[i].type) {
+      case ALLOC: /* mm_malloc */
+        if ((p = mm_malloc(size)) == NULL)
+          app_error("mm_malloc error in eval_mm_stats");
+        trace->blocks[index] = p;
+        allocs++;
+        break;
+
+      case REALLOC: /* mm_realloc */
+        if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+          app_error("mm_realloc error in eval_mm_stats");
+        trace->blocks[index] = p;
+        reallocs++;
+        break;
+
+      case FREE: /* mm_free */
+        mm_free(trace->blocks[index]);
+        releases++;
+        break;
+
+      default:
+        app_error("Nonexistent request type in eval_mm_stats");
+    }
+  }
+  mm_stats(&after);
+
+  mallocs = frees = 0;
+  for (c = 0; c < after.num_classes; c++) {
+    mallocs += after.mallocs[c] - before.mallocs[c];
+    frees += after.frees[c] - before.frees[c];
+  }
+  heap_size = 0;
+  for (i = 0; i < mem_arena_count(); i++)
+    heap_size += mem_arena_heapsize(i);
+
+  /* A realloc that moves a block counts as a malloc and a free */
+  if (mallocs < (size_t) allocs || (reallocs == 0 && mallocs != (size_t) allocs) ||
+      frees < (size_t) releases || (reallocs == 0 && frees != (size_t) releases) ||
+      mallocs - allocs != frees - releases) {
+    errors++;
+    printf("ERROR [trace %d]: mm_stats counted %zu mallocs and %zu frees for %d and %d\n",
+           tracenum, mallocs, frees, allocs, releases);
+  }
+  if (allocs == releases) {
+    if (after.in_use_bytes != before.in_use_bytes) {
+      errors++;
+      printf("ERROR [trace %d]: mm_stats has %ld bytes in use after freeing every block\n",
+             tracenum, (long) (after.in_use_bytes - before.in_use_bytes));
+    }
+    for (c = 0; c < after.num_classes && reallocs == 0; c++) {
+      if (after.mallocs[c] - before.mallocs[c] != after.frees[c] - before.frees[c]) {
+        errors++;
+        printf("ERROR [trace %d]: mm_stats size class %d has %zu mallocs but %zu frees\n",
+               tracenum, c, after.mallocs[c] - before.mallocs[c],
+               after.frees[c] - before.frees[c]);
+      }
+    }
+  }
+  if (after.heap_size != heap_size) {
+    errors++;
+    printf("ERROR [trace %d]: mm_stats heap size %zu, but memlib has %zu\n",
+           tracenum, after.heap_size, heap_size);
+  }
+}
+
+/*
+ * eval_mm_latency - Replay the trace once more, timing each request with
+ *    the cycle counter (less the counter's own overhead) and counting the
+ *    free blocks each mm_malloc looked at.
+ */
+static void eval_mm_latency(trace_t* trace, latency_t* latency) {
+  int i, index, size;
+  char* p;
+  char* block;
+  double overhead = ovhd();
+  double cycles;
+  size_t steps;
+
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed in eval_mm_latency");
+
+  for (i = 0; i < trace->num_ops; i++) {
+    index = trace->ops[i].index;
+    size = trace->ops[i].size;
+    switch (trace->ops[i].type) {
+      case ALLOC: /* mm_malloc */
+        steps = mm_search_steps();
+        start_counter();
+        p = mm_malloc(size);
+        cycles = get_counter();
+        if (p == NULL)
+          app_error("mm_malloc error in eval_mm_latency");
+        trace->blocks[index] = p;
+        hist_add(&latency->malloc_cyc, cycles > overhead ? cycles - overhead : 0);
+        hist_add(&latency->search, mm_search_steps() - steps);
+        break;
+
+      case REALLOC: /* mm_realloc */
+        block = trace->blocks[index];
+        start_counter();
+        p = mm_realloc(block, size);
+        cycles = get_counter();
+        if (p == NULL)
+          app_error("mm_realloc error in eval_mm_latency");
+        trace->blocks[index] = p;
+        hist_add(&latency->realloc_cyc, cycles > overhead ? cycles - overhead : 0);
+        break;
+
+      case FREE: /* mm_free */
+        block = trace->blocks[index];
+        start_counter();
+        mm_free(block);
+        cycles = get_counter();
+        hist_add(&latency->free_cyc, cycles > overhead ? cycles - overhead : 0);
+        break;
+
+      default:
+        app_error("Nonexistent request type in eval_mm_latency");
+    }
+  }
+  latency->valid = 1;
+}
+
+/*
+ * hist_add - count value in its log-linear bucket
+ */
+static void hist_add(hist_t* hist, unsigned long long value) {
+  int exp, bucket;
+
+  if (value < (1 << HIST_SUB_BITS)) {
+    bucket = value;
+  } else {
+    exp = 63 - __builtin_clzll(value);
+    bucket = ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+             ((value >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+  }
+  hist->count[bucket]++;
+  hist->n++;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+/*
+ * hist_percentile - return the smallest value of the bucket that holds
+ *    the value at fraction p of the sorted values (the max for p = 1)
+ */
+static unsigned long long hist_percentile(hist_t* hist, double p) {
+  unsigned long long rank = (unsigned long long) (p * hist->n + 0.5);
+  unsigned long long seen = 0;
+  int bucket, exp;
+
+  if (rank >= hist->n)
+    return hist->max;
+  if (rank < 1)
+    rank = 1;
+  for (bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+    seen += hist->count[bucket];
+    if (seen >= rank)
+      break;
+  }
+  if (bucket < (1 << HIST_SUB_BITS))
+    return bucket;
+  exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  return (unsigned long long) ((1 << HIST_SUB_BITS) + (bucket & ((1 << HIST_SUB_BITS) - 1)))
+         << (exp - HIST_SUB_BITS);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -718,6 +1364,15 @@ static int eval_libc_valid(trace_t* trace, int tracenum) {
         trace->blocks[trace->ops[i].index] = p;
         break;
 
+      case REALLOC: /* realloc */
+        p = realloc(trace->blocks[trace->ops[i].index], trace->ops[i].size);
+        if (p == NULL) {
+          malloc_error(tracenum, i, "libc realloc failed");
+          unix_error("System message");
+        }
+        trace->blocks[trace->ops[i].index] = p;
+        break;
+
       case FREE: /* free */
         free(trace->blocks[trace->ops[i].index]);
         break;
@@ -751,6 +1406,15 @@ static void eval_libc_speed(void* ptr) {
         trace->blocks[index] = p;
         break;
 
+      case REALLOC: /* realloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        block = trace->blocks[index];
+        if ((p = realloc(block, size)) == NULL)
+          unix_error("realloc failed in eval_libc_speed");
+        trace->blocks[index] = p;
+        break;
+
       case FREE: /* free */
         index = trace->ops[i].index;
         block = trace->blocks[index];
@@ -760,6 +1424,169 @@ static void eval_libc_speed(void* ptr) {
   }
 }
 
+/*******************************************************************
+ * The following functions replay a trace on several threads at once
+ * (-T) to measure how an allocator scales. Every thread replays its
+ * own copy of the trace; with -x, a fraction of the frees is handed
+ * to the next thread, which frees the block on the allocator's behalf.
+ ******************************************************************/
+
+/*
+ * eval_mt_speed - Replay trace on num_threads threads at once with the
+ *    given allocator and record per-thread and wall-clock times
+ */
+static void eval_mt_speed(trace_t* trace, mt_alloc_t* alloc, mt_stats_t* stats) {
+  pthread_t* tids;
+  double start, end;
+  int i;
+
+  if ((mt_threads = (mt_thread_t*) calloc(num_threads, sizeof(mt_thread_t))) == NULL)
+    unix_error("calloc 1 failed in eval_mt_speed");
+  if ((tids = (pthread_t*) malloc(num_threads * sizeof(pthread_t))) == NULL)
+    unix_error("malloc 1 failed in eval_mt_speed");
+  if ((stats->thread_secs = (double*) malloc(num_threads * sizeof(double))) == NULL)
+    unix_error("malloc 2 failed in eval_mt_speed");
+
+  for (i = 0; i < num_threads; i++) {
+    mt_threads[i].id = i;
+    mt_threads[i].trace = trace;
+    mt_threads[i].alloc = alloc;
+    mt_threads[i].seed = i + 1;
+    pthread_mutex_init(&mt_threads[i].lock, NULL);
+    if ((mt_threads[i].blocks = (char**) calloc(trace->num_ids, sizeof(char*))) == NULL ||
+        (mt_threads[i].inbox = (char**) malloc(trace->num_ops * sizeof(char*))) == NULL)
+      unix_error("malloc 3 failed in eval_mt_speed");
+  }
+
+  mt_done = 0;
+  pthread_barrier_init(&mt_barrier, NULL, num_threads);
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create(&tids[i], NULL, mt_replay, &mt_threads[i]) != 0)
+      unix_error("pthread_create failed in eval_mt_speed");
+  }
+  for (i = 0; i < num_threads; i++)
+    pthread_join(tids[i], NULL);
+
+  /* Wall-clock time runs from the first thread's start to the last one's end */
+  start = DBL_MAX;
+  end = 0;
+  for (i = 0; i < num_threads; i++) {
+    start = (mt_threads[i].start < start) ? mt_threads[i].start : start;
+    end = (mt_threads[i].end > end) ? mt_threads[i].end : end;
+  }
+  stats->valid = 1;
+  stats->ops = (double) trace->num_ops * num_threads;
+  stats->secs = end - start;
+  for (i = 0; i < num_threads; i++) {
+    assert(mt_threads[i].inbox_len == 0);  /* every free was timed */
+    stats->thread_secs[i] = mt_threads[i].end - mt_threads[i].start;
+    pthread_mutex_destroy(&mt_threads[i].lock);
+    free(mt_threads[i].blocks);
+    free(mt_threads[i].inbox);
+  }
+  pthread_barrier_destroy(&mt_barrier);
+  free(mt_threads);
+  free(tids);
+}
+
+/*
+ * mt_replay - Thread body of eval_mt_speed: replay the whole trace once,
+ *    then keep freeing the blocks handed over until every thread is done,
+ *    so that all the frees fall inside the timed interval
+ */
+static void* mt_replay(void* arg) {
+  mt_thread_t* self = (mt_thread_t*) arg;
+  mt_thread_t* next = &mt_threads[(self->id + 1) % num_threads];
+  trace_t* trace = self->trace;
+  mt_alloc_t* alloc = self->alloc;
+  int i, index;
+  char* p;
+
+  pthread_barrier_wait(&mt_barrier);
+  self->start = mt_now();
+
+  for (i = 0; i < trace->num_ops; i++) {
+    index = trace->ops[i].index;
+    switch (trace->ops[i].type) {
+      case ALLOC:
+        if ((p = alloc->malloc_fn(trace->ops[i].size)) == NULL)
+          app_error("malloc failed in mt_replay");
+        self->blocks[index] = p;
+        break;
+
+      case REALLOC:
+        if ((p = alloc->realloc_fn(self->blocks[index], trace->ops[i].size)) == NULL)
+          app_error("realloc failed in mt_replay");
+        self->blocks[index] = p;
+        break;
+
+      case FREE:
+        p = self->blocks[index];
+        if (num_threads > 1 &&
+            rand_r(&self->seed) < cross_frac * ((double) RAND_MAX + 1)) {
+          /* Wait for a full inbox to be drained (when the threads share
+             CPUs, its owner may not be running), freeing our own meanwhile */
+          pthread_mutex_lock(&next->lock);
+          while (next->inbox_len >= MT_INBOX_MAX) {
+            pthread_mutex_unlock(&next->lock);
+            mt_drain_inbox(self);
+            sched_yield();
+            pthread_mutex_lock(&next->lock);
+          }
+          next->inbox[next->inbox_len++] = p;
+          pthread_mutex_unlock(&next->lock);
+        } else {
+          alloc->free_fn(p);
+        }
+        break;
+    }
+    if (i % MT_DRAIN_OPS == 0)
+      mt_drain_inbox(self);
+  }
+
+  /* Only threads still replaying hand blocks over */
+  __atomic_add_fetch(&mt_done, 1, __ATOMIC_ACQ_REL);
+  while (__atomic_load_n(&mt_done, __ATOMIC_ACQUIRE) < num_threads) {
+    mt_drain_inbox(self);
+    sched_yield();
+  }
+  mt_drain_inbox(self);
+
+  self->end = mt_now();
+  return NULL;
+}
+
+/*
+ * mt_drain_inbox - Free every block other threads handed to this one
+ */
+static void mt_drain_inbox(mt_thread_t* self) {
+  int i;
+
+  pthread_mutex_lock(&self->lock);
+  for (i = 0; i < self->inbox_len; i++)
+    self->alloc->free_fn(self->inbox[i]);
+  self->inbox_len = 0;
+  pthread_mutex_unlock(&self->lock);
+}
+
+/*
+ * mt_now - Current time in seconds from a monotonic clock
+ */
+static double mt_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * mm_realloc_fn - Function-pointer wrapper, since mm_realloc may be
+ *    the stub macro in drivers built without realloc support
+ */
+static void* mm_realloc_fn(void* ptr, size_t size) {
+  return mm_realloc(ptr, size);
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -775,17 +1602,19 @@ static void printresults(int n, stats_t* stats) {
   double util = 0;
 
   /* Print the individual results for each trace */
-  printf("%5s%7s %5s%8s%10s%8s\n",
-         "trace", " valid", "util", "ops", "secs", "Kops");
+  printf("%5s%7s %5s%8s%10s%8s%7s%5s\n",
+         "trace", " valid", "util", "ops", "secs", "Kops", "+-", "runs");
   for (i = 0; i < n; i++) {
     if (stats[i].valid) {
-      printf("%2d%10s%5.0f%%%8.0f%10.6f%8.0f\n",
+      printf("%2d%10s%5.0f%%%8.0f%10.6f%8.0f%6.1f%%%5d\n",
              i,
              "yes",
              stats[i].util * 100.0,
              stats[i].ops,
              stats[i].secs,
-             (stats[i].ops / 1e3) / stats[i].secs);
+             (stats[i].ops / 1e3) / stats[i].secs,
+             100.0 * stats[i].stddev / stats[i].secs,
+             stats[i].runs);
       secs += stats[i].secs;
       ops += stats[i].ops;
       util += stats[i].util;
@@ -818,6 +1647,170 @@ static void printresults(int n, stats_t* stats) {
   }
 }
 
+/*
+ * write_csv_results - write the results of each trace to csvfile, one
+ *     line per trace, for scripts that compare runs
+ */
+static void write_csv_results(int n, char** tracefiles, stats_t* stats) {
+  FILE* f;
+  int i, e;
+
+  if ((f = fopen(csvfile, "w")) == NULL) {
+    sprintf(msg, "Could not create %s", csvfile);
+    unix_error(msg);
+  }
+  /* With -P, the hardware event counts of each trace follow (empty if
+     the event could not be counted) */
+  fprintf(f, "trace,valid,util,ops,secs,kops,stddev,runs");
+  for (e = 0; measure_perf && e < PERFCTR_NUM_EVENTS; e++)
+    fprintf(f, ",%s", perfctr_name(e));
+  fprintf(f, "\n");
+  for (i = 0; i < n; i++) {
+    if (stats[i].valid)
+      fprintf(f, "%s,1,%.4f,%.0f,%.6f,%.0f,%.6f,%d", tracefiles[i], stats[i].util,
+              stats[i].ops, stats[i].secs, (stats[i].ops / 1e3) / stats[i].secs,
+              stats[i].stddev, stats[i].runs);
+    else
+      fprintf(f, "%s,0,,,,,,", tracefiles[i]);
+    for (e = 0; measure_perf && e < PERFCTR_NUM_EVENTS; e++) {
+      if (stats[i].valid && stats[i].perf.count[e] >= 0)
+        fprintf(f, ",%.0f", stats[i].perf.count[e]);
+      else
+        fprintf(f, ",");
+    }
+    fprintf(f, "\n");
+  }
+  fclose(f);
+}
+
+/*
+ * print_mt_results - prints a multithreaded replay (-T) summary
+ */
+static void print_mt_results(int n, mt_stats_t* stats) {
+  int i, t;
+  double thread_kops;
+  double min_kops, max_kops;
+
+  printf("\nReplay on %d threads, %.0f%% of frees by another thread:\n",
+         num_threads, cross_frac * 100.0);
+  printf("%5s%12s%12s%12s\n", "trace", "min Kops/t", "max Kops/t", "total Kops");
+  for (i = 0; i < n; i++) {
+    if (!stats[i].valid) {
+      printf("%2d%15s%12s%12s\n", i, "-", "-", "-");
+      continue;
+    }
+    min_kops = DBL_MAX;
+    max_kops = 0;
+    for (t = 0; t < num_threads; t++) {
+      thread_kops = (stats[i].ops / num_threads / 1e3) / stats[i].thread_secs[t];
+      min_kops = (thread_kops < min_kops) ? thread_kops : min_kops;
+      max_kops = (thread_kops > max_kops) ? thread_kops : max_kops;
+    }
+    printf("%2d%15.0f%12.0f%12.0f\n",
+           i, min_kops, max_kops, (stats[i].ops / 1e3) / stats[i].secs);
+    if (verbose > 1) {
+      for (t = 0; t < num_threads; t++)
+        printf("%12s %2d: %10.6f secs%10.0f Kops\n", "thread", t,
+               stats[i].thread_secs[t],
+               (stats[i].ops / num_threads / 1e3) / stats[i].thread_secs[t]);
+    }
+  }
+}
+
+/*
+ * print_latency_results - prints the percentiles of each histogram (-L)
+ */
+static void print_latency_results(int n, latency_t* latency) {
+  int i, k;
+  struct {
+    char* name;
+    size_t offset;
+  } kinds[] = {
+    { "malloc", offsetof(latency_t, malloc_cyc) },
+    { "free", offsetof(latency_t, free_cyc) },
+    { "realloc", offsetof(latency_t, realloc_cyc) },
+    { "search", offsetof(latency_t, search) },
+  };
+  hist_t* hist;
+
+  printf("Per-operation latency in cycles, and free blocks searched per malloc:\n");
+  printf("%5s%9s%10s%10s%10s%10s%12s\n",
+         "trace", "op", "ops", "p50", "p99", "p99.9", "max");
+  for (i = 0; i < n; i++) {
+    if (!latency[i].valid) {
+      printf("%2d%12s\n", i, "-");
+      continue;
+    }
+    for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+      hist = (hist_t*) ((char*) &latency[i] + kinds[k].offset);
+      if (hist->n == 0)
+        continue;
+      printf("%2d%12s%10llu%10llu%10llu%10llu%12llu\n",
+             i, kinds[k].name, hist->n,
+             hist_percentile(hist, 0.5),
+             hist_percentile(hist, 0.99),
+             hist_percentile(hist, 0.999),
+             hist->max);
+    }
+  }
+}
+
+/*
+ * print_perf_results - prints the hardware events per op of each trace,
+ *     and the instructions per cycle (-P)
+ */
+static void print_perf_results(char* name, int n, stats_t* stats) {
+  double total[PERFCTR_NUM_EVENTS];
+  double ops = 0;
+  double* count;
+  int i, e;
+
+  printf("\nHardware events per op for %s:\n", name);
+  printf("%5s%8s", "trace", "ops");
+  for (e = 0; e < PERFCTR_NUM_EVENTS; e++) {
+    printf("%8s", perfctr_name(e));
+    if (e == PERFCTR_INSTRUCTIONS)
+      printf("%6s", "IPC");
+  }
+  printf("\n");
+
+  for (e = 0; e < PERFCTR_NUM_EVENTS; e++)
+    total[e] = 0;
+  for (i = 0; i <= n; i++) {
+    if (i < n) {
+      if (!stats[i].valid) {
+        printf("%2d%11s\n", i, "-");
+        continue;
+      }
+      count = stats[i].perf.count;
+      ops += stats[i].ops;
+      for (e = 0; e < PERFCTR_NUM_EVENTS; e++)
+        total[e] = (count[e] < 0 || total[e] < 0) ? -1 : total[e] + count[e];
+      printf("%2d%11.0f", i, stats[i].ops);
+    } else {
+      /* The events per op over all of the valid traces */
+      if (ops == 0)
+        break;
+      count = total;
+      printf("%5s%8.0f", "Total", ops);
+    }
+    for (e = 0; e < PERFCTR_NUM_EVENTS; e++) {
+      if (count[e] < 0)
+        printf("%8s", "-");
+      else
+        printf(e <= PERFCTR_INSTRUCTIONS ? "%8.1f" : "%8.3f",
+               count[e] / (i < n ? stats[i].ops : ops));
+      if (e == PERFCTR_INSTRUCTIONS) {
+        if (count[PERFCTR_CYCLES] > 0 && count[PERFCTR_INSTRUCTIONS] >= 0)
+          printf("%6.2f", count[PERFCTR_INSTRUCTIONS] / count[PERFCTR_CYCLES]);
+        else
+          printf("%6s", "-");
+      }
+    }
+    printf("\n");
+  }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -846,13 +1839,21 @@ void malloc_error(int tracenum, int opnum, char* msg) {
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+  fprintf(stderr, "Usage: mdriver [-hvValLP] [-f <file>] [-t <dir>] [-T <n> [-x <frac>]]\n");
+  fprintf(stderr, "               [-M <mb>] [-H <mode>] [-c <csv>]\n");
   fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-c <csv>   Write the results of each trace to <csv>.\n");
   fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
   fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
+  fprintf(stderr, "\t-H <mode>  Huge pages: 0 none, 1 transparent, 2 hugetlb.\n");
   fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+  fprintf(stderr, "\t-L         Print latency and search-length percentiles.\n");
+  fprintf(stderr, "\t-M <mb>    Maximum heap size (of each arena) in MB.\n");
+  fprintf(stderr, "\t-P         Print hardware events per op (perf_event_open).\n");
   fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
-  fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
+  fprintf(stderr, "\t-T <n>     Also replay each trace on n threads at once.\n");
+  fprintf(stderr, "\t-x <frac>  Fraction of frees done by another thread (-T).\n");
+  fprintf(stderr, "\t-v         Print per-trace performance breakdowns, and check mm_stats.\n");
   fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
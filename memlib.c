@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,79 +11,607 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * Each arena is an independent heap with its own brk pointer, so an address
+ * can be mapped back to its arena by range. The modeled VM holds
+ * mem_num_arenas consecutive arenas of mem_max_heap() bytes (MAX_HEAP unless
+ * set with mem_set_max_heap, rounded up to whole commit units). Arena 0 is
+ * the classic heap used by mem_sbrk, mem_heap_lo, mem_heap_hi, and
+ * mem_heapsize.
+ *
+ * An arena's brk may also be lowered. Pages below the brk can be handed back
+ * with mem_release, so the bytes actually resident in memory may be fewer
+ * than the bytes reserved below the brk.
+ *
+ * Each arena also tracks the address from which its bytes are known to read
+ * as zero (mem_arena_zero): the highest brk it has had, which mem_reset_brk
+ * keeps, until lowering the brk releases the pages above it.
+ *
+ * With MEM_MMAP, the VM is only reserved as inaccessible address space up
+ * front, and each arena commits pages (in units of mem_commit_unit) as its
+ * brk advances, so large arenas cost nothing until they are used.
+ */
+
+/* size of a huge page for MEM_HUGEPAGES (the x86-64 default) */
+#define MEM_HUGE_PAGE_SIZE (2 * (1 << 20))
+
+/* older headers lack it; a plain hint never replaces a mapping either */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
 /* private variables */
 static char* mem_start_brk;  /* points to first byte of heap */
-static char* mem_brk;        /* points to last byte of heap */
 static char* mem_max_addr;   /* largest legal heap address */
+static size_t mem_arena_span;/* bytes reserved for each arena */
+static int mem_num_arenas;   /* number of arenas in use */
+static void* mem_map_start;  /* storage as returned by mmap or malloc */
+static size_t mem_map_size;  /* bytes of that storage */
+static size_t mem_commit_unit;  /* granularity of committing (and releasing) pages */
+static size_t mem_max_heap_size = MAX_HEAP; /* requested bytes per arena */
+static int mem_huge = MEM_HUGEPAGES;        /* huge page mode in use */
+
+static char* arena_start[MEM_MAX_ARENAS]; /* first byte of each arena */
+static char* arena_brk[MEM_MAX_ARENAS];   /* current brk of each arena */
+static char* arena_max[MEM_MAX_ARENAS];   /* largest legal arena address */
+static char* arena_commit[MEM_MAX_ARENAS];/* end of the accessible pages */
+static char* arena_zero[MEM_MAX_ARENAS];  /* bytes from here on read as zero */
+
+/* serializes updates of each arena's brk so mem_sbrk may be called concurrently */
+static pthread_mutex_t arena_brk_lock[MEM_MAX_ARENAS] = {
+        [0 ... MEM_MAX_ARENAS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static size_t mem_mapped;    /* bytes currently handed out by mem_map */
+static size_t mem_peak;      /* largest footprint since the last reset */
+static pthread_mutex_t mem_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the memory handed out by mem_map, for mem_is_mapped (under mem_stat_lock) */
+typedef struct {
+    char* lo;
+    size_t len;
+} mem_region_t;
+static mem_region_t* mem_regions;
+static size_t mem_num_regions;
+static size_t mem_regions_size;
 
 /*
- * mem_init - initialize the memory system model
+ * mem_update_peak - account for a change of the footprint (all arenas plus
+ *    mem_map memory) by mapped_incr bytes of mem_map memory
+ */
+static void mem_update_peak(intptr_t mapped_incr) {
+  size_t footprint;
+  int i;
+
+  pthread_mutex_lock(&mem_stat_lock);
+  mem_mapped += mapped_incr;
+  footprint = mem_mapped;
+  for (i = 0; i < mem_num_arenas; i++) {
+    footprint += arena_brk[i] - arena_start[i];
+  }
+  if (footprint > mem_peak) {
+    mem_peak = footprint;
+  }
+  pthread_mutex_unlock(&mem_stat_lock);
+}
+
+/*
+ * mem_init - initialize the memory system model with MEM_ARENAS arenas
  */
 void mem_init(void) {
+  mem_init_arenas(MEM_ARENAS);
+}
+
+/*
+ * mem_set_max_heap - set the size of each arena for later calls of
+ *    mem_init and mem_init_arenas (MAX_HEAP by default)
+ */
+void mem_set_max_heap(size_t size) {
+  mem_max_heap_size = size;
+}
+
+/*
+ * mem_set_hugepages - set the huge page mode (see MEM_HUGEPAGES) for later
+ *    calls of mem_init and mem_init_arenas
+ */
+void mem_set_hugepages(int mode) {
+  mem_huge = mode;
+}
+
+#if MEM_MMAP
+/*
+ * mem_reserve - reserve size bytes of address space aligned to
+ *    mem_commit_unit, preferring huge pages if asked to
+ */
+static char* mem_reserve(size_t size) {
+  void* p = MAP_FAILED;
+  uintptr_t start;
+
+#ifdef MAP_HUGETLB
+  /* hugetlb pages are reserved up front, so the mmap fails (and we fall
+     back to transparent huge pages) when not enough of them are set aside */
+  if (mem_huge == 2) {
+    mem_map_size = size;
+    p = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED)
+      mem_huge = 1;
+  }
+#endif
+  if (p == MAP_FAILED) {
+    /* over-reserve so the start can be aligned to a commit unit */
+    mem_map_size = size + mem_commit_unit;
+    p = mmap(NULL, mem_map_size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+      return NULL;
+  }
+  mem_map_start = p;
+
+  start = ((uintptr_t) p + mem_commit_unit - 1) & ~(uintptr_t) (mem_commit_unit - 1);
+#ifdef MADV_HUGEPAGE
+  if (mem_huge == 1)
+    madvise((void*) start, size, MADV_HUGEPAGE);
+#endif
+  return (char*) start;
+}
+
+/*
+ * mem_commit - make the pages of an arena up to new_brk accessible. Called
+ *    with the arena's brk lock held; returns -1 if the pages cannot be had.
+ */
+static int mem_commit(int arena, char* new_brk) {
+  uintptr_t end;
+
+  if (new_brk <= arena_commit[arena])
+    return 0;
+  end = ((uintptr_t) new_brk + mem_commit_unit - 1) & ~(uintptr_t) (mem_commit_unit - 1);
+  if (mprotect(arena_commit[arena], (char*) end - arena_commit[arena],
+               PROT_READ | PROT_WRITE) != 0)
+    return -1;
+  arena_commit[arena] = (char*) end;
+  return 0;
+}
+#else
+#define mem_commit(arena, new_brk) 0
+#endif
+
+/*
+ * mem_layout - lay out mem_num_arenas empty arenas from mem_start_brk on
+ */
+static void mem_layout(void) {
+  int i;
+
+  mem_max_addr = mem_start_brk + mem_num_arenas * mem_arena_span;  /* max legal heap address */
+  for (i = 0; i < mem_num_arenas; i++) {
+    arena_start[i] = mem_start_brk + i * mem_arena_span;
+    arena_max[i] = arena_start[i] + mem_arena_span;
+    arena_brk[i] = arena_start[i];          /* heap is empty initially */
+    arena_commit[i] = MEM_MMAP ? arena_start[i] : arena_max[i];
+    arena_zero[i] = MEM_MMAP ? arena_start[i] : arena_max[i];  /* malloc'd storage is not cleared */
+  }
+}
+
+/*
+ * mem_init_arenas - initialize the memory system model with num_arenas
+ *    independent heaps of up to mem_max_heap() bytes each
+ */
+void mem_init_arenas(int num_arenas) {
+  if (num_arenas < 1 || num_arenas > MEM_MAX_ARENAS) {
+    fprintf(stderr, "mem_init_arenas: bad arena count %d\n", num_arenas);
+    exit(1);
+  }
+
   /* allocate the storage we will use to model the available VM */
-  if ((mem_start_brk = (char*) malloc(MAX_HEAP)) == NULL) {
-    fprintf(stderr, "mem_init_vm: malloc error\n");
+  mem_commit_unit = (MEM_MMAP && mem_huge) ? MEM_HUGE_PAGE_SIZE : mem_pagesize();
+  mem_arena_span = (mem_max_heap_size + mem_commit_unit - 1) & ~(mem_commit_unit - 1);
+#if MEM_MMAP
+  mem_start_brk = mem_reserve(num_arenas * mem_arena_span);
+#else
+  mem_map_size = num_arenas * mem_arena_span;
+  mem_start_brk = mem_map_start = malloc(mem_map_size);
+#endif
+  if (mem_start_brk == NULL) {
+    fprintf(stderr, "mem_init_vm: cannot reserve %zu bytes\n",
+            num_arenas * mem_arena_span);
     exit(1);
   }
 
-  mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-  mem_brk = mem_start_brk;                  /* heap is empty initially */
+  mem_num_arenas = num_arenas;
+  mem_layout();
+}
+
+/*
+ * mem_set_base - move the modeled VM so that arena 0 starts at base, which
+ *    must be a multiple of the commit unit. Only allowed while every arena
+ *    is empty. Returns 0, or -1 if the address range is already in use (or
+ *    the VM is not an mmap reservation).
+ */
+int mem_set_base(void* base) {
+#if MEM_MMAP
+  size_t size = mem_num_arenas * mem_arena_span;
+  void* p;
+  int i;
+
+  if ((char*) base == mem_start_brk)
+    return 0;
+  for (i = 0; i < mem_num_arenas; i++)
+    if (arena_brk[i] != arena_start[i])
+      return -1;
+  if ((uintptr_t) base % mem_commit_unit != 0)
+    return -1;
+
+  /* never replace what is already mapped there; kernels that do not know
+     MAP_FIXED_NOREPLACE take the address as a hint only */
+  p = mmap(base, size, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+  if (p == MAP_FAILED)
+    return -1;
+  if (p != base) {
+    munmap(p, size);
+    return -1;
+  }
+#ifdef MADV_HUGEPAGE
+  if (mem_huge)
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+  munmap(mem_map_start, mem_map_size);
+  mem_map_start = base;
+  mem_map_size = size;
+  mem_start_brk = (char*) base;
+  mem_layout();
+  return 0;
+#else
+  return (char*) base == mem_start_brk ? 0 : -1;
+#endif
 }
 
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
-  free(mem_start_brk);
+#if MEM_MMAP
+  munmap(mem_map_start, mem_map_size);
+#else
+  free(mem_map_start);
+#endif
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make empty heaps
  */
 void mem_reset_brk() {
-  mem_brk = mem_start_brk;
+  int i;
+
+  for (i = 0; i < mem_num_arenas; i++) {
+    arena_brk[i] = arena_start[i];
+  }
+  mem_peak = mem_mapped;
+}
+
+/*
+ * mem_release_above - give back the pages of an arena above its brk, just
+ *    lowered from old_brk. With MEM_MMAP, this goes up to where they are
+ *    already zero, and the bytes from the first whole page above the brk on
+ *    then read as zero.
+ */
+static void mem_release_above(int arena, char* brk, char* old_brk) {
+  uintptr_t pagesize = mem_huge == 2 ? mem_commit_unit : mem_pagesize();
+  char* lo = (char*) (((uintptr_t) brk + pagesize - 1) & ~(pagesize - 1));
+  char* hi;
+
+  if (!MEM_MMAP) {
+    mem_release(brk, old_brk - brk);
+    return;
+  }
+  hi = (char*) (((uintptr_t) arena_zero[arena] + pagesize - 1) & ~(pagesize - 1));
+  if (hi > lo && mem_release(lo, hi - lo) == (size_t) (hi - lo)) {
+    pthread_mutex_lock(&arena_brk_lock[arena]);
+    if (arena_brk[arena] <= lo) {
+      arena_zero[arena] = lo;
+    }
+    pthread_mutex_unlock(&arena_brk_lock[arena]);
+  }
 }
 
 /*
- * mem_sbrk - simple model of the sbrk function. Extends the heap
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ * mem_arena_sbrk - simple model of the sbrk function for one arena.
+ *    Extends the arena by incr bytes and returns the start address of the
+ *    new area. A negative incr shrinks the arena and returns the old brk;
+ *    the pages above the new brk are released. Safe to call from several
+ *    threads at once.
  */
-void* mem_sbrk(size_t incr) {
-  char* old_brk = mem_brk;
+void* mem_arena_sbrk(int arena, intptr_t incr) {
+  char* old_brk;
 
-  if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+  pthread_mutex_lock(&arena_brk_lock[arena]);
+  old_brk = arena_brk[arena];
+  if (incr < 0 && (old_brk - arena_start[arena]) < -incr) {
+    pthread_mutex_unlock(&arena_brk_lock[arena]);
+    errno = EINVAL;
+    fprintf(stderr, "ERROR: mem_sbrk failed. Attempt to shrink below the heap start...\n");
+    return (void*) -1;
+  }
+  if (incr > 0 && ((arena_max[arena] - old_brk) < incr ||
+                   mem_commit(arena, old_brk + incr) != 0)) {
+    pthread_mutex_unlock(&arena_brk_lock[arena]);
     errno = ENOMEM;
     fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
     return (void*) -1;
   }
-  mem_brk += incr;
+  arena_brk[arena] = old_brk + incr;
+  if (arena_brk[arena] > arena_zero[arena]) {
+    arena_zero[arena] = arena_brk[arena];
+  }
+  pthread_mutex_unlock(&arena_brk_lock[arena]);
+  if (incr > 0) {
+    mem_update_peak(0);
+  }
+
+  if (incr < 0) {
+    mem_release_above(arena, old_brk + incr, old_brk);
+  }
   return (void*) old_brk;
 }
 
+/*
+ * mem_sbrk - extend (or shrink) the heap (arena 0) by incr bytes
+ */
+void* mem_sbrk(intptr_t incr) {
+  return mem_arena_sbrk(0, incr);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
 void* mem_heap_lo() {
-  return (void*) mem_start_brk;
+  return (void*) arena_start[0];
 }
 
 /*
  * mem_heap_hi - return address of last heap byte
  */
 void* mem_heap_hi() {
-  return (void*) (mem_brk - 1);
+  return (void*) (arena_brk[0] - 1);
 }
 
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
 size_t mem_heapsize() {
-  return (size_t) (mem_brk - mem_start_brk);
+  return (size_t) (arena_brk[0] - arena_start[0]);
+}
+
+/*
+ * mem_heap_peak() - returns the largest footprint in bytes since the last
+ *    reset, counting all arenas and the memory handed out by mem_map. With
+ *    one arena that is never shrunk and no mem_map memory, this is the heap
+ *    size.
+ */
+size_t mem_heap_peak() {
+  return mem_peak;
+}
+
+/*
+ * mem_release - give the whole pages inside [addr, addr + len) back to the
+ *    system. Their contents read as zero when next touched. Returns the
+ *    number of bytes released.
+ */
+size_t mem_release(void* addr, size_t len) {
+  uintptr_t pagesize = mem_huge == 2 ? mem_commit_unit : mem_pagesize();
+  uintptr_t lo = ((uintptr_t) addr + pagesize - 1) & ~(pagesize - 1);
+  uintptr_t hi = ((uintptr_t) addr + len) & ~(pagesize - 1);
+
+  if (hi <= lo || madvise((void*) lo, hi - lo, MADV_DONTNEED) != 0) {
+    return 0;
+  }
+  return hi - lo;
+}
+
+/*
+ * mem_arena_resident - returns the number of bytes of an arena, up to its
+ *    brk, that are resident in memory (a multiple of the page size)
+ */
+size_t mem_arena_resident(int arena) {
+  size_t pagesize = mem_pagesize();
+  uintptr_t lo = (uintptr_t) arena_start[arena] & ~(pagesize - 1);
+  uintptr_t hi = (uintptr_t) arena_brk[arena];
+  unsigned char vec[1024];
+  size_t pages, i;
+  size_t resident = 0;
+
+  while (lo < hi) {
+    pages = (hi - lo + pagesize - 1) / pagesize;
+    if (pages > sizeof(vec)) {
+      pages = sizeof(vec);
+    }
+    if (mincore((void*) lo, pages * pagesize, vec) != 0) {
+      break;
+    }
+    for (i = 0; i < pages; i++) {
+      resident += vec[i] & 1;
+    }
+    lo += pages * pagesize;
+  }
+  return resident * pagesize;
+}
+
+/*
+ * mem_max_heap - returns the number of bytes reserved for each arena
+ */
+size_t mem_max_heap() {
+  return mem_arena_span;
+}
+
+/*
+ * mem_track - record that old_p (NULL for new memory) is now len bytes at
+ *    p (NULL for memory given back)
+ */
+static void mem_track(void* old_p, void* p, size_t len) {
+  mem_region_t* regions;
+  size_t i;
+
+  pthread_mutex_lock(&mem_stat_lock);
+  if (old_p == NULL) {
+    if (mem_num_regions == mem_regions_size) {
+      regions = realloc(mem_regions, (2 * mem_regions_size + 16) * sizeof(mem_region_t));
+      if (regions == NULL) {
+        pthread_mutex_unlock(&mem_stat_lock);
+        return;
+      }
+      mem_regions = regions;
+      mem_regions_size = 2 * mem_regions_size + 16;
+    }
+    i = mem_num_regions++;
+  } else {
+    for (i = 0; i < mem_num_regions && mem_regions[i].lo != old_p; i++)
+      ;
+    if (i == mem_num_regions) {
+      pthread_mutex_unlock(&mem_stat_lock);
+      return;
+    }
+  }
+  if (p != NULL) {
+    mem_regions[i].lo = p;
+    mem_regions[i].len = len;
+  } else {
+    mem_regions[i] = mem_regions[--mem_num_regions];
+  }
+  pthread_mutex_unlock(&mem_stat_lock);
+}
+
+/*
+ * mem_is_mapped - returns whether the bytes lo through hi lie in one piece
+ *    of memory returned by mem_map
+ */
+int mem_is_mapped(void* lo, void* hi) {
+  int found = 0;
+  size_t i;
+
+  pthread_mutex_lock(&mem_stat_lock);
+  for (i = 0; i < mem_num_regions && !found; i++) {
+    found = (char*) lo >= mem_regions[i].lo &&
+            (char*) hi < mem_regions[i].lo + mem_regions[i].len;
+  }
+  pthread_mutex_unlock(&mem_stat_lock);
+  return found;
+}
+
+/*
+ * mem_map - returns len bytes of zeroed, page-aligned memory outside of all
+ *    arenas, or NULL if there is none. For the allocator's own bookkeeping
+ *    and for blocks too large for the heap.
+ */
+void* mem_map(size_t len) {
+#if MEM_MMAP
+  void* p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+#else
+  void* p;
+  if (posix_memalign(&p, mem_pagesize(), len) != 0)
+    return NULL;
+  memset(p, 0, len);
+#endif
+  mem_update_peak(len);
+  mem_track(NULL, p, len);
+  return p;
+}
+
+/*
+ * mem_remap - resize memory of old_len bytes returned by mem_map to new_len
+ *    bytes, possibly moving it. Returns its new address, or NULL (leaving
+ *    it unchanged) if there is no room.
+ */
+void* mem_remap(void* p, size_t old_len, size_t new_len) {
+#if MEM_MMAP
+  void* q = mremap(p, old_len, new_len, MREMAP_MAYMOVE);
+  if (q == MAP_FAILED)
+    return NULL;
+  mem_track(p, q, new_len);
+  p = q;
+#else
+  void* q = mem_map(new_len);
+  if (q == NULL)
+    return NULL;
+  memcpy(q, p, old_len < new_len ? old_len : new_len);
+  mem_unmap(p, old_len);
+  return q;
+#endif
+  mem_update_peak((intptr_t) new_len - (intptr_t) old_len);
+  return p;
+}
+
+/*
+ * mem_unmap - give back memory of len bytes returned by mem_map
+ */
+void mem_unmap(void* p, size_t len) {
+#if MEM_MMAP
+  munmap(p, len);
+#else
+  free(p);
+#endif
+  mem_update_peak(-(intptr_t) len);
+  mem_track(p, NULL, 0);
+}
+
+/*
+ * mem_reserved - returns the number of bytes reserved for all arenas
+ */
+size_t mem_reserved() {
+  return mem_num_arenas * mem_arena_span;
+}
+
+/*
+ * mem_arena_count - returns the number of arenas
+ */
+int mem_arena_count() {
+  return mem_num_arenas;
+}
+
+/*
+ * mem_arena_lo - return address of the first byte of an arena
+ */
+void* mem_arena_lo(int arena) {
+  return (void*) arena_start[arena];
+}
+
+/*
+ * mem_arena_hi - return address of the last byte of an arena
+ */
+void* mem_arena_hi(int arena) {
+  return (void*) (arena_brk[arena] - 1);
+}
+
+/*
+ * mem_arena_zero - returns the address of an arena from which its bytes,
+ *    up to the end of the arena, read as zero (at or above its brk)
+ */
+void* mem_arena_zero(int arena) {
+  return (void*) arena_zero[arena];
+}
+
+/*
+ * mem_arena_heapsize - returns the size of an arena in bytes
+ */
+size_t mem_arena_heapsize(int arena) {
+  return (size_t) (arena_brk[arena] - arena_start[arena]);
+}
+
+/*
+ * mem_arena_of - returns the arena that contains address p, or -1 if p is
+ *    outside of the modeled VM
+ */
+int mem_arena_of(void* p) {
+  if ((char*) p < mem_start_brk || (char*) p >= mem_max_addr) {
+    return -1;
+  }
+  return (int) (((char*) p - mem_start_brk) / mem_arena_span);
 }
 
 /*
@@ -1,11 +1,35 @@
 #include <unistd.h>
+#include <stdint.h>
+
+/* Upper bound on the number of arenas the memory model can be split into */
+#define MEM_MAX_ARENAS 64
 
 void mem_init(void);
+void mem_set_max_heap(size_t size);
+void mem_set_hugepages(int mode);
+void mem_init_arenas(int num_arenas);
+int mem_set_base(void* base);
 void mem_deinit(void);
-void* mem_sbrk(size_t incr);
+void* mem_sbrk(intptr_t incr);
 void mem_reset_brk(void);
 void* mem_heap_lo(void);
 void* mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+size_t mem_heap_peak(void);
+size_t mem_release(void* addr, size_t len);
+size_t mem_reserved(void);
+size_t mem_max_heap(void);
+void* mem_map(size_t len);
+void* mem_remap(void* p, size_t old_len, size_t new_len);
+void mem_unmap(void* p, size_t len);
+int mem_is_mapped(void* lo, void* hi);
 
+int mem_arena_count(void);
+void* mem_arena_sbrk(int arena, intptr_t incr);
+void* mem_arena_lo(int arena);
+void* mem_arena_hi(int arena);
+size_t mem_arena_heapsize(int arena);
+size_t mem_arena_resident(int arena);
+void* mem_arena_zero(int arena);
+int mem_arena_of(void* p);
@@ -10,103 +10,869 @@
  *    start on this until you finish mm.c.
  *  - This file does not need to be submitted if you did not attempt it.
  */
+
+// The collector frees every unmarked used block, which would include blocks
+// parked in thread caches, so it builds the allocator without them. It also
+// relies on every payload having a header, which slab objects lack, and on
+// every block being in the heap it sweeps, which mapped blocks are not.
+// Blocks in quick lists would look used as well.
+#define THREAD_CACHE 0
+#define DEFERRED_COALESCE 0
+#define USE_SLABS 0
+#define MMAP_THRESHOLD 0
+
+// The collector keeps track of every block mm_malloc hands out and takes
+// over mm_free while a collection is in progress.
+static void gc_on_malloc(void* ptr);
+static int gc_on_free(void* ptr);
+#define MM_MALLOC_HOOK(ptr) gc_on_malloc(ptr)
+#define MM_FREE_HOOK(ptr) gc_on_free(ptr)
+
 #include "mm.c"
 
+#include <time.h>
+#include <sched.h>
+
 
 // The tag to indicate that a block is marked.
 #define TAG_MARKED 4
 
 // Forward function declarations
-static void sweep(void);
+static int sweep_step(size_t budget);
 static int is_pointer(void* ptr);
-static void mark(void* ptr);
+static int mark_step(size_t budget);
+static void mark_push(void* ptr);
+
+// Block-start bitmap: bit i is set when the word at map_base + i * WORD_SIZE
+// is the payload of an allocated block. map_base is the payload of the first
+// block of the heap. It is kept up to date by every
+// mm_malloc and mm_free and makes is_pointer O(1).
+static uint64_t* start_map;
+static size_t start_map_words;
+static char* map_base;
+static unsigned map_generation;
+
+// Number of bitmap words allocated at first.
+#define START_MAP_INIT 4096
+
+// Explicit mark stack of payloads whose words still have to be scanned.
+static void** mark_stack;
+static size_t mark_stack_size;
+static size_t mark_stack_top;
+
+// Number of mark stack entries allocated at first.
+#define MARK_STACK_INIT 4096
+
+// A collection runs in slices, and the program may run between them:
+//  - GC_MARK: blocks reachable from the roots are marked. Blocks allocated
+//    meanwhile are marked at once (allocate black), and mm_gc_write marks
+//    the target of every pointer stored into a block, so nothing the
+//    program keeps can be missed. The roots are scanned again at the end.
+//  - GC_SWEEP: unmarked blocks are freed in address order, starting at
+//    sweep_cursor. Only blocks allocated past the cursor are marked.
+// Blocks passed to mm_free during a collection are kept marked on
+// deferred_frees and freed when it ends, so the heap only changes under the
+// sweep by blocks being split.
+#define GC_IDLE 0
+#define GC_MARK 1
+#define GC_SWEEP 2
+
+static int gc_phase = GC_IDLE;
+static void** gc_roots;
+static int gc_num_roots;
+static block_info* sweep_cursor;
+static void* deferred_frees;
+
+// Pause times of the slices of the current (or last) collection.
+static struct mm_gc_stats gc_stats;
 
 
 /* A modified version of examine_heap() to include TAG_MARKED. */
 static void examine_heap_gc() {
   block_info* block;
+  int c;
 
   // print to stderr so output isn't buffered and not output if we crash
-  fprintf(stderr, "FREE_LIST_HEAD: %p\n", (void*) FREE_LIST_HEAD);
+  for (c = 0; c < NUM_SIZE_CLASSES; c++) {
+    if (FREE_LIST_HEAD(c) != NO_LINK) {
+      fprintf(stderr, "FREE_LIST_HEAD(%d): %p\n", c, (void*) to_block(FREE_LIST_HEAD(c)));
+    }
+  }
 
-  for (block = (block_info*) UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE);  // first block on heap
-       SIZE(block->size_and_tags) != 0 && (void*) block < mem_heap_hi();
+  for (block = first_block();
+       SIZE(block->size_and_tags) != 0 && (void*) block < heap_hi();
        block = (block_info*) UNSCALED_POINTER_ADD(block, SIZE(block->size_and_tags))) {
 
     // print out common block attributes
     fprintf(stderr, "%p: %ld %ld %ld %ld\t",
             (void*) block,
             SIZE(block->size_and_tags),
-            block->size_and_tags & TAG_MARKED,
-            block->size_and_tags & TAG_PRECEDING_USED,
-            block->size_and_tags & TAG_USED);
+            (size_t) (block->size_and_tags & TAG_MARKED),
+            (size_t) (block->size_and_tags & TAG_PRECEDING_USED),
+            (size_t) (block->size_and_tags & TAG_USED));
 
     // and allocated/free specific data
     if (block->size_and_tags & TAG_USED) {
       fprintf(stderr, "ALLOCATED\n");
     } else {
       fprintf(stderr, "FREE\tnext: %p, prev: %p\n",
-              (void*) block->next,
-              (void*) block->prev);
+              (void*) to_block(block->next),
+              (void*) to_block(block->prev));
     }
   }
   fprintf(stderr, "END OF HEAP\n\n");
 }
 
 
+/* Forget every block of a heap that mm_init has thrown away. */
+static void start_map_reset() {
+  if (start_map != NULL) {
+    memset(start_map, 0, start_map_words * sizeof(uint64_t));
+  }
+  map_base = (char*) UNSCALED_POINTER_ADD(first_block(), TAG_SIZE);
+  map_generation = heap_generation;
+  gc_phase = GC_IDLE;
+  mark_stack_top = 0;
+  deferred_frees = NULL;
+}
+
+
+/* Set or clear the bitmap bit of the payload ptr, growing the bitmap. */
+static void start_map_update(void* ptr, int set) {
+  size_t i;
+  size_t words;
+
+  if (map_generation != heap_generation) {
+    start_map_reset();
+  }
+  i = ((char*) ptr - map_base) / WORD_SIZE;
+
+  if (i / 64 >= start_map_words) {
+    if (!set) {
+      return;
+    }
+    words = start_map_words ? 2 * start_map_words : START_MAP_INIT;
+    while (i / 64 >= words) {
+      words *= 2;
+    }
+    if (start_map == NULL) {
+      start_map = (uint64_t*) mem_map(words * sizeof(uint64_t));
+    } else {
+      start_map = (uint64_t*) mem_remap(start_map, start_map_words * sizeof(uint64_t),
+                                        words * sizeof(uint64_t));
+    }
+    if (start_map == NULL) {
+      printf("ERROR: mem_map failed in start_map_update\n");
+      exit(1);
+    }
+    memset(start_map + start_map_words, 0, (words - start_map_words) * sizeof(uint64_t));
+    start_map_words = words;
+  }
+
+  if (set) {
+    start_map[i / 64] |= (uint64_t) 1 << (i % 64);
+  } else {
+    start_map[i / 64] &= ~((uint64_t) 1 << (i % 64));
+  }
+}
+
+
 /*
  * This will determine if the given pointer points to the beginning
  * of the payload of a block which is allocated.
  */
 static int is_pointer(void* ptr) {
-  size_t* cur_block = (size_t*) UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE);
-  size_t* heap_footer = (size_t*) UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1);
+  size_t i;
 
-  while (cur_block < heap_footer) {
-    size_t size_and_tags = *cur_block;
-    void* payload_ptr = UNSCALED_POINTER_ADD(cur_block, WORD_SIZE);
-    size_t allocated = size_and_tags & TAG_USED;
+  if ((char*) ptr < map_base || ((size_t) ptr & (WORD_SIZE - 1)) != 0) {
+    return 0;
+  }
+  i = ((char*) ptr - map_base) / WORD_SIZE;
+  return i / 64 < start_map_words && ((start_map[i / 64] >> (i % 64)) & 1);
+}
 
-    if (payload_ptr == ptr && allocated) {
-      return 1;
-    }
-    cur_block = (size_t*) UNSCALED_POINTER_ADD(cur_block, SIZE(size_and_tags));
+
+/*
+ * Record a block mm_malloc is about to return. During a collection it is
+ * marked, unless the sweep has already passed it.
+ */
+static void gc_on_malloc(void* ptr) {
+  tag_t* block_header = (tag_t*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+
+  start_map_update(ptr, 1);
+  if (gc_phase == GC_MARK ||
+      (gc_phase == GC_SWEEP && (block_info*) block_header >= sweep_cursor)) {
+    *block_header |= TAG_MARKED;
   }
-  return 0;
 }
 
 
 /*
- * Mark the block pointed to by ptr. The argument ptr will point to the
- * beginning of the payload of the block. Use the tag TAG_MARKED to signify
- * that a block is reachable. Next go and mark all other blocks that are
- * pointed to by pointers in this block.
+ * Record a block passed to mm_free. During a collection it is kept, marked
+ * so the sweep leaves it alone, and freed when the collection ends.
  */
+static int gc_on_free(void* ptr) {
+  start_map_update(ptr, 0);
+  if (gc_phase == GC_IDLE) {
+    return 0;
+  }
+  *(tag_t*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE) |= TAG_MARKED;
+  *(void**) ptr = deferred_frees;
+  deferred_frees = ptr;
+  return 1;
+}
+
+
+/* Push ptr on the mark stack. */
+static void mark_stack_push(void* ptr) {
+  if (mark_stack_top == mark_stack_size) {
+    if (mark_stack == NULL) {
+      mark_stack_size = MARK_STACK_INIT;
+      mark_stack = (void**) mem_map(mark_stack_size * sizeof(void*));
+    } else {
+      mark_stack = (void**) mem_remap(mark_stack, mark_stack_size * sizeof(void*),
+                                      2 * mark_stack_size * sizeof(void*));
+      mark_stack_size *= 2;
+    }
+    if (mark_stack == NULL) {
+      printf("ERROR: mem_map failed in mark_stack_push\n");
+      exit(1);
+    }
+  }
+  mark_stack[mark_stack_top++] = ptr;
+}
+
+
+/* Tag the block whose payload is ptr as marked and push it to be scanned. */
+static void mark_push(void* ptr) {
+  tag_t* block_header = (tag_t*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+
+  *block_header |= TAG_MARKED;
+  mark_stack_push(ptr);
+}
+
+
+/* Mark the block whose payload is ptr, if it is one and not yet marked. */
 static void mark(void* ptr) {
-  size_t* block_header = (size_t*) UNSCALED_POINTER_SUB(ptr, WORD_SIZE);
+  if (is_pointer(ptr) && !(*(tag_t*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE) & TAG_MARKED)) {
+    mark_push(ptr);
+  }
+}
+
+
+/*
+ * Scan the blocks on the mark stack, marking all other blocks that are
+ * pointed to by pointers in them, until about budget bytes have been
+ * scanned. Returns 1 once nothing is left to scan.
+ *  - Blocks still to be scanned are kept on an explicit stack rather than
+ *    the C stack, so long chains of blocks cannot overflow it.
+ */
+static int mark_step(size_t budget) {
+  void** payload;
+  size_t num_words;
+  size_t scanned = 0;
+  size_t i;
+
+  while (mark_stack_top > 0) {
+    if (scanned >= budget) {
+      return 0;
+    }
+    payload = (void**) mark_stack[--mark_stack_top];
+    num_words = (SIZE(*(tag_t*) UNSCALED_POINTER_SUB(payload, TAG_SIZE)) - TAG_SIZE) / WORD_SIZE;
+    for (i = 0; i < num_words; i++) {
+      mark(payload[i]);
+    }
+    scanned += (num_words + 1) * WORD_SIZE;
+  }
+  return 1;
+}
+
+
+/*
+ * Make the run_size bytes at run, which follow a used block (or the
+ * prologue), one free block.
+ */
+static void free_run(block_info* run, size_t run_size) {
+  block_info* following_block = (block_info*) UNSCALED_POINTER_ADD(run, run_size);
+
+  run->size_and_tags = run_size | TAG_PRECEDING_USED;
+  *((tag_t*) UNSCALED_POINTER_ADD(run, run_size - TAG_SIZE)) = run->size_and_tags;
+  insert_free_block(run);
+  following_block->size_and_tags &= ~TAG_PRECEDING_USED;
+}
+
+
+/*
+ * Sweep through the allocated blocks from sweep_cursor on, freeing all that
+ * are unreachable (i.e., TAG_MARKED is unset), until about budget bytes of
+ * used blocks have been swept. Free blocks count as one word, since only
+ * their header is read. Returns 1 once the end of the heap is reached.
+ *  - A single pass in address order collects each run of free and
+ *    unreachable blocks and turns it into one free block, so nothing is
+ *    coalesced twice. Marked blocks are unmarked for the next collection.
+ *  - A run still open when the slice ends is freed, and the next slice
+ *    starts at it again so it can keep growing. Every slice gets past at
+ *    least one block beyond its start.
+ */
+static int sweep_step(size_t budget) {
+  block_info* block = sweep_cursor;
+  block_info* run = NULL;
+  size_t run_size = 0;
+  size_t swept = 0;
+  size_t size_and_tags;
+  int done;
+
+  while (SIZE(block->size_and_tags) != 0 && (swept < budget || block == sweep_cursor)) {
+    size_and_tags = block->size_and_tags;
+
+    if ((size_and_tags & TAG_USED) && (size_and_tags & TAG_MARKED)) {
+      block->size_and_tags &= ~TAG_MARKED;
+      if (run != NULL) {
+        free_run(run, run_size);
+        run = NULL;
+      }
+      swept += SIZE(size_and_tags);
+    } else {
+      // Unreachable blocks inside a run keep a header that reads as free.
+      if ((size_and_tags & TAG_USED) == 0) {
+        remove_free_block(block);
+        swept += TAG_SIZE;
+      } else {
+        start_map_update(UNSCALED_POINTER_ADD(block, TAG_SIZE), 0);
+        count_free(SIZE(size_and_tags));
+        block->size_and_tags = size_and_tags & ~TAG_USED;
+        swept += SIZE(size_and_tags);
+      }
+      if (run == NULL) {
+        run = block;
+        run_size = 0;
+      }
+      run_size += SIZE(size_and_tags);
+    }
+    block = (block_info*) UNSCALED_POINTER_ADD(block, SIZE(size_and_tags));
+  }
+
+  done = SIZE(block->size_and_tags) == 0;
+  if (run != NULL) {
+    free_run(run, run_size);
+    block = run;
+  }
+  sweep_cursor = block;
+  return done;
+}
+
+
+/* Free the blocks that were passed to mm_free during the collection. */
+static void free_deferred() {
+  block_info* block;
+  void* ptr;
+
+  while (deferred_frees != NULL) {
+    ptr = deferred_frees;
+    deferred_frees = *(void**) ptr;
+    block = (block_info*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+    block->size_and_tags &= ~TAG_MARKED;
+    count_free(SIZE(block->size_and_tags));
+    heap_free(block);
+  }
+}
+
+
+/* Return the current time in seconds. */
+static double gc_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ * Begin a collection with the numRoots pointers in rootPtrs as roots. The
+ * array is scanned again when marking ends, so it must stay valid (and be
+ * kept up to date) until the collection is finished. A collection that is
+ * still running is finished first.
+ */
+void mm_gc_begin(void* rootPtrs[], int numRoots) {
+  double start;
+  int i;
+
+  mm_gc_finish();
+
+  // The collector only manages arena 0, the classic single heap.
+  arena_lock(0);
+  start = gc_now();
+  if (map_generation != heap_generation) {
+    start_map_reset();
+  }
+  memset(&gc_stats, 0, sizeof(gc_stats));
+  gc_roots = rootPtrs;
+  gc_num_roots = numRoots;
+  gc_phase = GC_MARK;
+  for (i = 0; i < numRoots; i++) {
+    mark(rootPtrs[i]);
+  }
+  gc_stats.last_pause = gc_stats.max_pause = gc_stats.total_pause = gc_now() - start;
+  arena_unlock(0);
+}
+
+
+/*
+ * Do about budget_bytes of marking or sweeping (0 runs the collection to its
+ * end) and record the pause. Returns nonzero while work is left.
+ */
+int mm_gc_step(size_t budget_bytes) {
+  double start;
+  double pause;
+  int done;
+
+  if (budget_bytes == 0) {
+    budget_bytes = SIZE_MAX;
+  }
+
+  arena_lock(0);
+  if (gc_phase == GC_IDLE || map_generation != heap_generation) {
+    arena_unlock(0);
+    return 0;
+  }
+  start = gc_now();
+
+  if (gc_phase == GC_MARK && mark_step(budget_bytes)) {
+    // Pick up what the program has stored in the roots since.
+    for (done = 0; done < gc_num_roots; done++) {
+      mark(gc_roots[done]);
+    }
+    if (mark_stack_top == 0) {
+      gc_phase = GC_SWEEP;
+      sweep_cursor = first_block();
+    }
+  } else if (gc_phase == GC_SWEEP && sweep_step(budget_bytes)) {
+    gc_phase = GC_IDLE;
+    free_deferred();
+  }
+
+  pause = gc_now() - start;
+  gc_stats.slices++;
+  gc_stats.last_pause = pause;
+  gc_stats.total_pause += pause;
+  if (pause > gc_stats.max_pause) {
+    gc_stats.max_pause = pause;
+  }
+  done = gc_phase == GC_IDLE;
+  arena_unlock(0);
+  return !done;
+}
+
 
-  // TODO: Implement mark.
+/* Run the collection in progress, if any, to its end. */
+void mm_gc_finish() {
+  while (mm_gc_step(0)) {
+  }
+}
+
+
+/*
+ * Store value in the pointer-sized field of a heap block. During marking the
+ * block value points to is marked, so a block that has already been scanned
+ * cannot hide it from the collector.
+ */
+void mm_gc_write(void** field, void* value) {
+  *field = value;
+  if (gc_phase == GC_MARK) {
+    mark(value);
+  }
+}
+
+
+/* Copy the pause times of the current (or last) collection to stats. */
+void mm_gc_get_stats(struct mm_gc_stats* stats) {
+  *stats = gc_stats;
+}
+
+
+// PARALLEL COLLECTION ---------------------------------------------
+
+// With more than one thread (see mm_gc_set_threads), mm_garbage_collect
+// marks and sweeps in parallel:
+//  - The roots are dealt out to the workers. Each keeps the blocks it still
+//    has to scan in a deque of its own (Chase-Lev): it pushes and pops at
+//    the bottom while idle workers steal from the top. TAG_MARKED is set
+//    with an atomic or, so only the worker that sets it scans the block.
+//    Deques that fill up spill onto the shared mark stack.
+//  - The heap is cut into one address range per worker, each starting at a
+//    used block found in the block-start bitmap. Workers unmark live blocks
+//    and record the runs of free and dead blocks in their range; a serial
+//    pass then joins runs that cross range boundaries, rebuilds the free
+//    lists from the runs, and fixes the tags next to them.
+
+// Most workers of one collection.
+#define GC_MAX_THREADS 64
+
+// Entries in each worker's deque.
+#define DEQUE_SIZE (1 << 16)
+
+// A run of free and dead blocks found by a sweeping worker.
+struct gc_run {
+  block_info* start;
+  size_t size;
+};
+
+struct gc_worker {
+  void** deque;
+  long top;     // next entry to steal
+  long bottom;  // next entry to push
+  // Runs found in the range [sweep_start, sweep_end) of the heap.
+  struct gc_run* runs;
+  size_t num_runs;
+  size_t runs_size;
+  block_info* sweep_start;
+  block_info* sweep_end;
+  unsigned seed;
+  pthread_t thread;
+} __attribute__((aligned(64)));
+
+static struct gc_worker workers[GC_MAX_THREADS];
+static int gc_threads = 1;
+static int gc_idle_workers;
+static pthread_barrier_t gc_barrier;
+static pthread_mutex_t mark_stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Collect with threads workers from now on (1 collects serially). */
+void mm_gc_set_threads(int threads) {
+  gc_threads = threads < 1 ? 1 : threads > GC_MAX_THREADS ? GC_MAX_THREADS : threads;
+}
+
+
+/* Push ptr at the bottom of the worker's deque, or spill it. */
+static void deque_push(struct gc_worker* w, void* ptr) {
+  long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+
+  if (b - t >= DEQUE_SIZE) {
+    pthread_mutex_lock(&mark_stack_lock);
+    mark_stack_push(ptr);
+    pthread_mutex_unlock(&mark_stack_lock);
+    return;
+  }
+  __atomic_store_n(&w->deque[b % DEQUE_SIZE], ptr, __ATOMIC_RELAXED);
+  __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Pop from the bottom of the worker's own deque; NULL if it is empty. */
+static void* deque_pop(struct gc_worker* w) {
+  long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+  long t;
+  void* ptr;
+
+  __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+  if (t > b) {
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  ptr = __atomic_load_n(&w->deque[b % DEQUE_SIZE], __ATOMIC_RELAXED);
+  if (t == b) {
+    // The last entry: race any thief for it.
+    if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      ptr = NULL;
+    }
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return ptr;
+}
+
+
+/* Steal from the top of another worker's deque; NULL if there is nothing. */
+static void* deque_steal(struct gc_worker* w) {
+  long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+  long b;
+  void* ptr;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b) {
+    return NULL;
+  }
+  ptr = __atomic_load_n(&w->deque[t % DEQUE_SIZE], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return ptr;
+}
+
+
+/* Take a spilled entry off the shared mark stack; NULL if there is none. */
+static void* spill_pop() {
+  void* ptr = NULL;
+
+  if (__atomic_load_n(&mark_stack_top, __ATOMIC_RELAXED) == 0) {
+    return NULL;
+  }
+  pthread_mutex_lock(&mark_stack_lock);
+  if (mark_stack_top > 0) {
+    ptr = mark_stack[--mark_stack_top];
+  }
+  pthread_mutex_unlock(&mark_stack_lock);
+  return ptr;
+}
+
+
+/* Find work for an idle worker: spilled entries first, then stealing. */
+static void* find_work(struct gc_worker* w) {
+  void* ptr = spill_pop();
+  int i, victim;
+
+  for (i = 0; ptr == NULL && i < 2 * gc_threads; i++) {
+    victim = rand_r(&w->seed) % gc_threads;
+    if (&workers[victim] != w) {
+      ptr = deque_steal(&workers[victim]);
+    }
+  }
+  return ptr;
+}
+
+
+/* Return whether any deque or the mark stack holds work. */
+static int work_left() {
+  int i;
+
+  if (__atomic_load_n(&mark_stack_top, __ATOMIC_RELAXED) != 0) {
+    return 1;
+  }
+  for (i = 0; i < gc_threads; i++) {
+    if (__atomic_load_n(&workers[i].top, __ATOMIC_ACQUIRE) <
+        __atomic_load_n(&workers[i].bottom, __ATOMIC_ACQUIRE)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/* Mark the block whose payload is ptr for worker w, if nobody has yet. */
+static void par_mark(struct gc_worker* w, void* ptr) {
+  tag_t* block_header;
+
+  if (!is_pointer(ptr)) {
+    return;
+  }
+  block_header = (tag_t*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+  if (!(__atomic_load_n(block_header, __ATOMIC_RELAXED) & TAG_MARKED) &&
+      !(__atomic_fetch_or(block_header, TAG_MARKED, __ATOMIC_RELAXED) & TAG_MARKED)) {
+    deque_push(w, ptr);
+  }
 }
 
 
 /*
- * Sweep through the all of the allocated blocks in the heap and free all
- * that are unreachable (i.e., TAG_MARKED is unset).
+ * Scan blocks until no worker has any left. A worker that finds no work
+ * counts itself idle and waits until there is work again or all are idle.
  */
-static void sweep() {
-  size_t* cur_block = (size_t*) UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE);
-  size_t* heap_footer = (size_t*) UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1);
+static void par_mark_drain(struct gc_worker* w) {
+  void** payload;
+  size_t num_words;
+  size_t i;
+
+  for (;;) {
+    while ((payload = (void**) deque_pop(w)) != NULL ||
+           (payload = (void**) find_work(w)) != NULL) {
+      num_words = (SIZE(*(tag_t*) UNSCALED_POINTER_SUB(payload, TAG_SIZE)) - TAG_SIZE) / WORD_SIZE;
+      for (i = 0; i < num_words; i++) {
+        par_mark(w, payload[i]);
+      }
+    }
+
+    __atomic_add_fetch(&gc_idle_workers, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&gc_idle_workers, __ATOMIC_SEQ_CST) == gc_threads) {
+        return;
+      }
+      if (work_left()) {
+        __atomic_sub_fetch(&gc_idle_workers, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+
+/* Record that the block at block starts or extends the worker's last run. */
+static void add_to_run(struct gc_worker* w, block_info* block, size_t size) {
+  struct gc_run* run = w->num_runs ? &w->runs[w->num_runs - 1] : NULL;
+
+  if (run != NULL && UNSCALED_POINTER_ADD(run->start, run->size) == (void*) block) {
+    run->size += size;
+    return;
+  }
+  if (w->num_runs == w->runs_size) {
+    w->runs_size = w->runs_size ? 2 * w->runs_size : 1024;
+    w->runs = (struct gc_run*) (w->runs == NULL
+        ? mem_map(w->runs_size * sizeof(struct gc_run))
+        : mem_remap(w->runs, w->runs_size / 2 * sizeof(struct gc_run),
+                    w->runs_size * sizeof(struct gc_run)));
+    if (w->runs == NULL) {
+      printf("ERROR: mem_map failed in add_to_run\n");
+      exit(1);
+    }
+  }
+  w->runs[w->num_runs].start = block;
+  w->runs[w->num_runs].size = size;
+  w->num_runs++;
+}
+
+
+/* Unmark the live blocks in the worker's range and record the others. */
+static void par_sweep_range(struct gc_worker* w) {
+  block_info* block = w->sweep_start;
+  size_t size_and_tags;
+  size_t i;
+
+  w->num_runs = 0;
+  while (block < w->sweep_end) {
+    size_and_tags = block->size_and_tags;
+    if ((size_and_tags & TAG_USED) && (size_and_tags & TAG_MARKED)) {
+      block->size_and_tags = size_and_tags & ~TAG_MARKED;
+    } else {
+      // Bitmap words are shared with the neighbouring ranges.
+      if (size_and_tags & TAG_USED) {
+        i = ((char*) block + TAG_SIZE - map_base) / WORD_SIZE;
+        __atomic_fetch_and(&start_map[i / 64], ~((uint64_t) 1 << (i % 64)), __ATOMIC_RELAXED);
+        count_free(SIZE(size_and_tags));
+        block->size_and_tags = size_and_tags & ~TAG_USED;
+      }
+      add_to_run(w, block, SIZE(size_and_tags));
+    }
+    block = (block_info*) UNSCALED_POINTER_ADD(block, SIZE(size_and_tags));
+  }
+}
+
+
+/* Return the first used block at or after addr, or the end-of-heap word. */
+static block_info* used_block_from(char* addr, block_info* end) {
+  size_t i = (addr + TAG_SIZE - map_base) / WORD_SIZE;
+  size_t word;
+  uint64_t bits;
+  block_info* block;
 
-  // TODO: Implement sweep.
+  for (word = i / 64; word < start_map_words; word++) {
+    bits = start_map[word];
+    if (word == i / 64) {
+      bits &= ~(uint64_t) 0 << (i % 64);
+    }
+    if (bits != 0) {
+      block = (block_info*) (map_base + (word * 64 + __builtin_ctzll(bits)) * WORD_SIZE - TAG_SIZE);
+      return block < end ? block : end;
+    }
+  }
+  return end;
+}
+
+
+/* Body of each worker thread (worker 0 is the collecting thread itself). */
+static void* gc_worker_main(void* arg) {
+  struct gc_worker* w = (struct gc_worker*) arg;
+  int i;
+
+  for (i = w - workers; i < gc_num_roots; i += gc_threads) {
+    par_mark(w, gc_roots[i]);
+  }
+  par_mark_drain(w);
+  pthread_barrier_wait(&gc_barrier);
+  par_sweep_range(w);
+  return NULL;
+}
+
+
+/* Mark and sweep with gc_threads workers. Called with arena 0 locked. */
+static void parallel_collect(void* rootPtrs[], int num_roots) {
+  block_info* end = (block_info*) UNSCALED_POINTER_SUB(heap_hi(), TAG_SIZE - 1);
+  char* base = (char*) first_block();
+  size_t span = ((char*) end - base) / gc_threads;
+  struct gc_run run = { NULL, 0 };
+  struct gc_worker* w;
+  int c, i;
+  size_t r;
+
+  if (map_generation != heap_generation) {
+    start_map_reset();
+  }
+  gc_roots = rootPtrs;
+  gc_num_roots = num_roots;
+  gc_idle_workers = 0;
+
+  for (i = 0; i < gc_threads; i++) {
+    w = &workers[i];
+    if (w->deque == NULL) {
+      w->deque = (void**) mem_map(DEQUE_SIZE * sizeof(void*));
+      if (w->deque == NULL) {
+        printf("ERROR: mem_map failed in parallel_collect\n");
+        exit(1);
+      }
+    }
+    w->top = w->bottom = 0;
+    w->seed = i + 1;
+    w->sweep_start = i == 0 ? first_block() : workers[i - 1].sweep_end;
+    w->sweep_end = i == gc_threads - 1 ? end : used_block_from(base + (i + 1) * span, end);
+  }
+
+  pthread_barrier_init(&gc_barrier, NULL, gc_threads);
+  for (i = 1; i < gc_threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, gc_worker_main, &workers[i]) != 0) {
+      printf("ERROR: pthread_create failed in parallel_collect\n");
+      exit(1);
+    }
+  }
+  gc_worker_main(&workers[0]);
+  for (i = 1; i < gc_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  pthread_barrier_destroy(&gc_barrier);
+
+  // Every free block is part of some run, so the free lists are rebuilt.
+  for (c = 0; c < NUM_SIZE_CLASSES; c++) {
+    FREE_LIST_HEAD(c) = NO_LINK;
+  }
+  NONEMPTY_CLASSES = 0;
+  for (c = 0; c < NUM_LIST_AUX; c++) {
+    LIST_AUX(c) = NO_LINK;
+  }
+  TREE_ROOT = NO_LINK;
+
+  for (i = 0; i < gc_threads; i++) {
+    for (r = 0; r < workers[i].num_runs; r++) {
+      if (run.start != NULL &&
+          UNSCALED_POINTER_ADD(run.start, run.size) == (void*) workers[i].runs[r].start) {
+        run.size += workers[i].runs[r].size;
+        continue;
+      }
+      if (run.start != NULL) {
+        free_run(run.start, run.size);
+      }
+      run = workers[i].runs[r];
+    }
+  }
+  if (run.start != NULL) {
+    free_run(run.start, run.size);
+  }
 }
 
 
 /* Run the mark-and-sweep garbage collection algorithm. */
 void mm_garbage_collect(void* rootPtrs[], int num_roots) {
-  int i;
-  for (i = 0; i < num_roots; i++) {
-    void* root = rootPtrs[i];
-    mark(root);
+  if (gc_threads == 1) {
+    mm_gc_begin(rootPtrs, num_roots);
+    mm_gc_finish();
+    return;
   }
-  sweep();
+
+  mm_gc_finish();
+  arena_lock(0);
+  parallel_collect(rootPtrs, num_roots);
+  arena_unlock(0);
 }
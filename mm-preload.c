@@ -0,0 +1,488 @@
+/*
+ * Preloadable malloc shim: records the allocations of a real program as a
+ * trace for mdriver, and can run the program on mm.c instead of libc.
+ *
+ * Built as libmmpreload.so ("make libmmpreload.so"), and configured by the
+ * environment of the program it is preloaded into:
+ *  - MM_PRELOAD_TRACE=file records every malloc, calloc, realloc, free and
+ *    aligned allocation to file, as an event log that rep2bin turns into a
+ *    binary trace (see tracefmt.h).
+ *  - MM_PRELOAD_ALLOCATOR=mm serves malloc, calloc, realloc and free from
+ *    mm.c (with mm_realloc from mm-realloc.c) instead of libc.
+ *    MM_PRELOAD_ARENAS (default 8) and MM_PRELOAD_HEAP_MB (default 1024)
+ *    size its heap.
+ *
+ *    unix> MM_PRELOAD_TRACE=ls.log LD_PRELOAD=./libmmpreload.so ls -l
+ *    unix> ./rep2bin ls.log ls.bin
+ *    unix> ./mdriver-realloc -V -f ls.bin
+ *
+ * NOTES:
+ *  - Recording costs one atomic increment for the event's sequence number
+ *    and a store into a buffer of the calling thread. Full buffers are
+ *    written out by a writer thread, so the program never waits for I/O.
+ *  - mm.c aligns blocks to 8 bytes by default, which programs that rely on
+ *    malloc's 16-byte alignment on x86-64 may not tolerate; build the shim
+ *    with -DALIGNMENT=16 for them.
+ *  - Anything allocated before the shim started or by the shim itself
+ *    comes from libc, and so do aligned allocations whose alignment is not
+ *    a power of two. Every block outside the mm.c heap is handed back to
+ *    libc, so blocks are never directly mapped by mm.c (see
+ *    mm_set_mmap_threshold).
+ *  - This relies on glibc, whose __libc_* entry points reach its allocator
+ *    without going through the interposed symbols.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#include "mm-realloc.c"
+#include "tracefmt.h"
+
+
+// Events in each thread's buffer (about 256 KB of them).
+#define EVENT_BUFFER_EVENTS 8192
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t num, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* ptr);
+
+// The events of one thread, laid out so that the chunk header and events
+// can be written out as they are.
+typedef struct event_buffer {
+  struct event_buffer* next;  // in live_buffers, the write queue or the pool
+  struct event_buffer* prev;  // in live_buffers
+  tracefmt_chunk_t chunk;
+  tracefmt_event_t events[EVENT_BUFFER_EVENTS];
+} event_buffer;
+
+// Set while a thread is inside the shim. Allocations made meanwhile (by
+// libc or pthreads on the shim's behalf) go straight to libc unrecorded.
+static __thread int in_shim;
+
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+static int preload_ready;
+static int use_mm;
+static size_t (*libc_malloc_usable_size)(void*);
+
+// The recorder. The buffers threads are filling are on live_buffers, full
+// ones wait on the write queue for the writer thread, and written ones are
+// pooled for reuse; recorder_lock protects all three.
+static int recording;
+static int trace_fd = -1;
+static uint64_t next_seq;
+static __thread event_buffer* thread_buffer;
+static pthread_key_t recorder_key;
+static pthread_mutex_t recorder_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recorder_cond = PTHREAD_COND_INITIALIZER;
+static event_buffer* live_buffers;
+static event_buffer* write_head;
+static event_buffer* write_tail;
+static event_buffer* buffer_pool;
+static int writer_stopping;
+static pthread_t writer_thread;
+
+
+// RECORDER ---------------------------------------------------------
+
+/* Take a buffer for the calling thread. */
+static event_buffer* buffer_get() {
+  event_buffer* buffer;
+
+  pthread_mutex_lock(&recorder_lock);
+  buffer = buffer_pool;
+  if (buffer != NULL) {
+    buffer_pool = buffer->next;
+  } else if ((buffer = (event_buffer*) mem_map(sizeof(event_buffer))) == NULL) {
+    pthread_mutex_unlock(&recorder_lock);
+    return NULL;
+  }
+  buffer->chunk.num_events = 0;
+  buffer->prev = NULL;
+  buffer->next = live_buffers;
+  if (live_buffers != NULL) {
+    live_buffers->prev = buffer;
+  }
+  live_buffers = buffer;
+  pthread_mutex_unlock(&recorder_lock);
+  return buffer;
+}
+
+/* Move a live buffer to the write queue. The caller holds recorder_lock. */
+static void buffer_queue(event_buffer* buffer) {
+  if (buffer->prev != NULL) {
+    buffer->prev->next = buffer->next;
+  } else {
+    live_buffers = buffer->next;
+  }
+  if (buffer->next != NULL) {
+    buffer->next->prev = buffer->prev;
+  }
+
+  buffer->next = NULL;
+  if (write_tail != NULL) {
+    write_tail->next = buffer;
+  } else {
+    write_head = buffer;
+  }
+  write_tail = buffer;
+  pthread_cond_signal(&recorder_cond);
+}
+
+static void buffer_submit(event_buffer* buffer) {
+  pthread_mutex_lock(&recorder_lock);
+  buffer_queue(buffer);
+  pthread_mutex_unlock(&recorder_lock);
+}
+
+/* Hand the buffer of an exiting thread to the writer. */
+static void recorder_thread_exit(void* buffer) {
+  if (recording && buffer == thread_buffer) {
+    thread_buffer = NULL;
+    buffer_submit((event_buffer*) buffer);
+  }
+}
+
+/* Take the next sequence number, which orders the events of all threads. */
+static inline uint64_t event_seq() {
+  return __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+}
+
+/* Append an event to the calling thread's buffer. */
+static void record(uint64_t seq, uint32_t type, void* ptr, void* old_ptr, size_t size) {
+  event_buffer* buffer = thread_buffer;
+  tracefmt_event_t* event;
+
+  if (buffer == NULL) {
+    if ((buffer = buffer_get()) == NULL) {
+      return;
+    }
+    thread_buffer = buffer;
+    pthread_setspecific(recorder_key, buffer);
+  }
+
+  event = &buffer->events[buffer->chunk.num_events];
+  event->seq = seq;
+  event->ptr = (uintptr_t) ptr;
+  event->old_ptr = (uintptr_t) old_ptr;
+  event->type = type;
+  event->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t) size;
+  // Published for recorder_stop, which may write out a live buffer.
+  __atomic_store_n(&buffer->chunk.num_events, buffer->chunk.num_events + 1, __ATOMIC_RELEASE);
+
+  if (buffer->chunk.num_events == EVENT_BUFFER_EVENTS) {
+    thread_buffer = NULL;
+    pthread_setspecific(recorder_key, NULL);
+    buffer_submit(buffer);
+  }
+}
+
+/* Write out queued buffers until recorder_stop, then write out the rest. */
+static void* writer_main(void* arg) {
+  event_buffer* buffer;
+  char* data;
+  size_t len;
+  ssize_t written;
+
+  (void) arg;
+  in_shim = 1;
+  pthread_mutex_lock(&recorder_lock);
+  for (;;) {
+    while (write_head == NULL && !writer_stopping) {
+      pthread_cond_wait(&recorder_cond, &recorder_lock);
+    }
+    if (write_head == NULL) {
+      break;
+    }
+    buffer = write_head;
+    write_head = buffer->next;
+    if (write_head == NULL) {
+      write_tail = NULL;
+    }
+    pthread_mutex_unlock(&recorder_lock);
+
+    data = (char*) &buffer->chunk;
+    len = sizeof(tracefmt_chunk_t) +
+          __atomic_load_n(&buffer->chunk.num_events, __ATOMIC_ACQUIRE) * sizeof(tracefmt_event_t);
+    while (len > 0 && (written = write(trace_fd, data, len)) != 0) {
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      data += written;
+      len -= written;
+    }
+
+    pthread_mutex_lock(&recorder_lock);
+    buffer->next = buffer_pool;
+    buffer_pool = buffer;
+  }
+  pthread_mutex_unlock(&recorder_lock);
+  return NULL;
+}
+
+/* A forked child has no writer thread, so it records nothing. */
+static void recorder_fork_child() {
+  recording = 0;
+}
+
+static void recorder_start(const char* path) {
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd < 0) {
+    fprintf(stderr, "mm-preload: cannot create %s\n", path);
+    return;
+  }
+  if (write(trace_fd, TRACEFMT_EVENT_MAGIC, TRACEFMT_MAGIC_LEN) != TRACEFMT_MAGIC_LEN ||
+      pthread_key_create(&recorder_key, recorder_thread_exit) != 0 ||
+      pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+    fprintf(stderr, "mm-preload: cannot record to %s\n", path);
+    close(trace_fd);
+    trace_fd = -1;
+    return;
+  }
+  pthread_atfork(NULL, NULL, recorder_fork_child);
+  recording = 1;
+}
+
+/*
+ * Write out every buffer, including those that threads are still filling,
+ * and wait for the writer thread. Events that other threads record while
+ * the process exits may be lost.
+ */
+__attribute__((destructor))
+static void recorder_stop() {
+  if (!recording) {
+    return;
+  }
+  recording = 0;
+  pthread_mutex_lock(&recorder_lock);
+  while (live_buffers != NULL) {
+    buffer_queue(live_buffers);
+  }
+  writer_stopping = 1;
+  pthread_cond_signal(&recorder_cond);
+  pthread_mutex_unlock(&recorder_lock);
+  pthread_join(writer_thread, NULL);
+  close(trace_fd);
+}
+
+
+// SETUP ------------------------------------------------------------
+
+static size_t env_size(const char* name, size_t default_value) {
+  const char* value = getenv(name);
+
+  return value != NULL && *value != '\0' ? (size_t) strtoull(value, NULL, 10) : default_value;
+}
+
+static void preload_init() {
+  const char* allocator = getenv("MM_PRELOAD_ALLOCATOR");
+  const char* trace = getenv("MM_PRELOAD_TRACE");
+  int arenas;
+
+  libc_malloc_usable_size = (size_t (*)(void*)) dlsym(RTLD_NEXT, "malloc_usable_size");
+
+  if (allocator != NULL && strcmp(allocator, "mm") == 0) {
+    arenas = (int) env_size("MM_PRELOAD_ARENAS", 8);
+    if (arenas < 1 || arenas > MEM_MAX_ARENAS) {
+      arenas = 8;
+    }
+    mem_set_max_heap(env_size("MM_PRELOAD_HEAP_MB", 1024) << 20);
+    mem_init_arenas(arenas);
+    mm_set_mmap_threshold(0);
+    use_mm = mm_init() == 0;
+  }
+  if (trace != NULL && *trace != '\0') {
+    recorder_start(trace);
+  }
+  __atomic_store_n(&preload_ready, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Enter the shim, setting it up on first use. Returns 0 for a call made
+ * from inside the shim, which must go straight to libc.
+ */
+static inline int shim_enter() {
+  if (in_shim) {
+    return 0;
+  }
+  in_shim = 1;
+  if (!__atomic_load_n(&preload_ready, __ATOMIC_ACQUIRE)) {
+    pthread_once(&preload_once, preload_init);
+  }
+  return 1;
+}
+
+static inline void shim_leave() {
+  in_shim = 0;
+}
+
+/* Whether ptr was allocated by mm.c; everything else belongs to libc. */
+static inline int mm_owns(void* ptr) {
+  return use_mm && mem_arena_of(ptr) >= 0;
+}
+
+
+// INTERPOSED INTERFACE ---------------------------------------------
+
+void* malloc(size_t size) {
+  void* ptr;
+
+  if (!shim_enter()) {
+    return __libc_malloc(size);
+  }
+  // Programs may take NULL from malloc(0) for a failure, so unlike
+  // mm_malloc it returns a block.
+  ptr = use_mm ? mm_malloc(size != 0 ? size : 1) : __libc_malloc(size);
+  if (recording && ptr != NULL) {
+    record(event_seq(), TRACEFMT_ALLOC, ptr, NULL, size);
+  }
+  shim_leave();
+  return ptr;
+}
+
+void free(void* ptr) {
+  uint64_t seq;
+
+  if (ptr == NULL) {
+    return;
+  }
+  if (!shim_enter()) {
+    if (mm_owns(ptr)) {
+      mm_free(ptr);
+    } else {
+      __libc_free(ptr);
+    }
+    return;
+  }
+  // Numbered before the block is freed, so that it precedes the event of
+  // any other thread that is given the same address next.
+  seq = event_seq();
+  if (mm_owns(ptr)) {
+    mm_free(ptr);
+  } else {
+    __libc_free(ptr);
+  }
+  if (recording) {
+    record(seq, TRACEFMT_FREE, ptr, NULL, 0);
+  }
+  shim_leave();
+}
+
+void* calloc(size_t num, size_t size) {
+  void* ptr;
+
+  if (!shim_enter()) {
+    return __libc_calloc(num, size);
+  }
+  if (use_mm) {
+    if (size != 0 && num > SIZE_MAX / size) {
+      errno = ENOMEM;
+      ptr = NULL;
+    } else {
+      ptr = num * size != 0 ? mm_calloc(num, size) : mm_malloc(1);
+    }
+  } else {
+    ptr = __libc_calloc(num, size);
+  }
+  if (recording && ptr != NULL) {
+    record(event_seq(), TRACEFMT_ALLOC, ptr, NULL, num * size);
+  }
+  shim_leave();
+  return ptr;
+}
+
+/*
+ * A realloc is recorded as two events: one numbered before the call, when
+ * the old block is given up, and one after it, when the new one exists.
+ */
+void* realloc(void* ptr, size_t size) {
+  void* new_ptr;
+  uint64_t seq;
+
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  if (!shim_enter()) {
+    return mm_owns(ptr) ? mm_realloc(ptr, size) : __libc_realloc(ptr, size);
+  }
+  seq = event_seq();
+  new_ptr = mm_owns(ptr) ? mm_realloc(ptr, size) : __libc_realloc(ptr, size);
+  if (recording) {
+    record(seq, TRACEFMT_REALLOC_FROM, NULL, ptr, 0);
+    record(event_seq(), TRACEFMT_REALLOC, new_ptr, ptr, size);
+  }
+  shim_leave();
+  return new_ptr;
+}
+
+void* memalign(size_t alignment, size_t size) {
+  void* ptr;
+
+  if (!shim_enter()) {
+    return __libc_memalign(alignment, size);
+  }
+  // mm_memalign only takes powers of two, which glibc rounds up to.
+  if (use_mm && alignment != 0 && (alignment & (alignment - 1)) == 0) {
+    ptr = mm_memalign(alignment, size != 0 ? size : 1);
+  } else {
+    ptr = __libc_memalign(alignment, size);
+  }
+  if (recording && ptr != NULL) {
+    record(event_seq(), TRACEFMT_ALLOC, ptr, NULL, size);
+  }
+  shim_leave();
+  return ptr;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+  void* ptr;
+
+  if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  if ((ptr = memalign(alignment, size)) == NULL) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+void* valloc(size_t size) {
+  return memalign(mem_pagesize(), size);
+}
+
+void* pvalloc(size_t size) {
+  size_t page = mem_pagesize();
+
+  return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void* ptr) {
+  int arena;
+
+  if (ptr == NULL) {
+    return 0;
+  }
+  if (mm_owns(ptr)) {
+    arena = mem_arena_of(ptr);
+    if (USE_SLABS && slab_owns(arena, ptr)) {
+      return slab_of(ptr)->object_size;
+    }
+    return SIZE(((block_info*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE))->size_and_tags) - TAG_SIZE - CANARY_SIZE;
+  }
+  return libc_malloc_usable_size != NULL ? libc_malloc_usable_size(ptr) : 0;
+}
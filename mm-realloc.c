@@ -12,9 +12,175 @@
  *    so make sure you actually test your code on these traces!
  *  - This file does not need to be submitted if you did not attempt it.
  */
+#include <string.h>
+
 #include "mm.c"
 
 
+/*
+ * Find and claim a used block of req_size bytes for a block that cannot grow
+ * in place. If the free block found is the last block in the heap, the new
+ * block is carved from its end, so later reallocs can keep growing it with
+ * mem_sbrk while the front remains free for other requests.
+ */
+static block_info* move_destination(size_t req_size) {
+  block_info* dest;
+  block_info* following_block;
+  size_t dest_size;
+  size_t lead_size;
+
+  dest = find_free_block(req_size);
+  remove_free_block(dest);
+  dest_size = SIZE(dest->size_and_tags);
+  following_block = (block_info*) UNSCALED_POINTER_ADD(dest, dest_size);
+
+  if (SIZE(following_block->size_and_tags) == 0 &&
+      dest_size - req_size >= MIN_BLOCK_SIZE) {
+    // Leave the leading part free, with its own footer.
+    lead_size = dest_size - req_size;
+    dest->size_and_tags = lead_size | (dest->size_and_tags & TAG_PRECEDING_USED);
+    *((tag_t*) UNSCALED_POINTER_ADD(dest, lead_size - TAG_SIZE)) = dest->size_and_tags;
+    insert_free_block(dest);
+
+    dest = (block_info*) UNSCALED_POINTER_ADD(dest, lead_size);
+    dest->size_and_tags = req_size;
+    dest_size = req_size;
+  }
+  place_block(dest, dest_size, req_size);
+  return dest;
+}
+
+
+/*
+ * Resize the used block whose payload is ptr to hold size bytes (size > 0),
+ * returning the payload's new address. The caller must hold the lock of the
+ * arena that contains the block; a moved block stays in that arena.
+ * The block is resized in place whenever possible:
+ *  - A shrinking block splits off its tail as a free block.
+ *  - A growing block absorbs a following free block.
+ *  - A block that reaches the end-of-heap word (possibly after absorbing a
+ *    following free block) extends the heap by the missing bytes only.
+ * Only when none of these apply is the data moved to a new block.
+ */
+static void* resize_block(void* ptr, size_t size) {
+  block_info* block;
+  block_info* following_block;
+  block_info* end_block;
+  block_info* tail;
+  size_t block_size;
+  size_t req_size;
+  size_t avail_size;
+  void* new_ptr;
+
+  block = (block_info*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+  block_size = SIZE(block->size_and_tags);
+  req_size = request_size(size);
+
+  // Shrink in place, returning any excess to the free list. The excess may
+  // be followed by a free block, so coalesce it.
+  if (req_size <= block_size) {
+    tail = place_block(block, block_size, req_size);
+    if (tail != NULL) {
+      coalesce_free_block(tail);
+    }
+    return ptr;
+  }
+
+  // Count the space of a following free block (there is at most one, since
+  // free blocks are always coalesced).
+  avail_size = block_size;
+  following_block = (block_info*) UNSCALED_POINTER_ADD(block, block_size);
+  if ((following_block->size_and_tags & TAG_USED) == 0) {
+    avail_size += SIZE(following_block->size_and_tags);
+  }
+
+  // If that space ends at the end-of-heap word, grow the heap by just the
+  // difference. The old end-of-heap word becomes part of the block and a new
+  // one is written after it.
+  end_block = (block_info*) UNSCALED_POINTER_ADD(block, avail_size);
+  if (avail_size < req_size && SIZE(end_block->size_and_tags) == 0) {
+    STAT_ADD(sbrk_calls, 1);
+    if ((ssize_t) mem_arena_sbrk(PROLOGUE->arena, req_size - avail_size) != -1) {
+      *((tag_t*) UNSCALED_POINTER_ADD(block, req_size)) = TAG_USED;
+      avail_size = req_size;
+    }
+  }
+
+  // Grow in place by absorbing the following free block.
+  if (avail_size >= req_size) {
+    if ((following_block->size_and_tags & TAG_USED) == 0) {
+      remove_free_block(following_block);
+    }
+    place_block(block, avail_size, req_size);
+    return ptr;
+  }
+
+  // Otherwise move the payload to a new block.
+  new_ptr = UNSCALED_POINTER_ADD(move_destination(req_size), TAG_SIZE);
+  memcpy(new_ptr, ptr, block_size - TAG_SIZE);
+  canary_clear(block);
+  heap_free(block);
+  return new_ptr;
+}
+
+
+/*
+ * Resize the directly mapped block whose payload is ptr to hold size bytes.
+ * A block that stays above the mapping threshold is remapped, which moves
+ * its pages instead of copying them; a smaller one, or one that cannot be
+ * remapped, is copied to a block of mm_malloc and *moved is set.
+ */
+static void* resize_mapped(void* ptr, size_t size, int* moved) {
+  block_info* block = (block_info*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+  size_t block_size = SIZE(block->size_and_tags);
+  size_t req_size = request_size(size);
+  size_t map_size;
+  block_info* new_block;
+  void* new_ptr;
+
+  *moved = 0;
+  if (req_size >= mmap_threshold) {
+    map_size = mapped_size(req_size);
+    if (map_size - MAP_SLACK == block_size) {
+      return ptr;
+    }
+    new_block = NULL;
+    if (map_size - MAP_SLACK == (tag_t) (map_size - MAP_SLACK)) {
+      new_block = (block_info*) mem_remap(UNSCALED_POINTER_SUB(block, TAG_PAD),
+                                          block_size + MAP_SLACK, map_size);
+    }
+    if (new_block != NULL) {
+      new_block = (block_info*) UNSCALED_POINTER_ADD(new_block, TAG_PAD);
+      new_block->size_and_tags = (map_size - MAP_SLACK) | TAG_PRECEDING_USED | TAG_USED;
+      return UNSCALED_POINTER_ADD(new_block, TAG_SIZE);
+    }
+  }
+
+  // mm_malloc counts the new block, which may be directly mapped as well.
+  new_ptr = mm_malloc(size);
+  memcpy(new_ptr, ptr, size < block_size - TAG_SIZE ? size : block_size - TAG_SIZE);
+  mapped_free(block);
+  *moved = 1;
+  return new_ptr;
+}
+
+
+/*
+ * Count a block of old_size bytes that was resized into the block at
+ * new_ptr as one that stays in use.
+ */
+static void count_resize(size_t old_size, void* new_ptr) {
+  size_t new_size = SIZE(((block_info*) UNSCALED_POINTER_SUB(new_ptr, TAG_SIZE))->size_and_tags);
+
+  if (MM_STATS) {
+    if (!thread_counters.registered) {
+      stats_register();
+    }
+    STAT_ADD(in_use_bytes, new_size - old_size);
+  }
+}
+
+
 /*
  * EXTRA CREDIT:
  * Change the size of the memory block pointed to by ptr to size bytes while
@@ -24,7 +190,51 @@
  *  - if size is 0, equivalent to free(size)
  */
 void* mm_realloc(void* ptr, size_t size) {
-  // TODO: Implement mm_realloc.
-  // You will want to replace this return statement...
-  return NULL;
+  void* new_ptr;
+  size_t old_size;
+  int arena;
+  int moved;
+
+  if (ptr == NULL) {
+    return mm_malloc(size);
+  }
+  if (size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+
+  // Directly mapped blocks lie outside of all arenas. Slab objects have no
+  // header; they stay in place while the new size fits the object and
+  // otherwise move to a block of the right kind.
+  arena = mem_arena_of(ptr);
+  if (arena < 0) {
+    check_used_block(ptr, -1);
+    old_size = SIZE(((block_info*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE))->size_and_tags);
+    new_ptr = resize_mapped(ptr, size, &moved);
+    canary_set((block_info*) UNSCALED_POINTER_SUB(new_ptr, TAG_SIZE));
+    if (moved) {
+      count_free(old_size);
+    } else {
+      count_resize(old_size, new_ptr);
+    }
+    return new_ptr;
+  }
+  if (USE_SLABS && slab_owns(arena, ptr)) {
+    if (size <= slab_of(ptr)->object_size) {
+      return ptr;
+    }
+    new_ptr = mm_malloc(size);
+    memcpy(new_ptr, ptr, slab_of(ptr)->object_size);
+    mm_free(ptr);
+    return new_ptr;
+  }
+
+  check_used_block(ptr, arena);
+  old_size = SIZE(((block_info*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE))->size_and_tags);
+  arena_lock(arena);
+  new_ptr = resize_block(ptr, size);
+  arena_unlock(arena);
+  canary_set((block_info*) UNSCALED_POINTER_SUB(new_ptr, TAG_SIZE));
+  count_resize(old_size, new_ptr);
+  return new_ptr;
 }
@@ -25,11 +25,46 @@
  *
  * NOTES:
  *  - Explicit allocator with an explicit free-list
- *  - Free-list uses a single, doubly-linked list with LIFO insertion policy,
- *    first-fit search strategy, and immediate coalescing.
+ *  - Free blocks are kept in segregated, doubly-linked lists, one per
+ *    power-of-two size class, with first-fit search strategy within a class
+ *    and immediate coalescing. The insertion policy is LIFO by default; see
+ *    FREE_LIST_POLICY for FIFO, address-ordered, and next-fit lists.
+ *  - Free blocks of at least TREE_MIN_SIZE bytes are instead kept in a treap
+ *    ordered by (size, address), which gives an O(log n) best-fit search
+ *    for large requests. The tree links live in the free block's payload.
+ *  - mm_malloc and mm_free are thread-safe. Each memlib arena is a separate
+ *    heap with its own lock; threads are assigned arenas round-robin, and a
+ *    block is always freed back to the arena that contains it. Small blocks
+ *    are served from per-thread caches that need no lock (see THREAD CACHE
+ *    below).
+ *  - Requests of at most SLAB_MAX_SIZE bytes are served from slabs: aligned,
+ *    SLAB_SIZE-byte regions of a single used block, carved into equal objects
+ *    with an occupancy bitmap and no per-object boundary tags. A per-arena
+ *    map of SLAB_SIZE windows tells mm_free whether a pointer is a slab
+ *    object.
+ *  - With DEFERRED_COALESCE, small freed blocks wait in exact-size quick
+ *    lists and are only coalesced in batches (see QUICK LISTS below).
+ *  - Blocks of at least MMAP_THRESHOLD bytes get a mapping of their own
+ *    outside of the arenas (see DIRECT MAPPING below), which mm_free gives
+ *    straight back, so large transient buffers do not grow the heap.
+ *  - mm_memalign splits a free block so that the payload lands on the
+ *    boundary, and mm_calloc only clears what may have been written since
+ *    the arena's memory was last zero (see fresh_start in the prologue).
+ *  - mm_check walks every arena and checks the boundary tags and the free
+ *    lists against each other. With MM_HARDEN, used blocks end in a canary
+ *    that mm_free and mm_check check, and a sample of the frees runs
+ *    mm_check (see HEAP CHECKER and HARDENING below).
+ *  - mm_snapshot writes the arenas to a file, and mm_restore maps them back
+ *    at the same addresses in a later process (see SNAPSHOTS below).
+ *  - Each arena starts with a prologue (struct heap_prologue) that holds the
+ *    allocator state, i.e., the heads of the size-class free lists and the
+ *    root of the large-block tree.
+ *  - With COMPACT_HEADERS, boundary tags are 4 bytes and free-list links are
+ *    32-bit offsets into the arena (see COMPACT LAYOUT below), which makes
+ *    the minimum block 16 bytes instead of 32.
  *  - We use "next" and "previous" to refer to blocks as ordered in the free-list.
  *  - We use "following" and "preceding" to refer to adjacent blocks in memory.
- *  - Pointers in the free-list will point to the beginning of a heap block
+ *  - Links in the free-list will refer to the beginning of a heap block
  *    (i.e., to the header).
  *  - Pointers returned by mm_malloc point to the beginning of the payload
  *    (i.e., to the word after the header).
@@ -64,11 +99,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "memlib.h"
 #include "mm.h"
+#include "config.h"
 
 
 // Static functions for unscaled pointer arithmetic to keep other code cleaner.
@@ -78,39 +118,210 @@
 //  - We cast the result to void* to force you to cast back to the appropriate
 //    type and ensure you don't accidentally use the resulting pointer as a
 //    char* implicitly.
-static inline void* UNSCALED_POINTER_ADD(void* p, int x) { return ((void*)((char*)(p) + (x))); }
-static inline void* UNSCALED_POINTER_SUB(void* p, int x) { return ((void*)((char*)(p) - (x))); }
-
+static inline void* UNSCALED_POINTER_ADD(void* p, size_t x) { return ((void*)((char*)(p) + (x))); }
+static inline void* UNSCALED_POINTER_SUB(void* p, size_t x) { return ((void*)((char*)(p) - (x))); }
+
+// Round x up to a multiple of the power of two a (a constant expression).
+#define ROUND_UP(x, a) (((x) + (a) - 1) & ~((size_t) (a) - 1))
+
+
+// Use 4-byte boundary tags and 32-bit free-list links when COMPACT_HEADERS
+// is set (see COMPACT LAYOUT below). Every arena must then be at most 4 GB.
+#ifndef COMPACT_HEADERS
+#define COMPACT_HEADERS 0
+#endif
+
+// A boundary tag, and a link to a block in the free lists or trees. A link
+// is a pointer, or in the compact layout the offset of the block from the
+// prologue of its arena (0 for none).
+#if COMPACT_HEADERS
+typedef uint32_t tag_t;
+typedef uint32_t link_t;
+#else
+typedef size_t tag_t;
+typedef struct block_info* link_t;
+#endif
 
 // A block_info can be used to access information about a heap block,
 // including boundary tag info (size and usage tags in header and footer)
-// and pointers to the next and previous blocks in the free-list.
+// and links to the next and previous blocks in the free-list.
 struct block_info {
     // Size of the block and tags (preceding-used? and used? flags) combined
 	// together. See the SIZE() function and TAG macros below for more details
 	// and how to extract these pieces of info.
-    size_t size_and_tags;
-    // Pointer to the next block in the free list.
-    struct block_info* next;
-    // Pointer to the previous block in the free list.
-    struct block_info* prev;
+    tag_t size_and_tags;
+    // Link to the next block in the free list.
+    link_t next;
+    // Link to the previous block in the free list.
+    link_t prev;
+    // Children in the size-ordered tree of large free blocks, or in the
+    // address-ordered index of a size class (POLICY_ADDRESS). These fields
+    // are only present in free blocks of at least TREE_MIN_SIZE bytes, or in
+    // every block under POLICY_ADDRESS.
+    link_t left;
+    link_t right;
 };
 typedef struct block_info block_info;
 
+// The empty link.
+#define NO_LINK ((link_t) 0)
 
-// Pointer to the first block_info in the free list, the list's head.
-// In this implementation, this is stored in the first word in the heap and
-// accessed via mem_heap_lo().
-#define FREE_LIST_HEAD *((block_info **)mem_heap_lo())
 
 // Size of a word on this architecture.
 #define WORD_SIZE sizeof(void*)
 
-// Minimum block size (accounts for header, next ptr, prev ptr, and footer).
-#define MIN_BLOCK_SIZE (sizeof(block_info) + WORD_SIZE)
+// Size of a boundary tag.
+#define TAG_SIZE sizeof(tag_t)
+
+// Placement policies of the size-class free lists; a policy picks where
+// insert_free_block puts a block, and so which block search_free_list finds
+// first. Large blocks in the tree are always placed best fit.
+//  - POLICY_LIFO inserts at the head of the list.
+//  - POLICY_FIFO inserts at the tail of the list.
+//  - POLICY_ADDRESS keeps each list in address order. A treap of the list's
+//    blocks, keyed by address, finds the insertion point in O(log n).
+//  - POLICY_NEXT_FIT inserts at the head, and each search resumes at a
+//    roving pointer where the previous one stopped.
+#define POLICY_LIFO 0
+#define POLICY_FIFO 1
+#define POLICY_ADDRESS 2
+#define POLICY_NEXT_FIT 3
+#ifndef FREE_LIST_POLICY
+#define FREE_LIST_POLICY POLICY_LIFO
+#endif
+
+// LIFO lists need no per-class policy state.
+#define NUM_LIST_AUX (FREE_LIST_POLICY == POLICY_LIFO ? 1 : NUM_SIZE_CLASSES)
+
+// Minimum block size (accounts for header, next link, prev link, and footer,
+// plus the tree links under POLICY_ADDRESS), rounded up to ALIGNMENT.
+#define MIN_BLOCK_SIZE ROUND_UP((FREE_LIST_POLICY == POLICY_ADDRESS ? \
+                                 sizeof(block_info) : offsetof(block_info, left)) + TAG_SIZE, \
+                                ALIGNMENT)
+
+// Number of segregated free lists. Class k holds free blocks with sizes in
+// [MIN_BLOCK_SIZE << k, MIN_BLOCK_SIZE << (k + 1)); the last class also holds
+// everything larger. Setting this to 1 gives a single LIFO free list.
+#ifndef NUM_SIZE_CLASSES
+#define NUM_SIZE_CLASSES 20
+#endif
+
+// Free blocks of at least TREE_MIN_SIZE bytes are indexed by the size-ordered
+// tree instead of the size-class lists when USE_SIZE_TREE is set.
+#ifndef USE_SIZE_TREE
+#define USE_SIZE_TREE 1
+#endif
+#ifndef TREE_MIN_SIZE
+#define TREE_MIN_SIZE 1024
+#endif
+
+// Defer the coalescing of freed blocks of at most QUICK_MAX_SIZE bytes when
+// DEFERRED_COALESCE is set: they wait, still tagged used, in exact-size quick
+// lists until a consolidation pass (see QUICK LISTS below).
+#ifndef DEFERRED_COALESCE
+#define DEFERRED_COALESCE 0
+#endif
+#ifndef QUICK_MAX_SIZE
+#define QUICK_MAX_SIZE 512
+#endif
+
+// Consolidate once the blocks in quick lists take up more than
+// QUICK_MAX_PERCENT percent of the arena, which bounds their cost in
+// utilization.
+#ifndef QUICK_MAX_PERCENT
+#define QUICK_MAX_PERCENT 5
+#endif
+
+// One quick list per ALIGNMENT bytes of block size.
+#define NUM_QUICK_LISTS (DEFERRED_COALESCE ? (QUICK_MAX_SIZE - MIN_BLOCK_SIZE) / ALIGNMENT + 1 : 1)
+
+
+// Serve requests of at most SLAB_MAX_SIZE bytes from slabs when USE_SLABS is
+// set. There is one slab class per ALIGNMENT bytes of object size.
+#ifndef USE_SLABS
+#define USE_SLABS 1
+#endif
+#define SLAB_MAX_SIZE ROUND_UP(24, ALIGNMENT)
+#define SLAB_SIZE 4096
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+
+// Occupancy bitmap words needed for the smallest objects in a slab.
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / ALIGNMENT / 64)
+
+// A slab sits at the start of an aligned SLAB_SIZE window and is followed by
+// its objects. It is the payload of an ordinary used heap block.
+struct slab {
+    // Next and previous slab of the same class with free objects.
+    struct slab* next;
+    struct slab* prev;
+    // Size of each object, number of objects, and number in use.
+    unsigned int object_size;
+    unsigned int capacity;
+    unsigned int used;
+    unsigned int unused;
+    // Bit i is set when object i is in use.
+    uint64_t bitmap[SLAB_BITMAP_WORDS];
+};
+typedef struct slab slab;
+
+// Bytes from a slab to its first object.
+#define SLAB_HEADER_SIZE ROUND_UP(sizeof(slab), ALIGNMENT)
+
+// Bit w of slab_map[a] is set when window w of arena a holds a slab. The maps
+// live outside the heap and are only made once an arena has a slab.
+static uint8_t* slab_map[MEM_MAX_ARENAS];
+static size_t slab_map_size[MEM_MAX_ARENAS];
+
+
+// The heap prologue occupies the first bytes of an arena (accessed via
+// mem_arena_lo()) and holds the heads of the size-class free lists, the
+// root of the large-block tree, the quick lists, and the slabs with free
+// objects.
+struct heap_prologue {
+    link_t free_lists[NUM_SIZE_CLASSES];
+    // Bit c is set when the free list of size class c is not empty.
+    uint64_t nonempty_classes;
+    // Per-class state of the placement policy: the tail of the list
+    // (POLICY_FIFO), the root of its address index (POLICY_ADDRESS), or the
+    // roving pointer (POLICY_NEXT_FIT).
+    link_t list_aux[NUM_LIST_AUX];
+    link_t tree_root;
+    block_info* quick_lists[NUM_QUICK_LISTS];
+    // Total size of the blocks in quick lists.
+    size_t quick_bytes;
+    slab* slabs[NUM_SLAB_CLASSES];
+    // Bytes at or above fresh_start have not been written since they last
+    // read as zero, except the footer of the last free block and the
+    // end-of-heap word (see mm_calloc).
+    char* fresh_start;
+    // Index of the memlib arena this prologue starts.
+    size_t arena;
+};
+typedef struct heap_prologue heap_prologue;
+
+// Prologue of the arena the calling thread has locked with arena_lock().
+static __thread heap_prologue* current_prologue;
+
+#define PROLOGUE current_prologue
+
+// Link to the first block_info in the free list for size class c.
+#define FREE_LIST_HEAD(c) (PROLOGUE->free_lists[c])
+
+// Bitmap of the size classes with free blocks (see heap_prologue).
+#define NONEMPTY_CLASSES (PROLOGUE->nonempty_classes)
+
+// Link to the root of the large-block tree.
+#define TREE_ROOT (PROLOGUE->tree_root)
 
-// Alignment requirement for allocator.
-#define ALIGNMENT 8
+// Policy state for size class c, see heap_prologue.
+#define LIST_AUX(c) (PROLOGUE->list_aux[c])
+
+
+// Payloads are aligned to ALIGNMENT bytes (see config.h). The tags use the
+// low 3 bits of a block size.
+#if ALIGNMENT < 8 || (ALIGNMENT & (ALIGNMENT - 1)) != 0
+#error "ALIGNMENT must be a power of two of at least 8"
+#endif
 
 // SIZE(block_info->size_and_tags) extracts the size of a 'size_and_tags' field.
 // SIZE(size) returns a properly-aligned value of 'size' (by rounding down).
@@ -123,6 +334,266 @@ static inline size_t SIZE(size_t x) { return ((x) & ~(ALIGNMENT - 1)); }
 #define TAG_PRECEDING_USED 2
 
 
+// COMPACT LAYOUT ---------------------------------------------------
+//  - With 4-byte tags (or 8-byte tags and an ALIGNMENT of 16), a block starts
+//    TAG_PAD bytes past an ALIGNMENT boundary so that its payload is
+//    aligned. Block sizes stay multiples of ALIGNMENT, so every block of an
+//    arena starts at the same offset.
+//  - Links are offsets from PROLOGUE, so they are only followed while the
+//    arena that holds the block is the current one.
+//  - A free block then needs 16 bytes (header, two links, footer), and a
+//    used one 4 bytes of overhead.
+
+// Bytes in front of the first block of an arena or mapping.
+#define TAG_PAD ((ALIGNMENT - TAG_SIZE % ALIGNMENT) % ALIGNMENT)
+
+// Offset of the first block from the start of an arena.
+#define HEAP_START (ROUND_UP(sizeof(heap_prologue), ALIGNMENT) + TAG_PAD)
+
+/* Return the block that link refers to in the current arena, or NULL. */
+static inline block_info* to_block(link_t link) {
+#if COMPACT_HEADERS
+  return link != NO_LINK ? (block_info*) UNSCALED_POINTER_ADD(PROLOGUE, link) : NULL;
+#else
+  return link;
+#endif
+}
+
+/* Note that the bytes of the current arena below end may have been written. */
+static inline void mark_written(void* end) {
+  if ((char*) end > PROLOGUE->fresh_start) {
+    PROLOGUE->fresh_start = (char*) end;
+  }
+}
+
+/* Return the link to block (NULL for none) in the current arena. */
+static inline link_t to_link(block_info* block) {
+#if COMPACT_HEADERS
+  return block != NULL ? (link_t) ((char*) block - (char*) PROLOGUE) : NO_LINK;
+#else
+  return block;
+#endif
+}
+
+
+// Serve small blocks from per-thread caches when THREAD_CACHE is set.
+#ifndef THREAD_CACHE
+#define THREAD_CACHE 1
+#endif
+
+// Largest block size kept in a thread cache.
+#define TCACHE_MAX_SIZE 256
+
+// Number of blocks a bin may hold before half of it is flushed.
+#define TCACHE_BIN_MAX 16
+
+// Number of blocks taken from the shared heap when a bin is empty.
+#define TCACHE_FILL 4
+
+// One bin per ALIGNMENT-sized step from MIN_BLOCK_SIZE to TCACHE_MAX_SIZE.
+#define TCACHE_BINS ((TCACHE_MAX_SIZE - MIN_BLOCK_SIZE) / ALIGNMENT + 1)
+
+// A thread_cache holds one thread's small used blocks, by exact block size.
+struct thread_cache {
+    // Value of heap_generation when the cached blocks were taken.
+    unsigned generation;
+    // Whether the thread-exit destructor has been registered.
+    int registered;
+    // Number of blocks in each bin.
+    int counts[TCACHE_BINS];
+    // Payload of the first block in each bin.
+    void* bins[TCACHE_BINS];
+};
+typedef struct thread_cache thread_cache;
+
+static __thread thread_cache tcache;
+
+// Protect each arena's heap (free lists, tree, and boundary tags).
+static pthread_mutex_t arena_locks[MEM_MAX_ARENAS] = {
+    [0 ... MEM_MAX_ARENAS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+// Arena the calling thread allocates from, or -1 if not yet assigned.
+static __thread int thread_arena = -1;
+
+// Round-robin counter for assigning arenas to threads.
+static unsigned next_arena;
+
+// Incremented by mm_init so stale thread caches are discarded.
+static unsigned heap_generation = 1;
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// Keep the counters reported by mm_stats when MM_STATS is set. Each thread
+// counts in its own thread_stats, so counting costs a plain add.
+#ifndef MM_STATS
+#define MM_STATS 1
+#endif
+
+#if NUM_SIZE_CLASSES > MM_STATS_CLASSES
+#error "NUM_SIZE_CLASSES exceeds MM_STATS_CLASSES"
+#endif
+
+struct thread_stats {
+    // Bytes of blocks handed out minus those given back by this thread. The
+    // sum over all threads is exact even when a thread's own value wraps.
+    size_t in_use_bytes;
+    size_t sbrk_calls;
+    size_t splits;
+    size_t coalesces;
+    size_t searches;
+    size_t search_steps;
+    size_t mallocs[NUM_SIZE_CLASSES];
+    size_t frees[NUM_SIZE_CLASSES];
+    // Whether this thread is on the stats_threads list.
+    int registered;
+    struct thread_stats* next;
+    struct thread_stats* prev;
+};
+typedef struct thread_stats thread_stats;
+
+static __thread thread_stats thread_counters;
+
+// Counters of the live threads, and the sums of those that have exited.
+static thread_stats* stats_threads;
+static thread_stats stats_retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+// Add n to a counter of the calling thread. The store is atomic so that
+// mm_stats may read it from another thread at any time.
+#if MM_STATS
+#define STAT_ADD(field, n) \
+  __atomic_store_n(&thread_counters.field, thread_counters.field + (n), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(field, n) ((void) 0)
+#endif
+
+/*
+ * Make mm_stats count in_use_bytes as in use, when the heap is replaced:
+ * the blocks of the old one, which the counters of the threads include, are
+ * gone.
+ */
+static void stats_set_in_use(size_t in_use_bytes) {
+  thread_stats* t;
+
+  pthread_mutex_lock(&stats_lock);
+  for (t = stats_threads; t != NULL; t = t->next) {
+    __atomic_store_n(&t->in_use_bytes, 0, __ATOMIC_RELAXED);
+  }
+  stats_retired.in_use_bytes = in_use_bytes;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// Free blocks of at least TRIM_THRESHOLD bytes are given back to the system
+// as soon as they are freed; 0 leaves trimming to explicit mm_trim calls.
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD 0
+#endif
+
+// Current automatic trimming threshold, see mm_set_trim_threshold.
+static size_t trim_threshold = TRIM_THRESHOLD;
+
+// Blocks of at least MMAP_THRESHOLD bytes get a mapping of their own instead
+// of heap space (0 keeps every block in the heap).
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (256 * 1024)
+#endif
+
+// Current direct mapping threshold, see mm_set_mmap_threshold.
+static size_t mmap_threshold = MMAP_THRESHOLD;
+
+// Check each block passed to mm_free, mm_free_batch and mm_realloc when
+// MM_HARDEN is set, and run mm_check on the arena of every
+// MM_CHECK_INTERVAL-th free of a thread (see HARDENING below).
+#ifndef MM_HARDEN
+#define MM_HARDEN 0
+#endif
+#ifndef MM_CHECK_INTERVAL
+#define MM_CHECK_INTERVAL 65536
+#endif
+
+// Current sampling interval of mm_check, see mm_set_check_interval.
+static size_t check_interval = MM_CHECK_INTERVAL;
+
+// Bytes at the end of a used block that hold its canary.
+#define CANARY_SIZE (MM_HARDEN ? TAG_SIZE : 0)
+
+// Key the canaries are made from, picked anew by mm_init.
+static uintptr_t canary_key;
+
+/* Report a corrupted heap, which can no longer be trusted, and abort. */
+static void heap_corrupt(const char* what, void* ptr) {
+  fprintf(stderr, "ERROR: %s: %p\n", what, ptr);
+  abort();
+}
+
+// The canary of a used block (see HARDENING below).
+static inline tag_t* canary_of(block_info* block) {
+  return (tag_t*) UNSCALED_POINTER_ADD(block, SIZE(block->size_and_tags) - TAG_SIZE);
+}
+
+static inline tag_t canary_value(block_info* block) {
+  return (tag_t) (canary_key ^ (uintptr_t) block ^ SIZE(block->size_and_tags));
+}
+
+/* Arm the canary of a used block before it is handed out. */
+static inline void canary_set(block_info* block) {
+  if (MM_HARDEN) {
+    *canary_of(block) = canary_value(block);
+  }
+}
+
+/* Mark the used block the program frees as freed. */
+static inline void canary_clear(block_info* block) {
+  if (MM_HARDEN) {
+    *canary_of(block) = ~canary_value(block);
+  }
+}
+
+// Hooks for the garbage collector (mm-gc.c), which defines them before it
+// includes this file. MM_MALLOC_HOOK sees each payload mm_malloc takes from
+// the heap; MM_FREE_HOOK sees each payload passed to mm_free and returns
+// nonzero if it has taken over freeing it.
+#ifndef MM_MALLOC_HOOK
+#define MM_MALLOC_HOOK(ptr)
+#endif
+#ifndef MM_FREE_HOOK
+#define MM_FREE_HOOK(ptr) 0
+#endif
+
+
+/* Return the first block on the heap, immediately after the prologue. */
+static inline block_info* first_block() {
+  return (block_info*) UNSCALED_POINTER_ADD(PROLOGUE, HEAP_START);
+}
+
+
+/* Return the last byte of the current arena's heap. */
+static inline void* heap_hi() {
+  return mem_arena_hi(PROLOGUE->arena);
+}
+
+
+/*
+ * Return the size class whose free list holds blocks of the given size.
+ *  - Class c starts at MIN_BLOCK_SIZE << c, so it is the position of the
+ *    highest bit of size / MIN_BLOCK_SIZE (a division by a constant).
+ */
+static inline int size_class(size_t size) {
+  size_t units = size / MIN_BLOCK_SIZE;
+  int c;
+
+  if (units <= 1) {
+    return 0;
+  }
+  c = 63 - __builtin_clzll(units);
+  return c < NUM_SIZE_CLASSES - 1 ? c : NUM_SIZE_CLASSES - 1;
+}
+
+
 /*
  * Print the heap by iterating through it as an implicit free list.
  *  - For debugging; make sure to remove calls before submission as will affect
@@ -131,62 +602,272 @@ static inline size_t SIZE(size_t x) { return ((x) & ~(ALIGNMENT - 1)); }
  */
 static void examine_heap() {
   block_info* block;
+  int c;
 
   // print to stderr so output isn't buffered and not output if we crash
-  fprintf(stderr, "FREE_LIST_HEAD: %p\n", (void*) FREE_LIST_HEAD);
+  for (c = 0; c < NUM_SIZE_CLASSES; c++) {
+    if (FREE_LIST_HEAD(c) != NO_LINK) {
+      fprintf(stderr, "FREE_LIST_HEAD(%d): %p\n", c, (void*) to_block(FREE_LIST_HEAD(c)));
+    }
+  }
+  fprintf(stderr, "TREE_ROOT: %p\n", (void*) to_block(TREE_ROOT));
 
-  for (block = (block_info*) UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE);  // first block on heap
-       SIZE(block->size_and_tags) != 0 && block < (block_info*) mem_heap_hi();
+  for (block = first_block();
+       SIZE(block->size_and_tags) != 0 && block < (block_info*) heap_hi();
        block = (block_info*) UNSCALED_POINTER_ADD(block, SIZE(block->size_and_tags))) {
 
     // print out common block attributes
     fprintf(stderr, "%p: %ld %ld %ld\t",
             (void*) block,
             SIZE(block->size_and_tags),
-            block->size_and_tags & TAG_PRECEDING_USED,
-            block->size_and_tags & TAG_USED);
+            (size_t) (block->size_and_tags & TAG_PRECEDING_USED),
+            (size_t) (block->size_and_tags & TAG_USED));
 
     // and allocated/free specific data
     if (block->size_and_tags & TAG_USED) {
       fprintf(stderr, "ALLOCATED\n");
     } else {
       fprintf(stderr, "FREE\tnext: %p, prev: %p\n",
-              (void*) block->next,
-              (void*) block->prev);
+              (void*) to_block(block->next),
+              (void*) to_block(block->prev));
     }
   }
   fprintf(stderr, "END OF HEAP\n\n");
 }
 
 
+/* Return whether a free block of the given size is kept in the tree. */
+static inline int in_size_tree(size_t size) {
+  return USE_SIZE_TREE && size >= TREE_MIN_SIZE;
+}
+
+
+// Tree nodes are ordered by size, with ties broken by address, so every
+// free block has a unique key. The address indexes of POLICY_ADDRESS use the
+// same treap code ordered by address alone (by_address). The heap-ordered
+// priority of a node is a hash of its address, which keeps the treap
+// balanced in expectation without storing a priority field.
+static inline int tree_less(block_info* a, block_info* b, int by_address) {
+  size_t size_a = SIZE(a->size_and_tags);
+  size_t size_b = SIZE(b->size_and_tags);
+  if (by_address) {
+    return a < b;
+  }
+  return size_a < size_b || (size_a == size_b && a < b);
+}
+
+static inline size_t tree_priority(block_info* node) {
+  return (size_t) node * (size_t) 0x9E3779B97F4A7C15ULL;
+}
+
+
+/*
+ * Insert free_block into the tree at root.
+ *  - Descend until a node of lower priority is found, then split that
+ *    subtree around free_block's key and hang the halves off free_block.
+ */
+static void tree_insert(link_t* root, block_info* free_block, int by_address) {
+  link_t* link = root;
+  link_t* left;
+  link_t* right;
+  block_info* node;
+  size_t priority = tree_priority(free_block);
+
+  while ((node = to_block(*link)) != NULL && tree_priority(node) >= priority) {
+    link = tree_less(free_block, node, by_address) ? &node->left : &node->right;
+  }
+
+  left = &free_block->left;
+  right = &free_block->right;
+  while (node != NULL) {
+    if (tree_less(node, free_block, by_address)) {
+      *left = to_link(node);
+      left = &node->right;
+      node = to_block(node->right);
+    } else {
+      *right = to_link(node);
+      right = &node->left;
+      node = to_block(node->left);
+    }
+  }
+  *left = NO_LINK;
+  *right = NO_LINK;
+  *link = to_link(free_block);
+}
+
+
+/*
+ * Remove free_block from the tree at root by merging its two subtrees into
+ * the link that pointed at it.
+ */
+static void tree_remove(link_t* root, block_info* free_block, int by_address) {
+  link_t* link = root;
+  block_info* node;
+  block_info* left = to_block(free_block->left);
+  block_info* right = to_block(free_block->right);
+
+  while ((node = to_block(*link)) != free_block) {
+    link = tree_less(free_block, node, by_address) ? &node->left : &node->right;
+  }
+
+  while (left != NULL && right != NULL) {
+    if (tree_priority(left) > tree_priority(right)) {
+      *link = to_link(left);
+      link = &left->right;
+      left = to_block(left->right);
+    } else {
+      *link = to_link(right);
+      link = &right->left;
+      right = to_block(right->left);
+    }
+  }
+  *link = to_link((left != NULL) ? left : right);
+}
+
+
+/*
+ * Find the smallest free block in the tree of at least req_size bytes
+ * (best fit). Returns NULL if no block in the tree is large enough.
+ */
+static block_info* tree_search(size_t req_size) {
+  block_info* node = to_block(TREE_ROOT);
+  block_info* best = NULL;
+  size_t steps = 0;
+
+  while (node != NULL) {
+    steps++;
+    if (SIZE(node->size_and_tags) >= req_size) {
+      best = node;
+      node = to_block(node->left);
+    } else {
+      node = to_block(node->right);
+    }
+  }
+  STAT_ADD(search_steps, steps);
+  return best;
+}
+
+
+/*
+ * Find the block with the highest address below block in the address index
+ * at root, or NULL if there is none.
+ */
+static block_info* tree_predecessor(link_t root, block_info* block) {
+  block_info* node = to_block(root);
+  block_info* best = NULL;
+
+  while (node != NULL) {
+    if (node < block) {
+      best = node;
+      node = to_block(node->right);
+    } else {
+      node = to_block(node->left);
+    }
+  }
+  return best;
+}
+
+
 /*
- * Find a free block of the requested size in the free list.
+ * Find a free block of the requested size in the free lists.
  * Returns NULL if no free block is large enough.
+ *  - The request's own size class may hold smaller blocks, so it is searched
+ *    first-fit, in list order, starting at the roving pointer under
+ *    POLICY_NEXT_FIT. Every block in a larger class fits, so the first
+ *    non-empty larger class, the lowest bit of NONEMPTY_CLASSES above c,
+ *    supplies its head.
  */
 static block_info* search_free_list(size_t req_size) {
   block_info* free_block;
+  block_info* start;
+  int c = size_class(req_size);
+  uint64_t larger;
+  size_t steps = 0;
 
-  free_block = FREE_LIST_HEAD;
-  while (free_block != NULL) {
+  STAT_ADD(searches, 1);
+
+  // Large requests go straight to a best-fit lookup in the tree.
+  if (in_size_tree(req_size)) {
+    return tree_search(req_size);
+  }
+
+  start = to_block(FREE_LIST_HEAD(c));
+  if (FREE_LIST_POLICY == POLICY_NEXT_FIT && LIST_AUX(c) != NO_LINK) {
+    start = to_block(LIST_AUX(c));
+  }
+  for (free_block = start; free_block != NULL; free_block = to_block(free_block->next)) {
+    steps++;
     if (SIZE(free_block->size_and_tags) >= req_size) {
-      return free_block;
-    } else {
-      free_block = free_block->next;
+      break;
     }
   }
-  return NULL;
+  // Wrap around to the part of the list before the roving pointer.
+  if (free_block == NULL && start != to_block(FREE_LIST_HEAD(c))) {
+    for (free_block = to_block(FREE_LIST_HEAD(c)); free_block != start;
+         free_block = to_block(free_block->next)) {
+      steps++;
+      if (SIZE(free_block->size_and_tags) >= req_size) {
+        break;
+      }
+    }
+    if (free_block == start) {
+      free_block = NULL;
+    }
+  }
+  STAT_ADD(search_steps, steps);
+  if (free_block != NULL) {
+    if (FREE_LIST_POLICY == POLICY_NEXT_FIT) {
+      LIST_AUX(c) = to_link(free_block);
+    }
+    return free_block;
+  }
+
+  larger = NONEMPTY_CLASSES & (~(uint64_t) 1 << c);
+  if (larger != 0) {
+    return to_block(FREE_LIST_HEAD(__builtin_ctzll(larger)));
+  }
+  return USE_SIZE_TREE ? tree_search(req_size) : NULL;
 }
 
 
-/* Insert free_block at the head of the list (LIFO). */
+/*
+ * Insert free_block into its size class's list at the place picked by
+ * FREE_LIST_POLICY: after its predecessor in address order, at the tail, or
+ * at the head.
+ */
 static void insert_free_block(block_info* free_block) {
-  block_info* old_head = FREE_LIST_HEAD;
-  free_block->next = old_head;
-  if (old_head != NULL) {
-    old_head->prev = free_block;
+  int c = size_class(SIZE(free_block->size_and_tags));
+  block_info* prev_free;
+  block_info* next_free;
+
+  if (in_size_tree(SIZE(free_block->size_and_tags))) {
+    tree_insert(&TREE_ROOT, free_block, 0);
+    return;
+  }
+
+  if (FREE_LIST_POLICY == POLICY_ADDRESS) {
+    prev_free = tree_predecessor(LIST_AUX(c), free_block);
+    tree_insert(&LIST_AUX(c), free_block, 1);
+  } else if (FREE_LIST_POLICY == POLICY_FIFO) {
+    prev_free = to_block(LIST_AUX(c));
+    LIST_AUX(c) = to_link(free_block);
+  } else {
+    prev_free = NULL;
+  }
+
+  // Link the block in after prev_free, or at the head if there is none.
+  next_free = to_block((prev_free != NULL) ? prev_free->next : FREE_LIST_HEAD(c));
+  free_block->next = to_link(next_free);
+  free_block->prev = to_link(prev_free);
+  if (next_free != NULL) {
+    next_free->prev = to_link(free_block);
+  }
+  if (prev_free != NULL) {
+    prev_free->next = to_link(free_block);
+  } else {
+    FREE_LIST_HEAD(c) = to_link(free_block);
+    NONEMPTY_CLASSES |= (uint64_t) 1 << c;
   }
-  free_block->prev = NULL;
-  FREE_LIST_HEAD = free_block;
 }
 
 
@@ -194,27 +875,49 @@ static void insert_free_block(block_info* free_block) {
 static void remove_free_block(block_info* free_block) {
   block_info* next_free;
   block_info* prev_free;
+  int c;
+
+  if (in_size_tree(SIZE(free_block->size_and_tags))) {
+    tree_remove(&TREE_ROOT, free_block, 0);
+    return;
+  }
 
-  next_free = free_block->next;
-  prev_free = free_block->prev;
+  c = size_class(SIZE(free_block->size_and_tags));
+  next_free = to_block(free_block->next);
+  prev_free = to_block(free_block->prev);
+
+  // Keep the policy state pointing into the list.
+  if (FREE_LIST_POLICY == POLICY_ADDRESS) {
+    tree_remove(&LIST_AUX(c), free_block, 1);
+  } else if (FREE_LIST_POLICY == POLICY_FIFO && to_block(LIST_AUX(c)) == free_block) {
+    LIST_AUX(c) = free_block->prev;
+  } else if (FREE_LIST_POLICY == POLICY_NEXT_FIT && to_block(LIST_AUX(c)) == free_block) {
+    LIST_AUX(c) = free_block->next;
+  }
 
-  // If the next block is not null, patch its prev pointer.
+  // If the next block is not null, patch its prev link.
   if (next_free != NULL) {
-    next_free->prev = prev_free;
+    next_free->prev = free_block->prev;
   }
 
   // If we're removing the head of the free list, set the head to be
-  // the next block, otherwise patch the previous block's next pointer.
-  if (free_block == FREE_LIST_HEAD) {
-    FREE_LIST_HEAD = next_free;
+  // the next block, otherwise patch the previous block's next link.
+  if (prev_free == NULL) {
+    FREE_LIST_HEAD(c) = free_block->next;
+    if (next_free == NULL) {
+      NONEMPTY_CLASSES &= ~((uint64_t) 1 << c);
+    }
   } else {
-    prev_free->next = next_free;
+    prev_free->next = free_block->next;
   }
 }
 
 
-/* Coalesce 'old_block' with any preceding or following free blocks. */
-static void coalesce_free_block(block_info* old_block) {
+/*
+ * Coalesce 'old_block' with any preceding or following free blocks and return
+ * the resulting free block.
+ */
+static block_info* coalesce_free_block(block_info* old_block) {
   block_info* block_cursor;
   block_info* new_block;
   block_info* free_block;
@@ -230,11 +933,12 @@ static void coalesce_free_block(block_info* old_block) {
     // prev. block in the free list) is free:
 
     // Get the size of the previous block from its boundary tag.
-    size_t size = SIZE(*((size_t*) UNSCALED_POINTER_SUB(block_cursor, WORD_SIZE)));
+    size_t size = SIZE(*((tag_t*) UNSCALED_POINTER_SUB(block_cursor, TAG_SIZE)));
     // Use this size to find the block info for that block.
     free_block = (block_info*) UNSCALED_POINTER_SUB(block_cursor, size);
     // Remove that block from free list.
     remove_free_block(free_block);
+    STAT_ADD(coalesces, 1);
 
     // Count that block's size and update the current block pointer.
     new_size += size;
@@ -251,6 +955,7 @@ static void coalesce_free_block(block_info* old_block) {
     size_t size = SIZE(block_cursor->size_and_tags);
     // Remove it from the free list.
     remove_free_block(block_cursor);
+    STAT_ADD(coalesces, 1);
     // Count its size and step to the following block.
     new_size += size;
     block_cursor = (block_info*) UNSCALED_POINTER_ADD(block_cursor, size);
@@ -268,12 +973,12 @@ static void coalesce_free_block(block_info* old_block) {
     new_block->size_and_tags = new_size | TAG_PRECEDING_USED;
     // The boundary tag of the preceding block is the word immediately
     // preceding block in memory where we left off advancing block_cursor.
-    *(size_t*) UNSCALED_POINTER_SUB(block_cursor, WORD_SIZE) = new_size | TAG_PRECEDING_USED;
+    *(tag_t*) UNSCALED_POINTER_SUB(block_cursor, TAG_SIZE) = new_size | TAG_PRECEDING_USED;
 
     // Put the new block in the free list.
     insert_free_block(new_block);
   }
-  return;
+  return new_block;
 }
 
 
@@ -285,25 +990,29 @@ static void request_more_space(size_t req_size) {
   size_t total_size = num_pages * pagesize;
   size_t prev_last_word_mask;
 
-  void* mem_sbrk_result = mem_sbrk(total_size);
+  void* mem_sbrk_result = mem_arena_sbrk(PROLOGUE->arena, total_size);
+  STAT_ADD(sbrk_calls, 1);
   if ((size_t) mem_sbrk_result == -1) {
     printf("ERROR: mem_sbrk failed in request_more_space\n");
     exit(0);
   }
-  new_block = (block_info*) UNSCALED_POINTER_SUB(mem_sbrk_result, WORD_SIZE);
+  new_block = (block_info*) UNSCALED_POINTER_SUB(mem_sbrk_result, TAG_SIZE);
+  // Its header and links (which coalescing may leave inside a larger block)
+  // overwrite the old end of the heap.
+  mark_written(UNSCALED_POINTER_ADD(new_block, sizeof(block_info)));
 
   // Initialize header by inheriting TAG_PRECEDING_USED status from the
   // end-of-heap word and resetting the TAG_USED bit.
   prev_last_word_mask = new_block->size_and_tags & TAG_PRECEDING_USED;
   new_block->size_and_tags = total_size | prev_last_word_mask;
   // Initialize new footer
-  ((block_info*) UNSCALED_POINTER_ADD(new_block, total_size - WORD_SIZE))->size_and_tags =
+  ((block_info*) UNSCALED_POINTER_ADD(new_block, total_size - TAG_SIZE))->size_and_tags =
           total_size | prev_last_word_mask;
 
   // Initialize new end-of-heap word: SIZE is 0, TAG_PRECEDING_USED is 0,
   // TAG_USED is 1. This trick lets us do the "normal" check even at the end
   // of the heap.
-  *((size_t*) UNSCALED_POINTER_ADD(new_block, total_size)) = TAG_USED;
+  *((tag_t*) UNSCALED_POINTER_ADD(new_block, total_size)) = TAG_USED;
 
   // Add the new block to the free list and immediately coalesce newly
   // allocated memory space.
@@ -312,17 +1021,70 @@ static void request_more_space(size_t req_size) {
 }
 
 
-/* Initialize the allocator. */
-int mm_init() {
+/*
+ * Give the memory of 'free_block' back to the system and return the number
+ * of bytes given back.
+ *  - If it is the last block of the heap, the heap is shrunk so that at least
+ *    pad bytes (and at least MIN_BLOCK_SIZE) of the block remain.
+ *  - Otherwise the whole pages between its links and its footer are released;
+ *    the block stays in its free list and the pages are faulted back in as
+ *    zeros when the block is reused.
+ */
+static size_t release_free_block(block_info* free_block, size_t pad) {
+  size_t pagesize = mem_pagesize();
+  size_t block_size = SIZE(free_block->size_and_tags);
+  block_info* following_block = (block_info*) UNSCALED_POINTER_ADD(free_block, block_size);
+  size_t keep_size;
+  size_t trim_size;
+
+  if (SIZE(following_block->size_and_tags) != 0) {
+    return mem_release(UNSCALED_POINTER_ADD(free_block, sizeof(block_info)),
+                       block_size - sizeof(block_info) - TAG_SIZE);
+  }
+
+  keep_size = pad < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : ALIGNMENT * ((pad + ALIGNMENT - 1) / ALIGNMENT);
+  if (block_size < keep_size + pagesize) {
+    return 0;
+  }
+  trim_size = (block_size - keep_size) & ~(pagesize - 1);
+
+  // Shrink the block (its size class may change), then move the end-of-heap
+  // word down to follow it and lower the brk.
+  remove_free_block(free_block);
+  block_size -= trim_size;
+  free_block->size_and_tags = block_size | (free_block->size_and_tags & TAG_PRECEDING_USED);
+  *((tag_t*) UNSCALED_POINTER_ADD(free_block, block_size - TAG_SIZE)) = free_block->size_and_tags;
+  *((tag_t*) UNSCALED_POINTER_ADD(free_block, block_size)) = TAG_USED;
+  insert_free_block(free_block);
+
+  mem_arena_sbrk(PROLOGUE->arena, -(intptr_t) trim_size);
+  STAT_ADD(sbrk_calls, 1);
+  if (PROLOGUE->fresh_start > (char*) mem_arena_zero(PROLOGUE->arena)) {
+    PROLOGUE->fresh_start = (char*) mem_arena_zero(PROLOGUE->arena);
+  }
+  return trim_size;
+}
+
+
+/*
+ * Lay out an empty heap in 'arena' and make it the current arena. The caller
+ * must hold the arena's lock.
+ */
+static void arena_init(int arena) {
   // Head of the free list.
   block_info* first_free_block;
+  int c;
 
-  // Initial heap size: WORD_SIZE byte heap-header (stores pointer to head
-  // of free list), MIN_BLOCK_SIZE bytes of space, WORD_SIZE byte heap-footer.
-  size_t init_size = WORD_SIZE + MIN_BLOCK_SIZE + WORD_SIZE;
+  // Initial heap size: heap prologue (stores links to the heads of the
+  // free lists) and the padding after it, MIN_BLOCK_SIZE bytes of space,
+  // TAG_SIZE byte heap-footer.
+  size_t init_size = HEAP_START + MIN_BLOCK_SIZE + TAG_SIZE;
   size_t total_size;
+  // Where the arena's memory is still zero, from before this heap.
+  void* zero_start = mem_arena_zero(arena);
 
-  void* mem_sbrk_result = mem_sbrk(init_size);
+  void* mem_sbrk_result = mem_arena_sbrk(arena, init_size);
+  STAT_ADD(sbrk_calls, 1);
   //  printf("mem_sbrk returned %p\n", mem_sbrk_result);
   if ((ssize_t) mem_sbrk_result == -1) {
     printf("ERROR: mem_sbrk failed in mm_init, returning %p\n",
@@ -330,146 +1092,1897 @@ int mm_init() {
     exit(1);
   }
 
-  first_free_block = (block_info*) UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE);
+  PROLOGUE = (heap_prologue*) mem_sbrk_result;
+  PROLOGUE->arena = arena;
+  first_free_block = first_block();
+  PROLOGUE->fresh_start = (char*) zero_start;
+  mark_written(UNSCALED_POINTER_ADD(first_free_block, sizeof(block_info)));
 
-  // Total usable size is full size minus heap-header and heap-footer words.
+  // Total usable size is full size minus heap prologue and heap-footer word.
   // NOTE: These are different than the "header" and "footer" of a block!
-  //  - The heap-header is a pointer to the first free block in the free list.
+  //  - The prologue holds pointers to the first block in each free list.
   //  - The heap-footer is the end-of-heap indicator (used block with size 0).
-  total_size = init_size - WORD_SIZE - WORD_SIZE;
+  total_size = init_size - HEAP_START - TAG_SIZE;
 
   // The heap starts with one free block, which we initialize now.
   first_free_block->size_and_tags = total_size | TAG_PRECEDING_USED;
-  first_free_block->next = NULL;
-  first_free_block->prev = NULL;
   // Set the free block's footer.
-  *((size_t*) UNSCALED_POINTER_ADD(first_free_block, total_size - WORD_SIZE)) =
+  *((tag_t*) UNSCALED_POINTER_ADD(first_free_block, total_size - TAG_SIZE)) =
 	  total_size | TAG_PRECEDING_USED;
 
   // Tag the end-of-heap word at the end of heap as used.
-  *((size_t*) UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1)) = TAG_USED;
+  *((tag_t*) UNSCALED_POINTER_SUB(heap_hi(), TAG_SIZE - 1)) = TAG_USED;
 
-  // Set the head of the free list to this new free block.
-  FREE_LIST_HEAD = first_free_block;
-  return 0;
-}
+  // Start from empty free lists and insert this new free block.
+  for (c = 0; c < NUM_SIZE_CLASSES; c++) {
+    FREE_LIST_HEAD(c) = NO_LINK;
+  }
+  NONEMPTY_CLASSES = 0;
+  for (c = 0; c < NUM_LIST_AUX; c++) {
+    LIST_AUX(c) = NO_LINK;
+  }
+  TREE_ROOT = NO_LINK;
+  insert_free_block(first_free_block);
 
+  for (c = 0; c < NUM_QUICK_LISTS; c++) {
+    PROLOGUE->quick_lists[c] = NULL;
+  }
+  PROLOGUE->quick_bytes = 0;
+
+  // No slabs yet.
+  for (c = 0; c < NUM_SLAB_CLASSES; c++) {
+    PROLOGUE->slabs[c] = NULL;
+  }
+}
 
-// TOP-LEVEL ALLOCATOR INTERFACE ------------------------------------
 
 /*
- * Allocate a block of size size and return a pointer to it. If size is zero,
- * returns NULL.
+ * Lock 'arena' and make it the current arena, laying out its heap first if
+ * it is still empty (arenas other than 0 are set up on first use).
  */
-void* mm_malloc(size_t size) {
-  size_t req_size;
-  block_info* ptr_free_block = NULL;
-  size_t block_size;
-  size_t preceding_block_use_tag;
+static inline void arena_lock(int arena) {
+  pthread_mutex_lock(&arena_locks[arena]);
+  if (mem_arena_heapsize(arena) == 0) {
+    arena_init(arena);
+  } else {
+    PROLOGUE = (heap_prologue*) mem_arena_lo(arena);
+  }
+}
 
-  // Zero-size requests get NULL.
-  if (size == 0) {
-    return NULL;
+static inline void arena_unlock(int arena) {
+  pthread_mutex_unlock(&arena_locks[arena]);
+}
+
+
+/* Return the arena the calling thread allocates from, assigning one if needed. */
+static inline int arena_for_thread() {
+  if (thread_arena < 0 || thread_arena >= mem_arena_count()) {
+    thread_arena = __sync_fetch_and_add(&next_arena, 1) % mem_arena_count();
+  }
+  return thread_arena;
+}
+
+
+/* Return the arena that owns 'block'. */
+static inline int arena_of_block(block_info* block) {
+  return mem_arena_of(block);
+}
+
+
+/* Initialize the allocator. */
+int mm_init() {
+  int arena;
+
+  // Links and tags of the compact layout only reach 4 GB into an arena.
+  if (COMPACT_HEADERS && mem_max_heap() > ((size_t) 1 << 32)) {
+    printf("ERROR: arenas of more than 4 GB need COMPACT_HEADERS 0\n");
+    return -1;
+  }
+
+  // The slab maps describe the previous heap. Each arena makes a new one for
+  // its first slab.
+  for (arena = 0; arena < MEM_MAX_ARENAS; arena++) {
+    if (slab_map[arena] != NULL) {
+      mem_unmap(slab_map[arena], slab_map_size[arena]);
+      slab_map[arena] = NULL;
+    }
+  }
+
+  arena_lock(0);
+  arena_unlock(0);
+
+  // Any blocks held in thread caches belonged to the previous heap, and
+  // none of its blocks are in use any more.
+  heap_generation++;
+  if (MM_STATS) {
+    stats_set_in_use(0);
   }
 
-  // Add one word for the initial size header.
+  // Canaries of the new heap are made from a key that depends on where the
+  // stack and the heap are.
+  canary_key = ((uintptr_t) &arena ^ (uintptr_t) mem_arena_lo(0)) * 0x9e3779b97f4a7c15;
+  return 0;
+}
+
+
+/*
+ * Compute the block size needed to satisfy a payload request of size bytes.
+ */
+static inline size_t request_size(size_t size) {
+  // Add one word for the initial size header, and one for the canary with
+  // MM_HARDEN.
   // Note that we don't need a footer when the block is used/allocated!
-  size += WORD_SIZE;
+  size += TAG_SIZE + CANARY_SIZE;
   if (size <= MIN_BLOCK_SIZE) {
     // Make sure we allocate enough space for the minimum block size.
-    req_size = MIN_BLOCK_SIZE;
+    return MIN_BLOCK_SIZE;
   } else {
     // Round up for proper alignment.
-    req_size = ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
-  }
-
-  // TODO: Implement mm_malloc.  You can change or remove any of the
-  // above code.  It is included as a suggestion of where to start.
-  // You will want to replace this return statement...
-  
-  // Do an initial search from the free list to determine if we need to request more space
-  ptr_free_block = search_free_list(req_size);
-  if (ptr_free_block == NULL) {
- 	request_more_space(req_size);
-        ptr_free_block = search_free_list(req_size);
-  }
-  
-  // Set used tag
-  ptr_free_block -> size_and_tags |= TAG_USED;
-  
-  // Remove the free block we found from free list
-  remove_free_block(ptr_free_block);
+    return ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
+  }
+}
+
+
+/*
+ * Mark 'block', which spans block_size bytes and is not in any free list, as
+ * used with req_size bytes. The header must already carry the right
+ * TAG_PRECEDING_USED bit.
+ *  - If the excess can hold another block, it is split off, inserted into the
+ *    free list, and returned (the caller coalesces it if its following block
+ *    may be free).
+ *  - Otherwise the whole block is used and NULL is returned.
+ */
+static block_info* place_block(block_info* block, size_t block_size, size_t req_size) {
+  size_t preceding_block_use_tag = block->size_and_tags & TAG_PRECEDING_USED;
+  block_info* following_block;
 
-  // Store header data
-  block_size = SIZE(ptr_free_block -> size_and_tags);
-  preceding_block_use_tag = ptr_free_block -> size_and_tags & TAG_PRECEDING_USED;
-	
-  // Splits free block if there is excess space that can be used as another block
+  // Splits the block if there is excess space that can be used as another block
   if (block_size - req_size >= MIN_BLOCK_SIZE) {
-	
-	// Update block header
-	ptr_free_block -> size_and_tags = req_size | preceding_block_use_tag;
-	ptr_free_block -> size_and_tags |= TAG_USED;
-	
-	// Point to the split block and set used tag to 0, and preceding used tag to 1
-	block_info* split_ptr = (block_info*) UNSCALED_POINTER_ADD(ptr_free_block, req_size);
-	split_ptr -> size_and_tags = (block_size - req_size);
-	split_ptr -> size_and_tags &= ~TAG_USED;
-	split_ptr -> size_and_tags |= TAG_PRECEDING_USED;
-
-	size_t split_size = SIZE(split_ptr -> size_and_tags);
-
-	// Update footer of the split block 
-	block_info* footer = (block_info*) UNSCALED_POINTER_SUB(UNSCALED_POINTER_ADD(split_ptr, split_size), WORD_SIZE);
-	footer -> size_and_tags = split_ptr -> size_and_tags;
-	
-	// Insert the split block into free list
-	insert_free_block(split_ptr);     
- } else {
-	// Update following block's tag
-	block_info* following_block = (block_info*) UNSCALED_POINTER_ADD(ptr_free_block, block_size);
-	following_block -> size_and_tags |= TAG_PRECEDING_USED;	
+    size_t split_size = block_size - req_size;
+
+    STAT_ADD(splits, 1);
+
+    // Update block header
+    block->size_and_tags = req_size | preceding_block_use_tag | TAG_USED;
+    canary_set(block);
+
+    // Point to the split block and set used tag to 0, and preceding used tag to 1
+    block_info* split_ptr = (block_info*) UNSCALED_POINTER_ADD(block, req_size);
+    split_ptr->size_and_tags = split_size | TAG_PRECEDING_USED;
+
+    // Update footer of the split block
+    *((tag_t*) UNSCALED_POINTER_ADD(split_ptr, split_size - TAG_SIZE)) = split_ptr->size_and_tags;
+
+    // The following block now comes after a free block
+    following_block = (block_info*) UNSCALED_POINTER_ADD(split_ptr, split_size);
+    following_block->size_and_tags &= ~TAG_PRECEDING_USED;
+
+    // Insert the split block into free list
+    insert_free_block(split_ptr);
+    mark_written(UNSCALED_POINTER_ADD(split_ptr, sizeof(block_info)));
+    return split_ptr;
   }
-  // Point to head of the block
-  return (void*) UNSCALED_POINTER_ADD(ptr_free_block, WORD_SIZE);		
+
+  // Use the whole block and update following block's tag
+  block->size_and_tags = block_size | preceding_block_use_tag | TAG_USED;
+  canary_set(block);
+  following_block = (block_info*) UNSCALED_POINTER_ADD(block, block_size);
+  following_block->size_and_tags |= TAG_PRECEDING_USED;
+  mark_written(following_block);
+  return NULL;
 }
 
 
-/* Free the block referenced by ptr. */
-void mm_free(void* ptr) {
+/*
+ * Return the used block 'block_to_free' to the free lists of the current
+ * arena, which must be the arena that contains it, and coalesce it right
+ * away. The caller must hold the arena's lock.
+ */
+static void heap_free_now(block_info* block_to_free) {
   size_t block_size;
-  block_info* block_to_free;
   block_info* following_block;
 
-  // TODO: Implement mm_free.  You can change or remove the declaraions
-  // above.  They are included as minor hints.
-  
-  // Point to start of the block (header) 
-  block_to_free = (block_info*) UNSCALED_POINTER_SUB(ptr, WORD_SIZE);
-
   // Extract the total size of the block
-  block_size = SIZE(block_to_free -> size_and_tags);
+  block_size = SIZE(block_to_free->size_and_tags);
 
-  // Point to following block 
+  // Point to following block
   following_block = (block_info*) UNSCALED_POINTER_ADD(block_to_free, block_size);
 
   // Clear used tag of the block to free, and clear preceding used tag of the following block
-  block_to_free -> size_and_tags &= ~TAG_USED;
-  following_block -> size_and_tags &= ~TAG_PRECEDING_USED;
+  block_to_free->size_and_tags &= ~TAG_USED;
+  following_block->size_and_tags &= ~TAG_PRECEDING_USED;
 
   // Update footer of the block to free
-  *((size_t*) UNSCALED_POINTER_ADD(block_to_free, block_size - WORD_SIZE)) = block_to_free -> size_and_tags;
+  *((tag_t*) UNSCALED_POINTER_ADD(block_to_free, block_size - TAG_SIZE)) = block_to_free->size_and_tags;
 
   insert_free_block(block_to_free);
-  coalesce_free_block(block_to_free);
+  block_to_free = coalesce_free_block(block_to_free);
+
+  if (trim_threshold != 0 && SIZE(block_to_free->size_and_tags) >= trim_threshold) {
+    release_free_block(block_to_free, 0);
+  }
+}
+
+
+// QUICK LISTS ------------------------------------------------------
+//
+// With DEFERRED_COALESCE, a freed block of at most QUICK_MAX_SIZE bytes is
+// pushed on the quick list for its exact size and keeps TAG_USED, so its
+// neighbors do not merge with it either. A later request of that size pops
+// it without touching the free lists. The quick lists of an arena are
+// consolidated, i.e., their blocks are freed and coalesced for real, when a
+// request finds no free block or when they hold more than QUICK_MAX_PERCENT
+// percent of the arena.
+
+static inline int quick_bin(size_t block_size) {
+  return (block_size - MIN_BLOCK_SIZE) / ALIGNMENT;
+}
+
+/* Free and coalesce every block in the current arena's quick lists. */
+static void quick_consolidate() {
+  block_info* block;
+  int bin;
+
+  for (bin = 0; bin < NUM_QUICK_LISTS; bin++) {
+    while ((block = PROLOGUE->quick_lists[bin]) != NULL) {
+      PROLOGUE->quick_lists[bin] = to_block(block->next);
+      heap_free_now(block);
+    }
+  }
+  PROLOGUE->quick_bytes = 0;
 }
 
 
 /*
- * A heap consistency checker. Optional, but recommended to help you debug
- * potential issues with your allocator.
+ * Find a free block of at least req_size bytes in the current arena,
+ * consolidating the quick lists and then growing the heap if there is none.
+ * The block is left in its free list.
  */
-int mm_check() {
-  // TODO: Implement a heap consistency checker as needed/desired.
+static block_info* find_free_block(size_t req_size) {
+  block_info* block;
+
+  block = search_free_list(req_size);
+  if (block == NULL && DEFERRED_COALESCE && PROLOGUE->quick_bytes != 0) {
+    quick_consolidate();
+    block = search_free_list(req_size);
+  }
+  if (block == NULL) {
+    request_more_space(req_size);
+    block = search_free_list(req_size);
+  }
+  return block;
+}
+
+
+/*
+ * Return whether find_free_block(req_size) can succeed without the current
+ * arena running out of space, which ends the program.
+ */
+static int can_find_free_block(size_t req_size) {
+  size_t pagesize = mem_pagesize();
+  size_t total_size = (req_size + pagesize - 1) / pagesize * pagesize;
+
+  if (search_free_list(req_size) != NULL) {
+    return 1;
+  }
+  if (DEFERRED_COALESCE && PROLOGUE->quick_bytes != 0) {
+    quick_consolidate();
+    if (search_free_list(req_size) != NULL) {
+      return 1;
+    }
+  }
+  return mem_arena_heapsize(PROLOGUE->arena) + total_size <= mem_max_heap();
+}
+
+
+/*
+ * Allocate a used block of req_size bytes from the current arena. The caller
+ * must hold the arena's lock.
+ */
+static block_info* heap_malloc(size_t req_size) {
+  block_info* ptr_free_block;
+  int bin;
+
+  // A quick block of exactly this size is already marked used.
+  if (DEFERRED_COALESCE && req_size <= QUICK_MAX_SIZE) {
+    bin = quick_bin(req_size);
+    if ((ptr_free_block = PROLOGUE->quick_lists[bin]) != NULL) {
+      PROLOGUE->quick_lists[bin] = to_block(ptr_free_block->next);
+      PROLOGUE->quick_bytes -= req_size;
+      return ptr_free_block;
+    }
+  }
+
+  ptr_free_block = find_free_block(req_size);
+
+  // Remove the free block we found from free list, then use it (splitting
+  // off any excess as a new free block)
+  remove_free_block(ptr_free_block);
+  place_block(ptr_free_block, SIZE(ptr_free_block->size_and_tags), req_size);
+  return ptr_free_block;
+}
+
+
+/*
+ * Return the used block 'block_to_free' to the current arena, which must be
+ * the arena that contains it. The caller must hold the arena's lock.
+ */
+static void heap_free(block_info* block_to_free) {
+  size_t block_size = SIZE(block_to_free->size_and_tags);
+  int bin;
+
+  if (DEFERRED_COALESCE && block_size <= QUICK_MAX_SIZE) {
+    bin = quick_bin(block_size);
+    block_to_free->next = to_link(PROLOGUE->quick_lists[bin]);
+    PROLOGUE->quick_lists[bin] = block_to_free;
+    PROLOGUE->quick_bytes += block_size;
+    if (PROLOGUE->quick_bytes * 100 >
+        mem_arena_heapsize(PROLOGUE->arena) * QUICK_MAX_PERCENT) {
+      quick_consolidate();
+    }
+    return;
+  }
+  heap_free_now(block_to_free);
+}
+
+
+/*
+ * Allocate a used block of req_size bytes whose payload address is a
+ * multiple of align (a power of two) from the current arena. Any space in
+ * front of the aligned payload is returned to the free list. The caller must
+ * hold the arena's lock.
+ */
+static block_info* heap_malloc_aligned(size_t req_size, size_t align) {
+  // Room for the block, the worst-case distance to an aligned payload, and a
+  // leading fragment large enough to be a free block.
+  size_t search_size = req_size + align + MIN_BLOCK_SIZE;
+  block_info* block;
+  size_t block_size;
+  size_t lead_size;
+  size_t payload;
+
+  block = find_free_block(search_size);
+  remove_free_block(block);
+  block_size = SIZE(block->size_and_tags);
+
+  // Find the first aligned payload that leaves either no leading fragment or
+  // one that can stand as a free block.
+  payload = (size_t) UNSCALED_POINTER_ADD(block, TAG_SIZE);
+  lead_size = ((payload + align - 1) & ~(align - 1)) - payload;
+  while (lead_size != 0 && lead_size < MIN_BLOCK_SIZE) {
+    lead_size += align;
+  }
+
+  if (lead_size != 0) {
+    // The leading fragment keeps the original TAG_PRECEDING_USED bit; its
+    // preceding block is used since free blocks are always coalesced.
+    block->size_and_tags = lead_size | (block->size_and_tags & TAG_PRECEDING_USED);
+    *((tag_t*) UNSCALED_POINTER_ADD(block, lead_size - TAG_SIZE)) = block->size_and_tags;
+    insert_free_block(block);
+
+    block = (block_info*) UNSCALED_POINTER_ADD(block, lead_size);
+    block_size -= lead_size;
+    block->size_and_tags = block_size;
+  }
+  place_block(block, block_size, req_size);
+  return block;
+}
+
+
+// DIRECT MAPPING ---------------------------------------------------
+//
+// A block of at least mmap_threshold bytes is placed at the start of its own
+// mem_map mapping, rounded up to whole pages. It keeps the usual used-block
+// header, with the size of the whole mapping, so mm_free can give the mapping
+// back at once. Mappings lie outside of every arena, which is how a directly
+// mapped block is told from a heap block (mem_arena_of returns -1).
+//  - When tags are narrower than ALIGNMENT (see COMPACT LAYOUT above), the
+//    block starts TAG_PAD bytes into the mapping, and its size leaves out the
+//    MAP_SLACK bytes that do not make up a whole ALIGNMENT unit at either
+//    end. In the compact layout, blocks of 4 GB or more are not mapped.
+
+#define MAP_SLACK (TAG_PAD != 0 ? ALIGNMENT : 0)
+
+// Directly mapped blocks in use, which a heap snapshot cannot hold.
+static size_t mapped_blocks;
+
+/* Return the size of the mapping for a block of req_size bytes. */
+static inline size_t mapped_size(size_t req_size) {
+  size_t pagesize = mem_pagesize();
+  return (req_size + MAP_SLACK + pagesize - 1) & ~(pagesize - 1);
+}
+
+/* Map a block of at least req_size bytes, or return NULL if there is no room. */
+static block_info* mapped_malloc(size_t req_size) {
+  size_t map_size = mapped_size(req_size);
+  block_info* block;
+
+  if (map_size - MAP_SLACK != (tag_t) (map_size - MAP_SLACK)) {
+    return NULL;
+  }
+  block = (block_info*) mem_map(map_size);
+  if (block != NULL) {
+    block = (block_info*) UNSCALED_POINTER_ADD(block, TAG_PAD);
+    block->size_and_tags = (map_size - MAP_SLACK) | TAG_PRECEDING_USED | TAG_USED;
+    __atomic_add_fetch(&mapped_blocks, 1, __ATOMIC_RELAXED);
+  }
+  return block;
+}
+
+/* Unmap a directly mapped block. */
+static void mapped_free(block_info* block) {
+  __atomic_sub_fetch(&mapped_blocks, 1, __ATOMIC_RELAXED);
+  mem_unmap(UNSCALED_POINTER_SUB(block, TAG_PAD), SIZE(block->size_and_tags) + MAP_SLACK);
+}
+
+
+// SLABS ------------------------------------------------------------
+//  - A slab's window index is its address divided by SLAB_SIZE, counted
+//    from the window that holds the start of the arena.
+//  - Only slab objects have payload addresses in a marked window: the slab's
+//    heap block header sits just before the window, and the next block
+//    starts right after it.
+//  - A slab with free objects is linked into its class's list in the
+//    prologue. A slab that empties is released to the heap unless it is the
+//    only one left in its class.
+
+static inline size_t slab_window(int arena, void* ptr) {
+  return (size_t) ptr / SLAB_SIZE - (size_t) mem_arena_lo(arena) / SLAB_SIZE;
+}
+
+static inline void slab_map_set(int arena, void* ptr, int in_use) {
+  size_t window = slab_window(arena, ptr);
+
+  if (in_use) {
+    slab_map[arena][window / 8] |= (uint8_t) (1 << (window % 8));
+  } else {
+    slab_map[arena][window / 8] &= (uint8_t) ~(1 << (window % 8));
+  }
+}
+
+
+/* Return whether ptr, in 'arena', is an object handed out by a slab. */
+static inline int slab_owns(int arena, void* ptr) {
+  size_t window = slab_window(arena, ptr);
+  return slab_map[arena] != NULL && ((slab_map[arena][window / 8] >> (window % 8)) & 1);
+}
+
+static inline slab* slab_of(void* ptr) {
+  return (slab*) ((size_t) ptr & ~((size_t) SLAB_SIZE - 1));
+}
+
+static inline void* slab_object(slab* s, unsigned int i) {
+  return UNSCALED_POINTER_ADD(s, SLAB_HEADER_SIZE + i * s->object_size);
+}
+
+static void slab_list_insert(slab* s, int c) {
+  s->prev = NULL;
+  s->next = PROLOGUE->slabs[c];
+  if (s->next != NULL) {
+    s->next->prev = s;
+  }
+  PROLOGUE->slabs[c] = s;
+}
+
+static void slab_list_remove(slab* s, int c) {
+  if (s->next != NULL) {
+    s->next->prev = s->prev;
+  }
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    PROLOGUE->slabs[c] = s->next;
+  }
+}
+
+
+/*
+ * Make the slab map of 'arena', with one bit per SLAB_SIZE window of the arena
+ * (plus one, since the arena need not start on a window boundary).
+ */
+static void slab_map_create(int arena) {
+  slab_map_size[arena] = (mem_max_heap() / SLAB_SIZE + 1 + 7) / 8;
+  slab_map[arena] = (uint8_t*) mem_map(slab_map_size[arena]);
+  if (slab_map[arena] == NULL) {
+    printf("ERROR: mem_map failed in slab_map_create\n");
+    exit(1);
+  }
+}
+
+/* Carve a new slab for class c out of an aligned heap block. */
+static slab* slab_create(int c) {
+  block_info* block = heap_malloc_aligned(request_size(SLAB_SIZE), SLAB_SIZE);
+  slab* s = (slab*) UNSCALED_POINTER_ADD(block, TAG_SIZE);
+
+  memset(s, 0, sizeof(slab));
+  s->object_size = (c + 1) * ALIGNMENT;
+  s->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / s->object_size;
+  if (slab_map[PROLOGUE->arena] == NULL) {
+    slab_map_create(PROLOGUE->arena);
+  }
+  slab_map_set(PROLOGUE->arena, s, 1);
+  slab_list_insert(s, c);
+  return s;
+}
+
+
+/*
+ * Allocate an object of at most SLAB_MAX_SIZE bytes from the current arena.
+ * The caller must hold the arena's lock.
+ */
+static void* slab_malloc(size_t size) {
+  int c = (size - 1) / ALIGNMENT;
+  slab* s = PROLOGUE->slabs[c];
+  unsigned int word;
+  unsigned int bit;
+
+  if (s == NULL) {
+    s = slab_create(c);
+  }
+
+  // Take the lowest free object.
+  for (word = 0; ~s->bitmap[word] == 0; word++) {
+  }
+  bit = __builtin_ctzll(~s->bitmap[word]);
+  s->bitmap[word] |= (uint64_t) 1 << bit;
+
+  // A full slab leaves its class's list.
+  if (++s->used == s->capacity) {
+    slab_list_remove(s, c);
+  }
+  return slab_object(s, word * 64 + bit);
+}
+
+
+/*
+ * Free a slab object of the current arena. The caller must hold the arena's
+ * lock.
+ */
+static void slab_free(void* ptr) {
+  slab* s = slab_of(ptr);
+  int c = s->object_size / ALIGNMENT - 1;
+  unsigned int i = ((size_t) ptr - (size_t) slab_object(s, 0)) / s->object_size;
+
+  if (MM_HARDEN && (ptr != slab_object(s, i) || ((s->bitmap[i / 64] >> (i % 64)) & 1) == 0)) {
+    heap_corrupt("double free or invalid pointer", ptr);
+  }
+  s->bitmap[i / 64] &= ~((uint64_t) 1 << (i % 64));
+
+  // A full slab has free objects again; an empty slab goes back to the heap
+  // unless it is the last slab with free objects in its class.
+  if (s->used-- == s->capacity) {
+    slab_list_insert(s, c);
+  } else if (s->used == 0 && (s->next != NULL || s->prev != NULL)) {
+    slab_list_remove(s, c);
+    slab_map_set(PROLOGUE->arena, s, 0);
+    heap_free((block_info*) UNSCALED_POINTER_SUB(s, TAG_SIZE));
+  }
+}
+
+
+// THREAD CACHE -----------------------------------------------------
+//  - Each thread keeps used blocks of up to TCACHE_MAX_SIZE bytes in
+//    per-size bins, so most small mm_malloc/mm_free calls never take an
+//    arena lock. Cached blocks keep TAG_USED set, so their arena treats
+//    them as allocated and never coalesces into them.
+//  - A bin may hold blocks from several arenas; each goes back to its own
+//    arena when flushed.
+//  - A bin is a singly-linked list threaded through the first payload word.
+//  - A miss refills TCACHE_FILL blocks under one lock acquisition, and a full
+//    bin flushes half of itself back to the shared heap.
+//  - mm_init bumps heap_generation, which discards every thread's cache
+//    lazily, since the blocks it held no longer exist.
+
+static inline int tcache_bin(size_t block_size) {
+  return (block_size - MIN_BLOCK_SIZE) / ALIGNMENT;
+}
+
+static inline void tcache_push(thread_cache* tc, block_info* block) {
+  int bin = tcache_bin(SIZE(block->size_and_tags));
+  void** payload = (void**) UNSCALED_POINTER_ADD(block, TAG_SIZE);
+
+  *payload = tc->bins[bin];
+  tc->bins[bin] = payload;
+  tc->counts[bin]++;
+}
+
+static inline block_info* tcache_pop(thread_cache* tc, int bin) {
+  void** payload = (void**) tc->bins[bin];
+
+  tc->bins[bin] = *payload;
+  tc->counts[bin]--;
+  return (block_info*) UNSCALED_POINTER_SUB(payload, TAG_SIZE);
+}
+
+
+/*
+ * Return up to n blocks of the given bin to their arenas, holding each
+ * arena's lock across a run of blocks that belong to it.
+ */
+static void tcache_flush(thread_cache* tc, int bin, int n) {
+  block_info* block;
+  int locked = -1;
+  int arena;
+
+  while (n-- > 0 && tc->bins[bin] != NULL) {
+    block = tcache_pop(tc, bin);
+    arena = arena_of_block(block);
+    if (arena != locked) {
+      if (locked >= 0) {
+        arena_unlock(locked);
+      }
+      arena_lock(arena);
+      locked = arena;
+    }
+    heap_free(block);
+  }
+  if (locked >= 0) {
+    arena_unlock(locked);
+  }
+}
+
+
+/* Thread-exit destructor: give all of a thread's cached blocks back. */
+static void tcache_release(void* arg) {
+  thread_cache* tc = (thread_cache*) arg;
+  int bin;
+
+  if (tc->generation == heap_generation) {
+    for (bin = 0; bin < TCACHE_BINS; bin++) {
+      tcache_flush(tc, bin, tc->counts[bin]);
+    }
+  }
+}
+
+static void tcache_key_create(void) {
+  pthread_key_create(&tcache_key, tcache_release);
+}
+
+
+/*
+ * Return the calling thread's cache, emptying it if it predates the last
+ * mm_init and registering its exit destructor on first use.
+ */
+static inline thread_cache* tcache_get() {
+  thread_cache* tc = &tcache;
+  int bin;
+
+  if (tc->generation != heap_generation) {
+    for (bin = 0; bin < TCACHE_BINS; bin++) {
+      tc->bins[bin] = NULL;
+      tc->counts[bin] = 0;
+    }
+    tc->generation = heap_generation;
+    if (!tc->registered) {
+      pthread_once(&tcache_key_once, tcache_key_create);
+      pthread_setspecific(tcache_key, tc);
+      tc->registered = 1;
+    }
+  }
+  return tc;
+}
+
+
+/* Allocate a small block of req_size bytes through the thread cache. */
+static block_info* tcache_malloc(size_t req_size) {
+  thread_cache* tc = tcache_get();
+  int bin = tcache_bin(req_size);
+  int arena;
+  block_info* block;
+  block_info* extra;
+  int i;
+
+  if (tc->bins[bin] != NULL) {
+    return tcache_pop(tc, bin);
+  }
+
+  // Refill: keep the first block for the caller and cache the rest in the
+  // bins matching their actual sizes (a block may be larger than requested
+  // when the excess was too small to split off).
+  arena = arena_for_thread();
+  arena_lock(arena);
+  block = heap_malloc(req_size);
+  for (i = 1; i < TCACHE_FILL; i++) {
+    extra = heap_malloc(req_size);
+    if (SIZE(extra->size_and_tags) <= TCACHE_MAX_SIZE &&
+        tc->counts[tcache_bin(SIZE(extra->size_and_tags))] < TCACHE_BIN_MAX) {
+      tcache_push(tc, extra);
+    } else {
+      heap_free(extra);
+    }
+  }
+  arena_unlock(arena);
+  return block;
+}
+
+
+/* Free a small block into the thread cache. */
+static void tcache_free(block_info* block) {
+  thread_cache* tc = tcache_get();
+  int bin = tcache_bin(SIZE(block->size_and_tags));
+
+  if (tc->counts[bin] >= TCACHE_BIN_MAX) {
+    tcache_flush(tc, bin, TCACHE_BIN_MAX / 2);
+  }
+  tcache_push(tc, block);
+}
+
+
+// STATISTICS -------------------------------------------------------
+//  - Counters live in each thread's thread_stats. A thread joins the
+//    stats_threads list the first time it counts an allocation or free,
+//    and its exit destructor folds its counters into stats_retired.
+//  - mm_stats adds up the counters and walks the free lists of every arena
+//    for the free-space figures, so only the call itself is slow.
+
+/* Add the counters of t to sum. */
+static void stats_add(thread_stats* sum, thread_stats* t) {
+  int c;
+
+  sum->in_use_bytes += __atomic_load_n(&t->in_use_bytes, __ATOMIC_RELAXED);
+  sum->sbrk_calls += __atomic_load_n(&t->sbrk_calls, __ATOMIC_RELAXED);
+  sum->splits += __atomic_load_n(&t->splits, __ATOMIC_RELAXED);
+  sum->coalesces += __atomic_load_n(&t->coalesces, __ATOMIC_RELAXED);
+  sum->searches += __atomic_load_n(&t->searches, __ATOMIC_RELAXED);
+  sum->search_steps += __atomic_load_n(&t->search_steps, __ATOMIC_RELAXED);
+  for (c = 0; c < NUM_SIZE_CLASSES; c++) {
+    sum->mallocs[c] += __atomic_load_n(&t->mallocs[c], __ATOMIC_RELAXED);
+    sum->frees[c] += __atomic_load_n(&t->frees[c], __ATOMIC_RELAXED);
+  }
+}
+
+
+/* Thread-exit destructor: keep the counts of an exiting thread. */
+static void stats_release(void* arg) {
+  thread_stats* t = (thread_stats*) arg;
+
+  pthread_mutex_lock(&stats_lock);
+  stats_add(&stats_retired, t);
+  if (t->prev != NULL) {
+    t->prev->next = t->next;
+  } else {
+    stats_threads = t->next;
+  }
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_key_create(void) {
+  pthread_key_create(&stats_key, stats_release);
+}
+
+
+/* Put the calling thread's counters on the stats_threads list. */
+static void stats_register() {
+  thread_stats* t = &thread_counters;
+
+  pthread_once(&stats_key_once, stats_key_create);
+  pthread_setspecific(stats_key, t);
+  pthread_mutex_lock(&stats_lock);
+  t->prev = NULL;
+  t->next = stats_threads;
+  if (stats_threads != NULL) {
+    stats_threads->prev = t;
+  }
+  stats_threads = t;
+  t->registered = 1;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+
+/* Count a block of block_size bytes handed to the program. */
+static inline void count_malloc(size_t block_size) {
+  if (MM_STATS) {
+    if (!thread_counters.registered) {
+      stats_register();
+    }
+    STAT_ADD(in_use_bytes, block_size);
+    STAT_ADD(mallocs[size_class(block_size)], 1);
+  }
+}
+
+
+/* Count a block of block_size bytes given back by the program. */
+static inline void count_free(size_t block_size) {
+  if (MM_STATS) {
+    if (!thread_counters.registered) {
+      stats_register();
+    }
+    STAT_ADD(in_use_bytes, -block_size);
+    STAT_ADD(frees[size_class(block_size)], 1);
+  }
+}
+
+
+/* Count node and the blocks below it in the tree into stats. */
+static void tree_stats(block_info* node, struct mm_stats* stats) {
+  size_t size;
+
+  while (node != NULL) {
+    size = SIZE(node->size_and_tags);
+    stats->free_bytes += size;
+    stats->free_blocks++;
+    if (size > stats->largest_free) {
+      stats->largest_free = size;
+    }
+    tree_stats(to_block(node->left), stats);
+    node = to_block(node->right);
+  }
+}
+
+
+/*
+ * Fill in stats with the allocator's counters, summed over all threads, and
+ * with the free space in the free lists and trees of all arenas. Blocks in
+ * thread caches and quick lists count as neither in use nor free.
+ */
+void mm_stats(struct mm_stats* stats) {
+  thread_stats sum;
+  thread_stats* t;
+  block_info* block;
+  size_t size;
+  int arena;
+  int c;
+
+  memset(stats, 0, sizeof(*stats));
+  memset(&sum, 0, sizeof(sum));
+  pthread_mutex_lock(&stats_lock);
+  stats_add(&sum, &stats_retired);
+  for (t = stats_threads; t != NULL; t = t->next) {
+    stats_add(&sum, t);
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  stats->in_use_bytes = sum.in_use_bytes;
+  stats->sbrk_calls = sum.sbrk_calls;
+  stats->splits = sum.splits;
+  stats->coalesces = sum.coalesces;
+  stats->searches = sum.searches;
+  stats->search_steps = sum.search_steps;
+  stats->num_classes = NUM_SIZE_CLASSES;
+  for (c = 0; c < NUM_SIZE_CLASSES; c++) {
+    stats->class_min[c] = c == 0 ? 0 : (size_t) MIN_BLOCK_SIZE << c;
+    stats->mallocs[c] = sum.mallocs[c];
+    stats->frees[c] = sum.frees[c];
+  }
+
+  for (arena = 0; arena < mem_arena_count(); arena++) {
+    if (mem_arena_heapsize(arena) == 0) {
+      continue;
+    }
+    stats->heap_size += mem_arena_heapsize(arena);
+    arena_lock(arena);
+    for (c = 0; c < NUM_SIZE_CLASSES; c++) {
+      for (block = to_block(FREE_LIST_HEAD(c)); block != NULL; block = to_block(block->next)) {
+        size = SIZE(block->size_and_tags);
+        stats->free_bytes += size;
+        stats->free_blocks++;
+        if (size > stats->largest_free) {
+          stats->largest_free = size;
+        }
+      }
+    }
+    tree_stats(to_block(TREE_ROOT), stats);
+    arena_unlock(arena);
+  }
+}
+
+
+/*
+ * Return the number of free blocks and tree nodes the calling thread's
+ * free-list searches have looked at, without the cost of mm_stats.
+ */
+size_t mm_search_steps() {
+  return thread_counters.search_steps;
+}
+
+
+// HEAP CHECKER -----------------------------------------------------
+//  - check_arena walks the blocks of the current arena in address order and
+//    checks their sizes, the footers of free blocks against their headers,
+//    every TAG_PRECEDING_USED bit, and that no two free blocks are adjacent.
+//    With MM_HARDEN, the canary of each used block must be armed or cleared.
+//  - It then follows every free list and the large-block tree, checking
+//    that each block is a free block of the arena in the right place, and
+//    that together they hold each free block exactly once.
+//  - The quick lists and the slabs with free objects are checked as well.
+//    Blocks in thread caches are tagged used, like the program's.
+
+/* Report a failed check and return 1. */
+static int check_failed(const char* what, void* where) {
+  fprintf(stderr, "mm_check: %s at %p\n", what, where);
+  return 1;
+}
+
+/* Return whether block lies in the current arena's heap. */
+static inline int check_in_heap(block_info* block) {
+  return block >= first_block() &&
+         (char*) block < (char*) mem_arena_hi(PROLOGUE->arena) + 1 - TAG_SIZE;
+}
+
+/*
+ * Check the large-block tree below node, whose blocks must come after *last
+ * in (size, address) order, and count them into *count (stopping at limit,
+ * which a cycle would exceed). Returns the number of failed checks.
+ */
+static int check_tree(block_info* node, block_info** last, size_t* count, size_t limit) {
+  int problems = 0;
+
+  if (node == NULL || *count > limit) {
+    return 0;
+  }
+  if (!check_in_heap(node)) {
+    return check_failed("tree link outside of the heap", node);
+  }
+  problems += check_tree(to_block(node->left), last, count, limit);
+  (*count)++;
+  if (node->size_and_tags & TAG_USED) {
+    problems += check_failed("used block in the tree", node);
+  }
+  if (!in_size_tree(SIZE(node->size_and_tags))) {
+    problems += check_failed("small block in the tree", node);
+  }
+  if (*last != NULL && !tree_less(*last, node, 0)) {
+    problems += check_failed("tree out of order", node);
+  }
+  *last = node;
+  return problems + check_tree(to_block(node->right), last, count, limit);
+}
+
+/*
+ * Check the current arena, whose lock the caller holds, and return the
+ * number of failed checks (each reported on stderr).
+ */
+static int check_arena() {
+  tag_t* end_word = (tag_t*) ((char*) mem_arena_hi(PROLOGUE->arena) + 1 - TAG_SIZE);
+  block_info* block;
+  block_info* prev;
+  block_info* last;
+  size_t size;
+  size_t free_blocks = 0;
+  size_t listed = 0;
+  size_t quick_bytes = 0;
+  size_t steps;
+  tag_t footer;
+  int preceding_used = 1;
+  int found_aux;
+  int problems = 0;
+  int c;
+  slab* s;
+  unsigned int used;
+  unsigned int w;
+
+  // Every block, in address order. The prologue counts as used.
+  for (block = first_block(); (tag_t*) block != end_word;
+       block = (block_info*) UNSCALED_POINTER_ADD(block, size)) {
+    size = SIZE(block->size_and_tags);
+    if (size < MIN_BLOCK_SIZE ||
+        (char*) block + size > (char*) end_word) {
+      // The walk cannot go on past a bad size.
+      return problems + check_failed("block size out of range", block);
+    }
+    if (((block->size_and_tags & TAG_PRECEDING_USED) != 0) != preceding_used) {
+      problems += check_failed("TAG_PRECEDING_USED does not match the preceding block", block);
+    }
+    if ((block->size_and_tags & TAG_USED) == 0) {
+      free_blocks++;
+      footer = *(tag_t*) UNSCALED_POINTER_ADD(block, size - TAG_SIZE);
+      if (footer != block->size_and_tags) {
+        problems += check_failed("footer does not match header", block);
+      }
+      if (!preceding_used) {
+        problems += check_failed("free block follows a free block", block);
+      }
+    } else if (MM_HARDEN && *canary_of(block) != canary_value(block) &&
+               *canary_of(block) != (tag_t) ~canary_value(block)) {
+      problems += check_failed("canary overwritten", block);
+    }
+    preceding_used = (block->size_and_tags & TAG_USED) != 0;
+  }
+  if (SIZE(*end_word) != 0 || (*end_word & TAG_USED) == 0 ||
+      ((*end_word & TAG_PRECEDING_USED) != 0) != preceding_used) {
+    problems += check_failed("bad end-of-heap word", end_word);
+  }
+
+  // Every size-class list.
+  for (c = 0; c < NUM_SIZE_CLASSES; c++) {
+    if (((NONEMPTY_CLASSES >> c) & 1) != (FREE_LIST_HEAD(c) != NO_LINK)) {
+      problems += check_failed("nonempty_classes bit is wrong for this list", to_block(FREE_LIST_HEAD(c)));
+    }
+    prev = NULL;
+    found_aux = FREE_LIST_POLICY != POLICY_NEXT_FIT || LIST_AUX(c) == NO_LINK;
+    for (block = to_block(FREE_LIST_HEAD(c)); block != NULL && listed <= free_blocks;
+         block = to_block(block->next)) {
+      if (!check_in_heap(block)) {
+        problems += check_failed("free-list link outside of the heap", block);
+        break;
+      }
+      listed++;
+      size = SIZE(block->size_and_tags);
+      if (block->size_and_tags & TAG_USED) {
+        problems += check_failed("used block in a free list", block);
+      }
+      if (size_class(size) != c || in_size_tree(size)) {
+        problems += check_failed("free block in the wrong list", block);
+      }
+      if (to_block(block->prev) != prev) {
+        problems += check_failed("prev link does not point back", block);
+      }
+      if (FREE_LIST_POLICY == POLICY_ADDRESS && prev != NULL && prev > block) {
+        problems += check_failed("free list out of address order", block);
+      }
+      if (FREE_LIST_POLICY == POLICY_NEXT_FIT && to_link(block) == LIST_AUX(c)) {
+        found_aux = 1;
+      }
+      prev = block;
+    }
+    if (FREE_LIST_POLICY == POLICY_FIFO && to_block(LIST_AUX(c)) != prev) {
+      problems += check_failed("list tail is not the last block", to_block(LIST_AUX(c)));
+    }
+    if (!found_aux) {
+      problems += check_failed("roving pointer is not in its list", to_block(LIST_AUX(c)));
+    }
+  }
+
+  // The large-block tree.
+  last = NULL;
+  problems += check_tree(to_block(TREE_ROOT), &last, &listed, free_blocks);
+  if (listed != free_blocks) {
+    problems += check_failed("free blocks missing from or repeated in the free lists", first_block());
+  }
+
+  // The quick lists hold used blocks of their exact size.
+  for (c = 0; c < NUM_QUICK_LISTS; c++) {
+    steps = 0;
+    for (block = PROLOGUE->quick_lists[c]; block != NULL && steps++ <= free_blocks + 1000000;
+         block = to_block(block->next)) {
+      if (!check_in_heap(block)) {
+        problems += check_failed("quick-list link outside of the heap", block);
+        break;
+      }
+      if ((block->size_and_tags & TAG_USED) == 0 || quick_bin(SIZE(block->size_and_tags)) != c) {
+        problems += check_failed("bad block in a quick list", block);
+      }
+      quick_bytes += SIZE(block->size_and_tags);
+    }
+  }
+  if (quick_bytes != PROLOGUE->quick_bytes) {
+    problems += check_failed("quick_bytes does not match the quick lists", PROLOGUE);
+  }
+
+  // The slabs with free objects.
+  for (c = 0; c < NUM_SLAB_CLASSES; c++) {
+    for (s = PROLOGUE->slabs[c]; s != NULL; s = s->next) {
+      if (!check_in_heap((block_info*) s) || !slab_owns(PROLOGUE->arena, slab_object(s, 0))) {
+        problems += check_failed("slab list link is not a slab", s);
+        break;
+      }
+      used = 0;
+      for (w = 0; w < SLAB_BITMAP_WORDS; w++) {
+        used += __builtin_popcountll(s->bitmap[w]);
+      }
+      if (s->object_size != (c + 1) * ALIGNMENT || used != s->used || used >= s->capacity) {
+        problems += check_failed("bad slab in a slab list", s);
+      }
+    }
+  }
+  return problems;
+}
+
+
+// HARDENING --------------------------------------------------------
+//  - With MM_HARDEN, the last TAG_SIZE bytes of a used block hold a canary,
+//    made from a per-heap key, the block's address and its size. Running
+//    past the end of the payload changes it, and so does overwriting the
+//    header's size, which moves where it is looked for.
+//  - place_block arms the canary under the arena's lock, so every used
+//    block of a heap has one and mm_check can check them all (slabs and
+//    thread caches included).
+//  - Freeing a block replaces its canary with the complement. Blocks in
+//    thread caches and quick lists stay tagged used, and this tells a second
+//    free of them from an overrun; any other freed block is no longer
+//    tagged used.
+//  - A failed check prints what it found and aborts.
+
+// Frees since the calling thread last ran check_arena.
+static __thread size_t frees_since_check;
+
+/*
+ * Check that ptr, passed in by the program, is the payload of a used block
+ * of 'arena' (-1 for a directly mapped block) with an intact canary.
+ */
+static void check_used_block(void* ptr, int arena) {
+  block_info* block = (block_info*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+  size_t size = SIZE(block->size_and_tags);
+  block_info* following;
+
+  if (!MM_HARDEN) {
+    return;
+  }
+  if ((block->size_and_tags & TAG_USED) == 0) {
+    heap_corrupt("double free or invalid pointer", ptr);
+  }
+  if (arena >= 0) {
+    following = (block_info*) UNSCALED_POINTER_ADD(block, size);
+    if (size < MIN_BLOCK_SIZE ||
+        (char*) following > (char*) mem_arena_hi(arena) + 1 - TAG_SIZE ||
+        (following->size_and_tags & TAG_PRECEDING_USED) == 0) {
+      heap_corrupt("corrupted block header", ptr);
+    }
+  }
+  if (*canary_of(block) == (tag_t) ~canary_value(block)) {
+    heap_corrupt("double free", ptr);
+  }
+  if (*canary_of(block) != canary_value(block)) {
+    heap_corrupt("block overrun (canary overwritten)", ptr);
+  }
+}
+
+/* Run check_arena on 'arena' once every check_interval frees of a thread. */
+static inline void sample_check(int arena) {
+  int problems;
+
+  if (MM_HARDEN && check_interval != 0 && ++frees_since_check >= check_interval) {
+    frees_since_check = 0;
+    arena_lock(arena);
+    problems = check_arena();
+    arena_unlock(arena);
+    if (problems != 0) {
+      heap_corrupt("mm_check found the heap inconsistent", mem_arena_lo(arena));
+    }
+  }
+}
+
+
+// TOP-LEVEL ALLOCATOR INTERFACE ------------------------------------
+
+/*
+ * Allocate a block of size size and return a pointer to it. If size is zero,
+ * returns NULL.
+ */
+void* mm_malloc(size_t size) {
+  size_t req_size;
+  block_info* block;
+  int arena;
+
+  void* ptr;
+
+  // Zero-size requests get NULL.
+  if (size == 0) {
+    return NULL;
+  }
+
+  if (USE_SLABS && size <= SLAB_MAX_SIZE) {
+    arena = arena_for_thread();
+    arena_lock(arena);
+    ptr = slab_malloc(size);
+    arena_unlock(arena);
+    count_malloc(slab_of(ptr)->object_size);
+    return ptr;
+  }
+  req_size = request_size(size);
+
+  if (THREAD_CACHE && req_size <= TCACHE_MAX_SIZE) {
+    block = tcache_malloc(req_size);
+  } else if (mmap_threshold != 0 && req_size >= mmap_threshold &&
+             (block = mapped_malloc(req_size)) != NULL) {
+    // Mapped outside of the heap.
+  } else {
+    arena = arena_for_thread();
+    arena_lock(arena);
+    block = heap_malloc(req_size);
+    arena_unlock(arena);
+  }
+
+  canary_set(block);
+  count_malloc(SIZE(block->size_and_tags));
+
+  // Point to head of the block
+  ptr = UNSCALED_POINTER_ADD(block, TAG_SIZE);
+  MM_MALLOC_HOOK(ptr);
+  return ptr;
+}
+
+
+/*
+ * Allocate a block of size bytes whose address is a multiple of alignment (a
+ * power of two) and return a pointer to it. The free block it is carved from
+ * is split so that the payload lands on the boundary, and the leading
+ * fragment goes back to the free list. Returns NULL if size is zero or
+ * alignment is not a power of two.
+ */
+void* mm_memalign(size_t alignment, size_t size) {
+  block_info* block;
+  int arena;
+
+  void* ptr;
+
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    return NULL;
+  }
+  // Every payload is aligned this much.
+  if (alignment <= ALIGNMENT) {
+    return mm_malloc(size);
+  }
+  if (size == 0) {
+    return NULL;
+  }
+
+  arena = arena_for_thread();
+  arena_lock(arena);
+  block = heap_malloc_aligned(request_size(size), alignment);
+  arena_unlock(arena);
+
+  canary_set(block);
+  count_malloc(SIZE(block->size_and_tags));
+
+  ptr = UNSCALED_POINTER_ADD(block, TAG_SIZE);
+  MM_MALLOC_HOOK(ptr);
+  return ptr;
+}
+
+
+/*
+ * Allocate a zeroed block for an array of nmemb elements of size bytes and
+ * return a pointer to it. Returns NULL if the size is zero or overflows.
+ *  - Directly mapped blocks come from mem_map and are already zero.
+ *  - Heap blocks are only cleared up to the arena's fresh_start. Above it,
+ *    the only bytes that may not be zero are the links and footer the block
+ *    had while it was the last free block.
+ *  - Slab objects and thread-cached blocks are small, and cleared.
+ */
+void* mm_calloc(size_t nmemb, size_t size) {
+  size_t bytes;
+  size_t req_size;
+  block_info* block;
+  char* fresh_start;
+  char* payload;
+  char* end;
+  char* clear_end;
+  int arena;
+
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    return NULL;
+  }
+  bytes = nmemb * size;
+  if (bytes == 0) {
+    return NULL;
+  }
+  req_size = request_size(bytes);
+
+  if ((USE_SLABS && bytes <= SLAB_MAX_SIZE) ||
+      (THREAD_CACHE && req_size <= TCACHE_MAX_SIZE)) {
+    payload = mm_malloc(bytes);
+    memset(payload, 0, bytes);
+    return payload;
+  }
+
+  if (mmap_threshold != 0 && req_size >= mmap_threshold &&
+      (block = mapped_malloc(req_size)) != NULL) {
+    fresh_start = NULL;
+  } else {
+    // As heap_malloc, but skipping the quick lists, whose blocks have been
+    // written.
+    arena = arena_for_thread();
+    arena_lock(arena);
+    block = find_free_block(req_size);
+    fresh_start = PROLOGUE->fresh_start;
+    remove_free_block(block);
+    place_block(block, SIZE(block->size_and_tags), req_size);
+    arena_unlock(arena);
+  }
+
+  count_malloc(SIZE(block->size_and_tags));
+
+  payload = UNSCALED_POINTER_ADD(block, TAG_SIZE);
+  if (fresh_start != NULL) {
+    // The canary is not part of the payload.
+    end = UNSCALED_POINTER_ADD(block, SIZE(block->size_and_tags) - CANARY_SIZE);
+    clear_end = (char*) UNSCALED_POINTER_ADD(block, sizeof(block_info));
+    if (fresh_start > clear_end) {
+      clear_end = fresh_start;
+    }
+    if (clear_end >= end) {
+      memset(payload, 0, end - payload);
+    } else {
+      memset(payload, 0, clear_end - payload);
+      memset(end - TAG_SIZE, 0, TAG_SIZE);
+    }
+  }
+  canary_set(block);
+  MM_MALLOC_HOOK(payload);
+  return payload;
+}
+
+
+/*
+ * Allocate n blocks of size bytes, store pointers to them in out, and return
+ * how many were allocated: n, fewer if the arena runs out of space (out then
+ * holds the first ones), or 0 if size or n is zero or the total size
+ * overflows.
+ *  - Heap blocks are carved one after another out of as few free blocks as
+ *    the free lists allow, under one lock: a free block that holds the rest
+ *    of the batch if there is one, else the first one that holds any. When
+ *    there is none, the heap grows by one block at a time (rounded up to
+ *    whole pages), not by the rest of the batch. They bypass the thread
+ *    cache.
+ *  - Slab objects are taken under one lock, and blocks that are directly
+ *    mapped are allocated one at a time.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void* out[]) {
+  size_t req_size;
+  size_t block_size;
+  size_t last_size;
+  size_t tags;
+  block_info* block;
+  int arena;
+  size_t i;
+  size_t j;
+  size_t k;
+
+  if (size == 0 || n == 0) {
+    return 0;
+  }
+
+  if (USE_SLABS && size <= SLAB_MAX_SIZE) {
+    arena = arena_for_thread();
+    arena_lock(arena);
+    for (i = 0; i < n; i++) {
+      // A new slab takes an aligned block (see heap_malloc_aligned).
+      if (PROLOGUE->slabs[(size - 1) / ALIGNMENT] == NULL &&
+          !can_find_free_block(request_size(SLAB_SIZE) + SLAB_SIZE + MIN_BLOCK_SIZE)) {
+        break;
+      }
+      out[i] = slab_malloc(size);
+    }
+    arena_unlock(arena);
+    n = i;
+    for (i = 0; i < n; i++) {
+      count_malloc(slab_of(out[i])->object_size);
+    }
+    return n;
+  }
+
+  req_size = request_size(size);
+  if (n > SIZE_MAX / req_size) {
+    return 0;
+  }
+  if (mmap_threshold != 0 && req_size >= mmap_threshold) {
+    for (i = 0; i < n; i++) {
+      out[i] = mm_malloc(size);
+    }
+    return n;
+  }
+
+  arena = arena_for_thread();
+  arena_lock(arena);
+  for (i = 0; i < n; i += k) {
+    block = search_free_list((n - i) * req_size);
+    if (block == NULL) {
+      block = search_free_list(req_size);
+    }
+    if (block == NULL) {
+      if (!can_find_free_block(req_size)) {
+        break;
+      }
+      block = find_free_block(req_size);
+    }
+    block_size = SIZE(block->size_and_tags);
+    k = block_size / req_size < n - i ? block_size / req_size : n - i;
+    remove_free_block(block);
+    place_block(block, block_size, k * req_size);
+
+    // Split the used space into k blocks. If the excess was too small to be
+    // split off, the last block keeps it.
+    last_size = SIZE(block->size_and_tags) - (k - 1) * req_size;
+    tags = block->size_and_tags & TAG_PRECEDING_USED;
+    for (j = 0; j < k; j++) {
+      block->size_and_tags = (j + 1 < k ? req_size : last_size) | tags | TAG_USED;
+      canary_set(block);
+      out[i + j] = UNSCALED_POINTER_ADD(block, TAG_SIZE);
+      block = (block_info*) UNSCALED_POINTER_ADD(block, req_size);
+      tags = TAG_PRECEDING_USED;
+    }
+  }
+  arena_unlock(arena);
+  n = i;
+
+  for (i = 0; i < n; i++) {
+    count_malloc(SIZE(((block_info*) UNSCALED_POINTER_SUB(out[i], TAG_SIZE))->size_and_tags));
+    MM_MALLOC_HOOK(out[i]);
+  }
+  return n;
+}
+
+
+/*
+ * Free the block referenced by ptr, which is not NULL. It is only looked up
+ * in the slab maps if may_be_slab is set.
+ */
+static inline void free_payload(void* ptr, int may_be_slab) {
+  block_info* block_to_free;
+  int arena;
+
+  // Point to start of the block (header)
+  block_to_free = (block_info*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+
+  // Directly mapped blocks are outside of all arenas.
+  arena = mem_arena_of(ptr);
+  if (arena < 0) {
+    check_used_block(ptr, -1);
+    count_free(SIZE(block_to_free->size_and_tags));
+    mapped_free(block_to_free);
+    return;
+  }
+
+  // Slab objects have no header, so check for them before reading one.
+  if (may_be_slab && slab_owns(arena, ptr)) {
+    count_free(slab_of(ptr)->object_size);
+    arena_lock(arena);
+    slab_free(ptr);
+    arena_unlock(arena);
+    sample_check(arena);
+    return;
+  }
+
+  check_used_block(ptr, arena);
+  canary_clear(block_to_free);
+  count_free(SIZE(block_to_free->size_and_tags));
+  if (THREAD_CACHE && SIZE(block_to_free->size_and_tags) <= TCACHE_MAX_SIZE) {
+    tcache_free(block_to_free);
+  } else {
+    arena = arena_of_block(block_to_free);
+    arena_lock(arena);
+    heap_free(block_to_free);
+    arena_unlock(arena);
+  }
+  sample_check(arena);
+}
+
+
+/* Free the block referenced by ptr. */
+void mm_free(void* ptr) {
+  if (ptr == NULL || MM_FREE_HOOK(ptr)) {
+    return;
+  }
+  free_payload(ptr, USE_SLABS);
+}
+
+
+/*
+ * Free the block referenced by ptr, which was allocated with size bytes (or
+ * last reallocated to them). A block of more than SLAB_MAX_SIZE bytes cannot
+ * be a slab object, so the slab map is not looked at.
+ */
+void mm_free_sized(void* ptr, size_t size) {
+  if (ptr == NULL || MM_FREE_HOOK(ptr)) {
+    return;
+  }
+  free_payload(ptr, USE_SLABS && size <= SLAB_MAX_SIZE);
+}
+
+
+/*
+ * Sort the n pointers in a by address: a quicksort on the middle element,
+ * with an insertion sort of short ranges, which does not go through a
+ * comparison function as qsort does.
+ */
+static void sort_pointers(void** a, size_t n) {
+  uintptr_t pivot;
+  void* tmp;
+  size_t i;
+  size_t j;
+
+  while (n > 16) {
+    pivot = (uintptr_t) a[n / 2];
+    i = 0;
+    j = n - 1;
+    for (;;) {
+      while ((uintptr_t) a[i] < pivot) {
+        i++;
+      }
+      while ((uintptr_t) a[j] > pivot) {
+        j--;
+      }
+      if (i >= j) {
+        break;
+      }
+      tmp = a[i];
+      a[i++] = a[j];
+      a[j--] = tmp;
+    }
+    // Recurse into the smaller part and loop on the larger one.
+    if (j + 1 < n - j - 1) {
+      sort_pointers(a, j + 1);
+      a += j + 1;
+      n -= j + 1;
+    } else {
+      sort_pointers(a + j + 1, n - j - 1);
+      n = j + 1;
+    }
+  }
+  for (i = 1; i < n; i++) {
+    tmp = a[i];
+    for (j = i; j > 0 && (uintptr_t) a[j - 1] > (uintptr_t) tmp; j--) {
+      a[j] = a[j - 1];
+    }
+    a[j] = tmp;
+  }
+}
+
+/*
+ * Free the n blocks referenced by ptrs (NULL entries are skipped), which are
+ * sorted by address in the process.
+ *  - Each arena is locked once for the run of its blocks.
+ *  - Heap blocks that are adjacent in memory are merged into one used block
+ *    first, which is then freed and coalesced with its neighbors once.
+ *  - Blocks bypass the thread cache.
+ */
+void mm_free_batch(void* ptrs[], size_t n) {
+  block_info* block;
+  block_info* run = NULL;
+  block_info* run_end = NULL;
+  int locked = -1;
+  int arena;
+  size_t i;
+
+  sort_pointers(ptrs, n);
+
+  for (i = 0; i < n; i++) {
+    if (ptrs[i] == NULL || MM_FREE_HOOK(ptrs[i])) {
+      continue;
+    }
+    block = (block_info*) UNSCALED_POINTER_SUB(ptrs[i], TAG_SIZE);
+
+    arena = mem_arena_of(ptrs[i]);
+    if (arena < 0) {
+      check_used_block(ptrs[i], -1);
+      count_free(SIZE(block->size_and_tags));
+      mapped_free(block);
+      continue;
+    }
+    // Arenas are ordered by address, so each is visited once.
+    if (arena != locked) {
+      if (run != NULL) {
+        heap_free(run);
+        run = NULL;
+      }
+      if (locked >= 0) {
+        arena_unlock(locked);
+      }
+      arena_lock(arena);
+      locked = arena;
+    }
+
+    if (USE_SLABS && slab_owns(arena, ptrs[i])) {
+      count_free(slab_of(ptrs[i])->object_size);
+      slab_free(ptrs[i]);
+      continue;
+    }
+
+    check_used_block(ptrs[i], arena);
+    canary_clear(block);
+    count_free(SIZE(block->size_and_tags));
+    if (block == run_end) {
+      // The run's header takes over the block; its tags stay the same.
+      run->size_and_tags += SIZE(block->size_and_tags);
+      canary_clear(run);
+    } else {
+      if (run != NULL) {
+        heap_free(run);
+      }
+      run = block;
+    }
+    run_end = (block_info*) UNSCALED_POINTER_ADD(run, SIZE(run->size_and_tags));
+  }
+
+  if (run != NULL) {
+    heap_free(run);
+  }
+  if (locked >= 0) {
+    arena_unlock(locked);
+    sample_check(locked);
+  }
+}
+
+
+/*
+ * Give free memory back to the system and return the number of bytes given
+ * back. Every arena is shrunk to keep at most about pad free bytes at its end,
+ * and the whole pages inside other free blocks are released. Blocks in the
+ * calling thread's cache are freed first; other threads' caches are kept.
+ */
+size_t mm_trim(size_t pad) {
+  size_t released = 0;
+  block_info* block;
+  thread_cache* tc;
+  int arena;
+  int bin;
+
+  if (THREAD_CACHE) {
+    tc = tcache_get();
+    for (bin = 0; bin < TCACHE_BINS; bin++) {
+      tcache_flush(tc, bin, tc->counts[bin]);
+    }
+  }
+
+  for (arena = 0; arena < mem_arena_count(); arena++) {
+    if (mem_arena_heapsize(arena) == 0) {
+      continue;
+    }
+    arena_lock(arena);
+    if (DEFERRED_COALESCE) {
+      quick_consolidate();
+    }
+    for (block = first_block(); SIZE(block->size_and_tags) != 0;
+         block = (block_info*) UNSCALED_POINTER_ADD(block, SIZE(block->size_and_tags))) {
+      if ((block->size_and_tags & TAG_USED) == 0) {
+        released += release_free_block(block, pad);
+      }
+    }
+    arena_unlock(arena);
+  }
+  return released;
+}
+
+
+/*
+ * Set the size of a free block at which mm_free gives its memory back to the
+ * system, as mm_trim does; 0 turns automatic trimming off.
+ */
+void mm_set_trim_threshold(size_t threshold) {
+  trim_threshold = threshold;
+}
+
+
+/*
+ * Set the block size from which mm_malloc maps blocks directly instead of
+ * carving them from the heap; 0 turns direct mapping off.
+ */
+void mm_set_mmap_threshold(size_t threshold) {
+  mmap_threshold = threshold;
+}
+
+
+/*
+ * A heap consistency checker: check every arena (see HEAP CHECKER above),
+ * report each problem on stderr, and return the number found. Blocks in
+ * other threads' caches are seen as used.
+ */
+int mm_check() {
+  int problems = 0;
+  int arena;
+
+  for (arena = 0; arena < mem_arena_count(); arena++) {
+    if (mem_arena_heapsize(arena) == 0) {
+      continue;
+    }
+    arena_lock(arena);
+    problems += check_arena();
+    arena_unlock(arena);
+  }
+  return problems;
+}
+
+
+/*
+ * Set how many frees of a thread pass between the checks of an arena that
+ * MM_HARDEN makes; 0 turns them off.
+ */
+void mm_set_check_interval(size_t interval) {
+  check_interval = interval;
+}
+
+
+
+// SNAPSHOTS --------------------------------------------------------
+//  - mm_snapshot writes the bytes of every arena, from its prologue to its
+//    brk, and the arena's slab map, after a header that records where the
+//    arenas were and how mm.c was built.
+//  - mm_restore maps the arenas back at the same addresses (mem_set_base).
+//    Since no address changes, the free-list links (plain pointers unless
+//    COMPACT_HEADERS is set) and the pointers the program stored in its
+//    blocks stay valid with no fixups.
+//  - A directly mapped block lies outside of the arenas, so there may be
+//    none when a snapshot is taken (mm_set_mmap_threshold(0) sees to that).
+//    Blocks that other threads hold in their caches stay used in the
+//    snapshot, and are lost.
+
+#define SNAPSHOT_MAGIC 0x746f687370616d6dULL  // "mmapshot"
+
+// The build configuration, which must be the same for a restore.
+#define SNAPSHOT_LAYOUT \
+  (((uint64_t) sizeof(heap_prologue) << 48) ^ ((uint64_t) sizeof(block_info) << 40) ^ \
+   ((uint64_t) ALIGNMENT << 32) ^ ((uint64_t) TREE_MIN_SIZE << 8) ^ \
+   ((uint64_t) FREE_LIST_POLICY << 4) ^ (COMPACT_HEADERS << 3) ^ \
+   (DEFERRED_COALESCE << 2) ^ (USE_SLABS << 1) ^ MM_HARDEN)
+
+struct snapshot_header {
+  uint64_t magic;
+  uint64_t layout;
+  uint64_t arenas;
+  uint64_t arena_span;
+  uint64_t base;          // address of arena 0
+  uint64_t root;
+  uint64_t canary_key;
+  uint64_t in_use_bytes;  // for mm_stats
+};
+
+// Written before the contents of each arena.
+struct snapshot_arena {
+  uint64_t heap_size;
+  uint64_t map_size;      // bytes of the slab map, 0 if none
+};
+
+/* Write all n bytes at buf to fd, returning 0, or -1 on an error. */
+static int write_all(int fd, const void* buf, size_t n) {
+  ssize_t done;
+
+  while (n > 0) {
+    done = write(fd, buf, n);
+    if (done <= 0) {
+      return -1;
+    }
+    buf = (const char*) buf + done;
+    n -= done;
+  }
+  return 0;
+}
+
+/* Read n bytes from fd into buf, returning 0, or -1 on an error or EOF. */
+static int read_all(int fd, void* buf, size_t n) {
+  ssize_t done;
+
+  while (n > 0) {
+    done = read(fd, buf, n);
+    if (done <= 0) {
+      return -1;
+    }
+    buf = (char*) buf + done;
+    n -= done;
+  }
+  return 0;
+}
+
+
+/*
+ * Write the heap to fd, with root as the pointer mm_restore gives back, and
+ * return 0, or -1 if a directly mapped block is in use or a write failed.
+ * No other thread may use the allocator meanwhile. The calling thread's
+ * cache is freed first.
+ */
+int mm_snapshot(int fd, void* root) {
+  struct snapshot_header header;
+  struct snapshot_arena sa;
+  struct mm_stats stats;
+  thread_cache* tc;
+  int arena;
+  int bin;
+  int result = 0;
+
+  if (__atomic_load_n(&mapped_blocks, __ATOMIC_RELAXED) != 0) {
+    return -1;
+  }
+  if (THREAD_CACHE) {
+    tc = tcache_get();
+    for (bin = 0; bin < TCACHE_BINS; bin++) {
+      tcache_flush(tc, bin, tc->counts[bin]);
+    }
+  }
+
+  header.magic = SNAPSHOT_MAGIC;
+  header.layout = SNAPSHOT_LAYOUT;
+  header.arenas = mem_arena_count();
+  header.arena_span = mem_max_heap();
+  header.base = (uintptr_t) mem_arena_lo(0);
+  header.root = (uintptr_t) root;
+  header.canary_key = canary_key;
+  header.in_use_bytes = 0;
+  if (MM_STATS) {
+    mm_stats(&stats);
+    header.in_use_bytes = stats.in_use_bytes;
+  }
+  if (write_all(fd, &header, sizeof(header)) != 0) {
+    return -1;
+  }
+
+  for (arena = 0; arena < mem_arena_count() && result == 0; arena++) {
+    sa.heap_size = mem_arena_heapsize(arena);
+    sa.map_size = sa.heap_size != 0 && slab_map[arena] != NULL ? slab_map_size[arena] : 0;
+    if (sa.heap_size != 0) {
+      arena_lock(arena);
+    }
+    if (write_all(fd, &sa, sizeof(sa)) != 0 ||
+        write_all(fd, mem_arena_lo(arena), sa.heap_size) != 0 ||
+        (sa.map_size != 0 && write_all(fd, slab_map[arena], sa.map_size) != 0)) {
+      result = -1;
+    }
+    if (sa.heap_size != 0) {
+      arena_unlock(arena);
+    }
+  }
+  return result;
+}
+
+
+/* Empty the first n arenas, and drop their slab maps. */
+static void empty_arenas(int n) {
+  int arena;
+
+  for (arena = 0; arena < n; arena++) {
+    if (mem_arena_heapsize(arena) != 0) {
+      mem_arena_sbrk(arena, -(intptr_t) mem_arena_heapsize(arena));
+    }
+    if (slab_map[arena] != NULL) {
+      mem_unmap(slab_map[arena], slab_map_size[arena]);
+      slab_map[arena] = NULL;
+    }
+  }
+}
+
+/*
+ * Replace the heap by the one mm_snapshot wrote to fd, and store the root
+ * passed to mm_snapshot in *root. Any blocks of the current heap are lost,
+ * as with mm_init, and mm_stats counts the snapshot's blocks in use instead.
+ * The memory model must have as many arenas of the same size, and mm.c the
+ * same build configuration. Returns 0 on success. Returns -1 in two cases:
+ *  - The header cannot be read, or does not match the memory model or the
+ *    build. The current heap is then left untouched.
+ *  - The snapshot's addresses are taken, or its arenas cannot be read in
+ *    full. The current heap is lost by then, and an empty heap (as from
+ *    mm_init) replaces it.
+ * No other thread may use the allocator meanwhile.
+ */
+int mm_restore(int fd, void** root) {
+  struct snapshot_header header;
+  struct snapshot_arena sa;
+  int restored;
+  int failed = 0;
+
+  if (read_all(fd, &header, sizeof(header)) != 0 ||
+      header.magic != SNAPSHOT_MAGIC || header.layout != SNAPSHOT_LAYOUT ||
+      header.arenas != (uint64_t) mem_arena_count() ||
+      header.arena_span != mem_max_heap()) {
+    return -1;
+  }
+  empty_arenas(mem_arena_count());
+  heap_generation++;
+  if (mem_set_base((void*) (uintptr_t) header.base) != 0) {
+    mm_init();
+    return -1;
+  }
+
+  // An arena that fails is left partly read, so count it as restored for
+  // empty_arenas.
+  for (restored = 0; restored < mem_arena_count() && !failed; restored++) {
+    if (read_all(fd, &sa, sizeof(sa)) != 0) {
+      failed = 1;
+    } else if (sa.heap_size != 0 &&
+               ((ssize_t) mem_arena_sbrk(restored, sa.heap_size) == -1 ||
+                read_all(fd, mem_arena_lo(restored), sa.heap_size) != 0)) {
+      failed = 1;
+    } else if (sa.map_size != 0) {
+      slab_map[restored] = (uint8_t*) mem_map(sa.map_size);
+      slab_map_size[restored] = sa.map_size;
+      if (slab_map[restored] == NULL || read_all(fd, slab_map[restored], sa.map_size) != 0) {
+        failed = 1;
+      }
+    }
+  }
+
+  // Start an empty heap if the snapshot could not be read in full.
+  if (failed) {
+    empty_arenas(restored);
+    mm_init();
+    return -1;
+  }
+
+  canary_key = header.canary_key;
+  if (MM_STATS) {
+    stats_set_in_use(header.in_use_bytes);
+  }
+  *root = (void*) (uintptr_t) header.root;
   return 0;
 }
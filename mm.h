@@ -3,9 +3,79 @@
 extern int mm_init(void);
 extern void* mm_malloc(size_t size);
 extern void mm_free(void* ptr);
+extern void* mm_memalign(size_t alignment, size_t size);
+extern void* mm_calloc(size_t nmemb, size_t size);
+
+// Allocate or free many blocks at once, amortizing the searches, locking and
+// coalescing. mm_free_sized takes the size the block was allocated with.
+extern size_t mm_malloc_batch(size_t size, size_t n, void* out[]);
+extern void mm_free_batch(void* ptrs[], size_t n);
+extern void mm_free_sized(void* ptr, size_t size);
+
+// Give free memory back to the system
+extern size_t mm_trim(size_t pad);
+extern void mm_set_trim_threshold(size_t threshold);
+extern void mm_set_mmap_threshold(size_t threshold);
+
+// Check the heap, printing each problem found and returning how many there
+// were. Built with MM_HARDEN, every interval-th free of a thread checks its
+// arena and aborts on a problem (0 turns this off).
+extern int mm_check(void);
+extern void mm_set_check_interval(size_t interval);
+
+// Write the heap to a file and read it back at the same addresses in a new
+// process, with a root pointer to find the program's data by.
+extern int mm_snapshot(int fd, void* root);
+extern int mm_restore(int fd, void** root);
+
+// Allocator statistics. The counters are kept as the allocator runs; the
+// free-space figures are measured by each call.
+#define MM_STATS_CLASSES 32
+
+struct mm_stats {
+  size_t in_use_bytes;   // bytes of the blocks the program holds
+  size_t free_bytes;     // bytes in the free lists of all arenas
+  size_t free_blocks;    // blocks in those lists
+  size_t largest_free;   // largest of them
+  size_t heap_size;      // bytes of all arenas (mem_heapsize() with one)
+  size_t sbrk_calls;     // times an arena was grown or shrunk
+  size_t splits;         // free blocks split to fit a request
+  size_t coalesces;      // free neighbours merged into a freed block
+  size_t searches;       // free-list searches
+  size_t search_steps;   // free blocks and tree nodes they looked at
+  // Blocks allocated and freed, by the size class of the block size. Class
+  // c holds blocks of at least class_min[c] bytes.
+  int num_classes;
+  size_t class_min[MM_STATS_CLASSES];
+  size_t mallocs[MM_STATS_CLASSES];
+  size_t frees[MM_STATS_CLASSES];
+};
+
+extern void mm_stats(struct mm_stats* stats);
+extern size_t mm_search_steps(void);
 
 // Extra credit
 extern void* mm_realloc(void* ptr, size_t size);
 
 // Garbage collector extra credit
 extern void mm_garbage_collect(void* rootPtrs[], int numRoots);
+
+// Incremental garbage collection: mm_gc_begin starts a collection, each
+// mm_gc_step does about budget_bytes of it, and mm_gc_finish completes it.
+// Between steps, pointers stored into heap blocks must go through
+// mm_gc_write.
+struct mm_gc_stats {
+  size_t slices;       // steps taken so far
+  double last_pause;   // seconds spent in the latest step
+  double max_pause;    // longest step
+  double total_pause;  // all steps, including mm_gc_begin
+};
+
+extern void mm_gc_begin(void* rootPtrs[], int numRoots);
+extern int mm_gc_step(size_t budget_bytes);
+extern void mm_gc_finish(void);
+extern void mm_gc_write(void** field, void* value);
+extern void mm_gc_get_stats(struct mm_gc_stats* stats);
+
+// Number of threads mm_garbage_collect marks and sweeps with (1 by default).
+extern void mm_gc_set_threads(int threads);
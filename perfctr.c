@@ -0,0 +1,118 @@
+/*
+ * perfctr.c - Count the hardware events caused by a function f
+ *
+ * Each event gets its own counter from perf_event_open, for the calling
+ * thread in user mode only (which perf_event_paranoid up to 2 allows).
+ * The counters are opened once, disabled, and are reset, enabled and
+ * read around the runs of each function. Events the kernel or the CPU
+ * does not support are left out of the results rather than failing.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfctr.h"
+
+/* perf_event_attr type and config of one event */
+typedef struct {
+    const char* name;
+    unsigned type;
+    unsigned long long config;
+} perfctr_event_t;
+
+/* Config of a PERF_TYPE_HW_CACHE read miss in the given cache */
+#define CACHE_READ_MISS(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/* In the order of the PERFCTR_ constants */
+static const perfctr_event_t events[PERFCTR_NUM_EVENTS] = {
+    { "cyc",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "ins",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "L1D",    PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    { "LLC",    PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL) },
+    { "dTLB",   PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    { "brmiss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+static int fds[PERFCTR_NUM_EVENTS];  /* counter of each event, or -1 */
+static int initialized = 0;
+
+/* The value of a counter, with the times it was enabled and running */
+typedef struct {
+    unsigned long long value;
+    unsigned long long time_enabled;
+    unsigned long long time_running;
+} perfctr_read_t;
+
+static int perf_event_open(struct perf_event_attr* attr) {
+  return (int) syscall(SYS_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+int init_perfctr(void) {
+  struct perf_event_attr attr;
+  int i, n = 0;
+
+  if (initialized) {
+    for (i = 0; i < PERFCTR_NUM_EVENTS; i++)
+      n += fds[i] >= 0;
+    return n;
+  }
+
+  for (i = 0; i < PERFCTR_NUM_EVENTS; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    fds[i] = perf_event_open(&attr);
+    n += fds[i] >= 0;
+  }
+  initialized = 1;
+  return n;
+}
+
+const char* perfctr_name(int event) {
+  return events[event].name;
+}
+
+void perfctr(perfctr_test_funct f, void* argp, int runs, perfctr_result_t* result) {
+  perfctr_read_t r;
+  int i;
+
+  if (!initialized)
+    init_perfctr();
+  if (runs < 1)
+    runs = 1;
+
+  f(argp);
+
+  for (i = 0; i < PERFCTR_NUM_EVENTS; i++)
+    if (fds[i] >= 0)
+      ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+  for (i = 0; i < PERFCTR_NUM_EVENTS; i++)
+    if (fds[i] >= 0)
+      ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+
+  for (i = 0; i < runs; i++)
+    f(argp);
+
+  for (i = 0; i < PERFCTR_NUM_EVENTS; i++)
+    if (fds[i] >= 0)
+      ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+  for (i = 0; i < PERFCTR_NUM_EVENTS; i++) {
+    result->count[i] = -1;
+    if (fds[i] < 0 || read(fds[i], &r, sizeof(r)) != sizeof(r) || r.time_running == 0)
+      continue;
+    /* Scale up a multiplexed count to the whole time it was enabled */
+    result->count[i] = (double) r.value * r.time_enabled / r.time_running / runs;
+  }
+}
@@ -0,0 +1,45 @@
+/*
+ * perfctr.h - prototypes for the routines in perfctr.c that count the
+ *     hardware events (cycles, cache and TLB misses, ...) caused by a
+ *     test function f, with perf_event_open
+ */
+
+/* The test function takes a generic pointer as input */
+typedef void (* perfctr_test_funct)(void*);
+
+/* The events counted */
+enum {
+    PERFCTR_CYCLES,        /* CPU cycles */
+    PERFCTR_INSTRUCTIONS,  /* instructions retired */
+    PERFCTR_L1D_MISSES,    /* L1 data cache read misses */
+    PERFCTR_LLC_MISSES,    /* last-level cache read misses */
+    PERFCTR_DTLB_MISSES,   /* data TLB read misses */
+    PERFCTR_BRANCH_MISSES, /* mispredicted branches */
+    PERFCTR_PAGE_FAULTS,   /* page faults (a software event) */
+    PERFCTR_NUM_EVENTS
+};
+
+/* The counts of one function, per run of it */
+typedef struct {
+    double count[PERFCTR_NUM_EVENTS]; /* < 0 if the event is unavailable */
+} perfctr_result_t;
+
+/*
+ * init_perfctr - Open a counter for each event (in user mode only), for
+ *     the calling thread. Returns the number of events that can be
+ *     counted, which is 0 where perf_event_open is not allowed or the
+ *     CPU's counters are not exposed, as in most virtual machines.
+ */
+int init_perfctr(void);
+
+/* Return the short name of the event, as a column heading */
+const char* perfctr_name(int event);
+
+/*
+ * perfctr - Run f(argp) once to warm up, then runs times with the counters
+ *     enabled, and fill in *result with the counts per run. The counters
+ *     are not grouped, so when there are more events than the CPU has
+ *     counters the kernel multiplexes them, and each count is scaled up
+ *     from the time its counter was running.
+ */
+void perfctr(perfctr_test_funct f, void* argp, int runs, perfctr_result_t* result);
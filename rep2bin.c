@@ -0,0 +1,424 @@
+/*
+ * rep2bin.c - Convert a text (.rep) trace, or an event log recorded by
+ *     libmmpreload.so, into a binary trace
+ *
+ * usage: rep2bin <in.rep | in.log> <out.bin>
+ *
+ * The binary format (see tracefmt.h) is what mdriver maps and replays in
+ * place. A text trace is converted in one pass that streams through it, so
+ * it needs no more memory for a large trace than for a small one.
+ *
+ * An event log names blocks by address and holds the events of each
+ * thread in chunks, so its conversion merges the chunks into the order of
+ * the sequence numbers and assigns ids to addresses as it goes. Ids are
+ * reused once their block is freed, so num_ids is the peak number of live
+ * blocks. A log may not match a trace exactly:
+ *  - Frees of blocks allocated before recording began are dropped.
+ *  - An allocation at an address that is still live means the previous
+ *    block's free was lost (e.g. at exit); it is freed first.
+ *  - A size of zero is replayed as one byte, since mm_malloc(0) returns
+ *    NULL, which mdriver takes for a failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE 1024
+
+/* Maps block addresses to ids, by open addressing; address 0 is a free slot */
+typedef struct {
+    uint64_t* addrs;
+    int32_t* ids;
+    size_t mask;     /* number of slots - 1, a power of two minus 1 */
+    size_t count;    /* addresses in the table */
+} addr_table_t;
+
+/* The unmerged rest of one chunk of an event log */
+typedef struct {
+    tracefmt_event_t* next;
+    tracefmt_event_t* end;
+} chunk_cursor_t;
+
+static char* out_path;
+static FILE* out;
+static tracefmt_header_t header;
+
+static void* xmalloc(size_t size) {
+  void* p = malloc(size);
+
+  if (p == NULL) {
+    fprintf(stderr, "rep2bin: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static void write_header() {
+  if (fseek(out, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(header), 1, out) != 1) {
+    fprintf(stderr, "rep2bin: could not write %s\n", out_path);
+    exit(1);
+  }
+}
+
+static void write_op(int type, int index, int size) {
+  tracefmt_op_t op;
+
+  op.type = type;
+  op.index = index;
+  op.size = size;
+  if (fwrite(&op, sizeof(op), 1, out) != 1) {
+    fprintf(stderr, "rep2bin: could not write %s\n", out_path);
+    exit(1);
+  }
+  header.num_ops++;
+}
+
+/*
+ * convert_rep - convert the text trace in, whose header has been read
+ */
+static void convert_rep(FILE* in, char* in_path) {
+  char type[MAXLINE];
+  unsigned index, size;
+  int claimed_ops = header.num_ops;
+
+  header.num_ops = 0;
+  write_header();
+  while (fscanf(in, "%s", type) != EOF) {
+    size = 0;
+    switch (type[0]) {
+      case 'a':
+        if (fscanf(in, "%u %u", &index, &size) != 2)
+          goto bogus;
+        write_op(TRACEFMT_ALLOC, index, size);
+        break;
+      case 'r':
+        if (fscanf(in, "%u %u", &index, &size) != 2)
+          goto bogus;
+        write_op(TRACEFMT_REALLOC, index, size);
+        break;
+      case 'f':
+        if (fscanf(in, "%u", &index) != 1)
+          goto bogus;
+        write_op(TRACEFMT_FREE, index, 0);
+        break;
+      default:
+        goto bogus;
+    }
+  }
+  if (header.num_ops != claimed_ops) {
+    fprintf(stderr, "rep2bin: %s claims %d requests but has %d\n",
+            in_path, claimed_ops, header.num_ops);
+  }
+  return;
+
+bogus:
+  fprintf(stderr, "rep2bin: bogus request %d (%s) in %s\n",
+          header.num_ops, type, in_path);
+  exit(1);
+}
+
+/*
+ * The address table
+ */
+static size_t addr_slot(addr_table_t* table, uint64_t addr) {
+  return (size_t) ((addr >> 3) * 0x9E3779B97F4A7C15ull >> 17) & table->mask;
+}
+
+static void addr_init(addr_table_t* table, size_t slots) {
+  table->addrs = (uint64_t*) xmalloc(slots * sizeof(uint64_t));
+  table->ids = (int32_t*) xmalloc(slots * sizeof(int32_t));
+  memset(table->addrs, 0, slots * sizeof(uint64_t));
+  table->mask = slots - 1;
+  table->count = 0;
+}
+
+static void addr_put(addr_table_t* table, uint64_t addr, int32_t id);
+
+/* Double the number of slots, keeping the table at most half full */
+static void addr_grow(addr_table_t* table) {
+  uint64_t* addrs = table->addrs;
+  int32_t* ids = table->ids;
+  size_t slots = table->mask + 1;
+  size_t i;
+
+  addr_init(table, 2 * slots);
+  for (i = 0; i < slots; i++) {
+    if (addrs[i] != 0)
+      addr_put(table, addrs[i], ids[i]);
+  }
+  free(addrs);
+  free(ids);
+}
+
+/* Map addr, which is not in the table, to id */
+static void addr_put(addr_table_t* table, uint64_t addr, int32_t id) {
+  size_t i;
+
+  if (2 * (table->count + 1) > table->mask + 1)
+    addr_grow(table);
+  for (i = addr_slot(table, addr); table->addrs[i] != 0; i = (i + 1) & table->mask)
+    ;
+  table->addrs[i] = addr;
+  table->ids[i] = id;
+  table->count++;
+}
+
+/*
+ * addr_take - remove addr from the table and return its id, or -1 if it
+ *     is not there. The slots after it are shifted back, so that no probe
+ *     sequence has a gap.
+ */
+static int32_t addr_take(addr_table_t* table, uint64_t addr) {
+  size_t i, j, home;
+  int32_t id;
+
+  for (i = addr_slot(table, addr); table->addrs[i] != addr; i = (i + 1) & table->mask) {
+    if (table->addrs[i] == 0)
+      return -1;
+  }
+  id = table->ids[i];
+  table->count--;
+
+  for (j = (i + 1) & table->mask; table->addrs[j] != 0; j = (j + 1) & table->mask) {
+    home = addr_slot(table, table->addrs[j]);
+    /* the entry at j may move to i if i lies on its probe path */
+    if (((j - home) & table->mask) >= ((j - i) & table->mask)) {
+      table->addrs[i] = table->addrs[j];
+      table->ids[i] = table->ids[j];
+      i = j;
+    }
+  }
+  table->addrs[i] = 0;
+  return id;
+}
+
+/*
+ * The heap of chunk cursors, ordered by the sequence number of their next
+ * event
+ */
+static void cursor_sift_down(chunk_cursor_t* heap, size_t n, size_t i) {
+  chunk_cursor_t c = heap[i];
+  size_t child;
+
+  while ((child = 2 * i + 1) < n) {
+    if (child + 1 < n && heap[child + 1].next->seq < heap[child].next->seq)
+      child++;
+    if (heap[child].next->seq >= c.next->seq)
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = c;
+}
+
+/* Ids of freed blocks, for reuse */
+static int32_t* free_ids;
+static size_t num_free_ids;
+static size_t free_ids_size;
+
+static int32_t new_id() {
+  return num_free_ids > 0 ? free_ids[--num_free_ids] : header.num_ids++;
+}
+
+static void free_id(int32_t id) {
+  if (num_free_ids == free_ids_size) {
+    free_ids_size = free_ids_size ? 2 * free_ids_size : 1024;
+    if ((free_ids = (int32_t*) realloc(free_ids, free_ids_size * sizeof(int32_t))) == NULL) {
+      fprintf(stderr, "rep2bin: out of memory\n");
+      exit(1);
+    }
+  }
+  free_ids[num_free_ids++] = id;
+}
+
+/* Free the live block at addr, if any, because a new one was put there */
+static long free_stale(addr_table_t* live, uint64_t addr) {
+  int32_t id = addr_take(live, addr);
+
+  if (id < 0)
+    return 0;
+  write_op(TRACEFMT_FREE, id, 0);
+  free_id(id);
+  return 1;
+}
+
+static int event_size(tracefmt_event_t* event) {
+  if (event->size == 0)
+    return 1;
+  return event->size > INT32_MAX ? INT32_MAX : (int) event->size;
+}
+
+/*
+ * convert_events - convert the event log in_path
+ */
+static void convert_events(char* in_path) {
+  addr_table_t live;        /* live blocks */
+  addr_table_t resizing;    /* blocks given up by a realloc still in progress */
+  chunk_cursor_t* heap = NULL;
+  chunk_cursor_t cursor;
+  tracefmt_event_t* event;
+  int32_t id;
+  size_t heap_size = 0;
+  size_t n = 0;
+  size_t i;
+  long dropped = 0;
+  long stale = 0;
+  struct stat st;
+  char* map;
+  char* p;
+  char* end;
+  int fd;
+
+  if ((fd = open(in_path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "rep2bin: could not open %s\n", in_path);
+    exit(1);
+  }
+  map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "rep2bin: could not map %s\n", in_path);
+    exit(1);
+  }
+  end = map + st.st_size;
+
+  /* Find the chunks; a log cut short ends with a partial one */
+  for (p = map + TRACEFMT_MAGIC_LEN; p + sizeof(tracefmt_chunk_t) <= end; p = (char*) cursor.end) {
+    cursor.next = (tracefmt_event_t*) (p + sizeof(tracefmt_chunk_t));
+    if (((tracefmt_chunk_t*) p)->num_events > (end - (char*) cursor.next) / sizeof(tracefmt_event_t)) {
+      fprintf(stderr, "rep2bin: %s is cut short\n", in_path);
+      cursor.end = cursor.next + (end - (char*) cursor.next) / sizeof(tracefmt_event_t);
+      p = end;
+    } else {
+      cursor.end = cursor.next + ((tracefmt_chunk_t*) p)->num_events;
+    }
+    if (cursor.next == cursor.end)
+      continue;
+    if (n == heap_size) {
+      heap_size = heap_size ? 2 * heap_size : 64;
+      if ((heap = (chunk_cursor_t*) realloc(heap, heap_size * sizeof(chunk_cursor_t))) == NULL) {
+        fprintf(stderr, "rep2bin: out of memory\n");
+        exit(1);
+      }
+    }
+    heap[n++] = cursor;
+    if (p == end)
+      break;
+  }
+  for (i = n; i-- > 0;)
+    cursor_sift_down(heap, n, i);
+
+  addr_init(&live, 1024);
+  addr_init(&resizing, 64);
+  header.num_ids = 0;
+  header.num_ops = 0;
+  header.weight = 1;
+  write_header();
+
+  while (n > 0) {
+    event = heap[0].next++;
+    if (heap[0].next == heap[0].end)
+      heap[0] = heap[--n];
+    if (n > 0)
+      cursor_sift_down(heap, n, 0);
+
+    switch (event->type) {
+      case TRACEFMT_ALLOC:
+        stale += free_stale(&live, event->ptr);
+        id = new_id();
+        addr_put(&live, event->ptr, id);
+        write_op(TRACEFMT_ALLOC, id, event_size(event));
+        break;
+      case TRACEFMT_FREE:
+        if ((id = addr_take(&live, event->ptr)) < 0) {
+          dropped++;
+          break;
+        }
+        write_op(TRACEFMT_FREE, id, 0);
+        free_id(id);
+        break;
+      case TRACEFMT_REALLOC_FROM:
+        if ((id = addr_take(&live, event->old_ptr)) >= 0)
+          addr_put(&resizing, event->old_ptr, id);
+        break;
+      case TRACEFMT_REALLOC:
+        id = addr_take(&resizing, event->old_ptr);
+        if (event->ptr == 0) {
+          /* a failed realloc keeps the old block */
+          if (id >= 0)
+            addr_put(&live, event->old_ptr, id);
+          break;
+        }
+        stale += free_stale(&live, event->ptr);
+        if (id >= 0) {
+          write_op(TRACEFMT_REALLOC, id, event_size(event));
+        } else {
+          /* the old block was allocated before recording began */
+          id = new_id();
+          write_op(TRACEFMT_ALLOC, id, event_size(event));
+        }
+        addr_put(&live, event->ptr, id);
+        break;
+      default:
+        fprintf(stderr, "rep2bin: bogus event type %u in %s\n", event->type, in_path);
+        exit(1);
+    }
+  }
+
+  if (dropped > 0)
+    fprintf(stderr, "rep2bin: dropped %ld frees of blocks allocated before recording\n", dropped);
+  if (stale > 0)
+    fprintf(stderr, "rep2bin: freed %ld blocks whose free was not recorded\n", stale);
+  free(heap);
+  munmap(map, st.st_size);
+}
+
+int main(int argc, char** argv) {
+  FILE* in;
+  char magic[TRACEFMT_MAGIC_LEN];
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <in.rep | in.log> <out.bin>\n", argv[0]);
+    exit(1);
+  }
+  if ((in = fopen(argv[1], "r")) == NULL) {
+    fprintf(stderr, "rep2bin: could not open %s\n", argv[1]);
+    exit(1);
+  }
+  out_path = argv[2];
+  if ((out = fopen(out_path, "wb")) == NULL) {
+    fprintf(stderr, "rep2bin: could not create %s\n", out_path);
+    exit(1);
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACEFMT_MAGIC, TRACEFMT_MAGIC_LEN);
+  if (fread(magic, 1, TRACEFMT_MAGIC_LEN, in) == TRACEFMT_MAGIC_LEN &&
+      memcmp(magic, TRACEFMT_EVENT_MAGIC, TRACEFMT_MAGIC_LEN) == 0) {
+    fclose(in);
+    convert_events(argv[1]);
+  } else {
+    rewind(in);
+    if (fscanf(in, "%d %d %d %d", &header.sugg_heapsize, &header.num_ids,
+               &header.num_ops, &header.weight) != 4) {
+      fprintf(stderr, "rep2bin: %s has no trace header\n", argv[1]);
+      exit(1);
+    }
+    convert_rep(in, argv[1]);
+    fclose(in);
+  }
+
+  /* Record the number of requests (and ids) actually converted */
+  write_header();
+  if (fclose(out) != 0) {
+    fprintf(stderr, "rep2bin: could not write %s\n", out_path);
+    exit(1);
+  }
+  return 0;
+}
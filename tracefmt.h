@@ -0,0 +1,62 @@
+/*
+ * tracefmt.h - Binary trace file format
+ *
+ * A binary trace holds the same requests as a text (.rep) trace, but in a
+ * form that mdriver can memory-map and replay in place, without parsing:
+ * a tracefmt_header_t followed by an array of fixed-width tracefmt_op_t
+ * records. All fields are in the byte order of the machine that wrote the
+ * trace; a reader on a machine of the other byte order will not recognize
+ * the magic string.
+ *
+ * The trace recorder (mm-preload.c) writes an event log instead, which
+ * rep2bin turns into a binary trace: TRACEFMT_EVENT_MAGIC followed by
+ * chunks, each a tracefmt_chunk_t and its tracefmt_event_t records. Each
+ * chunk comes from one thread and is in order, but chunks of different
+ * threads interleave arbitrarily; the global order of the events is that
+ * of their sequence numbers. Events name blocks by address, not by id.
+ */
+#ifndef __TRACEFMT_H_
+#define __TRACEFMT_H_
+
+#include <stdint.h>
+
+#define TRACEFMT_MAGIC "MMTRACE1"
+#define TRACEFMT_MAGIC_LEN 8
+
+/* Request types */
+#define TRACEFMT_ALLOC 0
+#define TRACEFMT_FREE 1
+#define TRACEFMT_REALLOC 2
+/* Event only: a realloc gave up old_ptr (followed by its TRACEFMT_REALLOC) */
+#define TRACEFMT_REALLOC_FROM 3
+
+typedef struct {
+    char magic[TRACEFMT_MAGIC_LEN]; /* TRACEFMT_MAGIC, not NUL-terminated */
+    int32_t sugg_heapsize;  /* suggested heap size (unused) */
+    int32_t num_ids;        /* number of alloc ids, or 0 if unknown */
+    int32_t num_ops;        /* number of requests, or 0 to use the file size */
+    int32_t weight;         /* weight for this trace (unused) */
+} tracefmt_header_t;
+
+typedef struct {
+    int32_t type;           /* TRACEFMT_ALLOC, TRACEFMT_FREE or TRACEFMT_REALLOC */
+    int32_t index;          /* id of the block */
+    int32_t size;           /* byte size of alloc/realloc request */
+} tracefmt_op_t;
+
+#define TRACEFMT_EVENT_MAGIC "MMEVENT1"
+
+typedef struct {
+    uint32_t num_events;    /* number of tracefmt_event_t records that follow */
+    uint32_t reserved;
+} tracefmt_chunk_t;
+
+typedef struct {
+    uint64_t seq;           /* position of the event in the global order */
+    uint64_t ptr;           /* block allocated or freed (realloc: new block) */
+    uint64_t old_ptr;       /* realloc: the block that was resized */
+    uint32_t type;          /* TRACEFMT_ALLOC, _FREE, _REALLOC or _REALLOC_FROM */
+    uint32_t size;          /* byte size of alloc/realloc request, saturated */
+} tracefmt_event_t;
+
+#endif /* __TRACEFMT_H_ */
@@ -0,0 +1,357 @@
+/*
+ * tracegen.c - Generate a synthetic binary trace from a workload model
+ *
+ * usage: tracegen [-n <ops>] [-l <live>] [-s <sizes>] [-t <lifetimes>]
+ *                 [-r <frac>] [-S <seed>] <out.bin>
+ *
+ * Each request either frees the block that is due to die, resizes a live
+ * block (a fraction -r of requests) or allocates a new block, whose size
+ * is drawn from the size distribution and whose lifetime, counted in
+ * requests, from the lifetime distribution. A block's lifetime is cut
+ * short when the live set would exceed -l blocks. After the -n requests,
+ * the blocks still live are freed.
+ *
+ * Distributions are given as name:param:param...
+ *   uniform:MIN:MAX    MIN to MAX, uniformly
+ *   lognormal:MED:SIG  log-normal with median MED and log-sigma SIG
+ *   bimodal:A:B:P      A with probability P, otherwise B
+ *   exp:MEAN           exponential with mean MEAN (lifetimes only)
+ *   hist:FILE          (sizes only) lines of "size weight" in FILE
+ *
+ * The trace is written as it is generated and the generator keeps only
+ * the live set, so traces of 10^8 and more requests are fine.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE 1024
+#define OUT_BUFFER_OPS 4096
+
+typedef enum { DIST_UNIFORM, DIST_LOGNORMAL, DIST_BIMODAL, DIST_EXP, DIST_HIST } dist_kind_t;
+
+/* A distribution parsed from its name:param... spec */
+typedef struct {
+    dist_kind_t kind;
+    double a, b, p;
+    double* values;   /* DIST_HIST: the sizes ... */
+    double* cumul;    /* ... and their cumulative weights */
+    int num_values;
+} dist_t;
+
+/* A live block, in the heap ordered by the request at which it dies */
+typedef struct {
+    uint64_t death;
+    int32_t id;
+} live_t;
+
+static uint64_t rng_state = 88172645463325252ull;
+static FILE* out;
+static char* out_path;
+static tracefmt_header_t header;
+static tracefmt_op_t out_buffer[OUT_BUFFER_OPS];
+static int out_count;
+
+static void usage(void) {
+  fprintf(stderr, "usage: tracegen [-n <ops>] [-l <live>] [-s <sizes>] [-t <lifetimes>]\n");
+  fprintf(stderr, "                [-r <frac>] [-S <seed>] <out.bin>\n");
+  fprintf(stderr, "\t-n <ops>        Number of requests before the final frees (100000).\n");
+  fprintf(stderr, "\t-l <live>       Maximum number of live blocks (1000).\n");
+  fprintf(stderr, "\t-s <sizes>      Size distribution (lognormal:64:1.5).\n");
+  fprintf(stderr, "\t-t <lifetimes>  Lifetime distribution, in requests (exp:1000).\n");
+  fprintf(stderr, "\t-r <frac>       Fraction of requests that are reallocs (0).\n");
+  fprintf(stderr, "\t-S <seed>       Random seed (1).\n");
+  fprintf(stderr, "Distributions: uniform:MIN:MAX, lognormal:MEDIAN:SIGMA, bimodal:A:B:P,\n");
+  fprintf(stderr, "               exp:MEAN (lifetimes), hist:FILE (sizes)\n");
+  exit(1);
+}
+
+/*
+ * Random numbers (xorshift64*), reproducible for a given seed
+ */
+static double uniform01(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return ((rng_state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double normal01(void) {
+  double u = uniform01();
+
+  return sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * uniform01());
+}
+
+static void read_hist(dist_t* dist, char* path) {
+  FILE* f;
+  double size, weight, total = 0;
+  int size_values = 0;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "tracegen: could not open %s\n", path);
+    exit(1);
+  }
+  dist->num_values = 0;
+  dist->values = dist->cumul = NULL;
+  while (fscanf(f, "%lf %lf", &size, &weight) == 2) {
+    if (size < 1 || weight < 0) {
+      fprintf(stderr, "tracegen: bogus line %d in %s\n", dist->num_values + 1, path);
+      exit(1);
+    }
+    if (dist->num_values == size_values) {
+      size_values = size_values ? 2 * size_values : 64;
+      dist->values = (double*) realloc(dist->values, size_values * sizeof(double));
+      dist->cumul = (double*) realloc(dist->cumul, size_values * sizeof(double));
+      if (dist->values == NULL || dist->cumul == NULL) {
+        fprintf(stderr, "tracegen: out of memory\n");
+        exit(1);
+      }
+    }
+    total += weight;
+    dist->values[dist->num_values] = size;
+    dist->cumul[dist->num_values++] = total;
+  }
+  fclose(f);
+  if (total <= 0) {
+    fprintf(stderr, "tracegen: %s has no weights\n", path);
+    exit(1);
+  }
+}
+
+static void parse_dist(dist_t* dist, char* spec, int is_size) {
+  char name[MAXLINE];
+  char* params = strchr(spec, ':');
+  int n;
+
+  if (params == NULL || params - spec >= MAXLINE)
+    goto bogus;
+  memcpy(name, spec, params - spec);
+  name[params - spec] = '\0';
+  params++;
+
+  if (strcmp(name, "uniform") == 0) {
+    dist->kind = DIST_UNIFORM;
+    n = sscanf(params, "%lf:%lf", &dist->a, &dist->b) == 2 && dist->a <= dist->b;
+  } else if (strcmp(name, "lognormal") == 0) {
+    dist->kind = DIST_LOGNORMAL;
+    n = sscanf(params, "%lf:%lf", &dist->a, &dist->b) == 2 && dist->a > 0;
+  } else if (strcmp(name, "bimodal") == 0) {
+    dist->kind = DIST_BIMODAL;
+    n = sscanf(params, "%lf:%lf:%lf", &dist->a, &dist->b, &dist->p) == 3;
+  } else if (strcmp(name, "exp") == 0 && !is_size) {
+    dist->kind = DIST_EXP;
+    n = sscanf(params, "%lf", &dist->a) == 1 && dist->a > 0;
+  } else if (strcmp(name, "hist") == 0 && is_size) {
+    dist->kind = DIST_HIST;
+    read_hist(dist, params);
+    n = 1;
+  } else {
+    n = 0;
+  }
+  if (n)
+    return;
+
+bogus:
+  fprintf(stderr, "tracegen: bogus %s distribution %s\n", is_size ? "size" : "lifetime", spec);
+  usage();
+}
+
+/* Draw from dist, rounded to an integer of at least 1 and at most max */
+static uint64_t sample(dist_t* dist, double max) {
+  double x;
+  int lo, hi, mid;
+
+  switch (dist->kind) {
+    case DIST_UNIFORM:
+      x = dist->a + (dist->b - dist->a + 1) * uniform01();
+      break;
+    case DIST_LOGNORMAL:
+      x = dist->a * exp(dist->b * normal01());
+      break;
+    case DIST_BIMODAL:
+      x = uniform01() < dist->p ? dist->a : dist->b;
+      break;
+    case DIST_EXP:
+      x = -dist->a * log(1.0 - uniform01());
+      break;
+    default: /* DIST_HIST */
+      x = uniform01() * dist->cumul[dist->num_values - 1];
+      lo = 0;
+      hi = dist->num_values - 1;
+      while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (dist->cumul[mid] <= x)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      x = dist->values[lo];
+      break;
+  }
+  if (x < 1)
+    return 1;
+  return x > max ? (uint64_t) max : (uint64_t) x;
+}
+
+/*
+ * Output
+ */
+static void flush_ops(void) {
+  if (fwrite(out_buffer, sizeof(tracefmt_op_t), out_count, out) != (size_t) out_count) {
+    fprintf(stderr, "tracegen: could not write %s\n", out_path);
+    exit(1);
+  }
+  out_count = 0;
+}
+
+static void emit(int type, int32_t id, uint64_t size) {
+  out_buffer[out_count].type = type;
+  out_buffer[out_count].index = id;
+  out_buffer[out_count].size = (int32_t) size;
+  if (++out_count == OUT_BUFFER_OPS)
+    flush_ops();
+  header.num_ops++;
+}
+
+static void write_header(void) {
+  if (fseek(out, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(header), 1, out) != 1) {
+    fprintf(stderr, "tracegen: could not write %s\n", out_path);
+    exit(1);
+  }
+}
+
+/*
+ * The live set: a binary heap by time of death
+ */
+static void live_sift_up(live_t* heap, int i) {
+  live_t x = heap[i];
+
+  while (i > 0 && heap[(i - 1) / 2].death > x.death) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = x;
+}
+
+static void live_sift_down(live_t* heap, int n, int i) {
+  live_t x = heap[i];
+  int child;
+
+  while ((child = 2 * i + 1) < n) {
+    if (child + 1 < n && heap[child + 1].death < heap[child].death)
+      child++;
+    if (heap[child].death >= x.death)
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = x;
+}
+
+int main(int argc, char** argv) {
+  dist_t sizes, lifetimes;
+  live_t* heap;
+  int32_t* free_ids;
+  int num_free_ids = 0;
+  int num_live = 0;
+  long long num_ops = 100000;
+  long long t;
+  int max_live = 1000;
+  double realloc_frac = 0;
+  unsigned long long seed = 1;
+  char* size_spec = "lognormal:64:1.5";
+  char* lifetime_spec = "exp:1000";
+  int32_t id;
+  int c, i;
+
+  while ((c = getopt(argc, argv, "n:l:s:t:r:S:h")) != EOF) {
+    switch (c) {
+      case 'n':
+        num_ops = atoll(optarg);
+        break;
+      case 'l':
+        max_live = atoi(optarg);
+        break;
+      case 's':
+        size_spec = optarg;
+        break;
+      case 't':
+        lifetime_spec = optarg;
+        break;
+      case 'r':
+        realloc_frac = atof(optarg);
+        break;
+      case 'S':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind != argc - 1 || max_live < 1 || num_ops < 0 || realloc_frac < 0 || realloc_frac > 1)
+    usage();
+  /* The final frees count too, and the trace stores ops as an int */
+  if (num_ops + max_live > INT32_MAX) {
+    fprintf(stderr, "tracegen: at most %d requests\n", INT32_MAX - max_live);
+    exit(1);
+  }
+  parse_dist(&sizes, size_spec, 1);
+  parse_dist(&lifetimes, lifetime_spec, 0);
+  for (i = 0; i < 16; i++) /* spread the seed over the whole state */
+    rng_state = rng_state * 6364136223846793005ull + seed;
+  if (rng_state == 0)
+    rng_state = 1;
+
+  out_path = argv[optind];
+  if ((out = fopen(out_path, "wb")) == NULL) {
+    fprintf(stderr, "tracegen: could not create %s\n", out_path);
+    exit(1);
+  }
+  heap = (live_t*) malloc(max_live * sizeof(live_t));
+  free_ids = (int32_t*) malloc(max_live * sizeof(int32_t));
+  if (heap == NULL || free_ids == NULL) {
+    fprintf(stderr, "tracegen: out of memory\n");
+    exit(1);
+  }
+  memcpy(header.magic, TRACEFMT_MAGIC, TRACEFMT_MAGIC_LEN);
+  header.weight = 1;
+  write_header();
+
+  for (t = 0; t < num_ops; t++) {
+    if (num_live > 0 && (heap[0].death <= (uint64_t) t || num_live == max_live)) {
+      free_ids[num_free_ids++] = heap[0].id;
+      emit(TRACEFMT_FREE, heap[0].id, 0);
+      heap[0] = heap[--num_live];
+      live_sift_down(heap, num_live, 0);
+    } else if (num_live > 0 && uniform01() < realloc_frac) {
+      i = (int) (uniform01() * num_live);
+      emit(TRACEFMT_REALLOC, heap[i].id, sample(&sizes, INT32_MAX));
+    } else {
+      id = num_free_ids > 0 ? free_ids[--num_free_ids] : header.num_ids++;
+      emit(TRACEFMT_ALLOC, id, sample(&sizes, INT32_MAX));
+      heap[num_live].id = id;
+      heap[num_live].death = t + sample(&lifetimes, 1e18);
+      live_sift_up(heap, num_live++);
+    }
+  }
+
+  /* Free what is left, in order of death */
+  while (num_live > 0) {
+    emit(TRACEFMT_FREE, heap[0].id, 0);
+    heap[0] = heap[--num_live];
+    live_sift_down(heap, num_live, 0);
+  }
+  flush_ops();
+  write_header();
+  if (fclose(out) != 0) {
+    fprintf(stderr, "tracegen: could not write %s\n", out_path);
+    exit(1);
+  }
+  return 0;
+}